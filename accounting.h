@@ -0,0 +1,359 @@
+#pragma once
+
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+#include <fcntl.h>
+#include <optional>
+#include <poll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "error.h"
+
+struct ResourceUsage
+{
+	qint64 wallUs = 0;
+	qint64 userUs = 0;
+	qint64 systemUs = 0;
+	qint64 maxRssBytes = 0;
+	qint64 readBytes = 0;
+	qint64 writeBytes = 0;
+	// Counted by a cgroup, so it covers every process the phase started
+	// rather than only those it waited for.
+	bool cgroup = false;
+};
+
+auto UsageFromRusage(const struct rusage &usage) -> ResourceUsage
+{
+	auto us = [](const struct timeval &tv) { return qint64(tv.tv_sec) * 1000000 + tv.tv_usec; };
+	return ResourceUsage{
+		.userUs = us(usage.ru_utime),
+		.systemUs = us(usage.ru_stime),
+		.maxRssBytes = qint64(usage.ru_maxrss) * 1024,
+		// Blocks of 512 bytes that actually hit the disk.
+		.readBytes = qint64(usage.ru_inblock) * 512,
+		.writeBytes = qint64(usage.ru_oublock) * 512,
+	};
+}
+
+auto UsageToJson(const ResourceUsage &usage) -> QJsonObject
+{
+	return QJsonObject{
+		{"wall_us", usage.wallUs},
+		{"user_us", usage.userUs},
+		{"system_us", usage.systemUs},
+		{"max_rss_bytes", usage.maxRssBytes},
+		{"read_bytes", usage.readBytes},
+		{"write_bytes", usage.writeBytes},
+		{"cgroup", usage.cgroup},
+	};
+}
+
+auto UsageFromJson(const QJsonObject &json) -> ResourceUsage
+{
+	return ResourceUsage{
+		.wallUs = json["wall_us"].toInteger(),
+		.userUs = json["user_us"].toInteger(),
+		.systemUs = json["system_us"].toInteger(),
+		.maxRssBytes = json["max_rss_bytes"].toInteger(),
+		.readBytes = json["read_bytes"].toInteger(),
+		.writeBytes = json["write_bytes"].toInteger(),
+		.cgroup = json["cgroup"].toBool(),
+	};
+}
+
+// A child cgroup for one phase under a delegated cgroup v2 directory, which
+// must not hold processes itself so the memory and io controllers can be
+// enabled for its children. Removed when destroyed.
+class PhaseCgroup
+{
+	QString path;
+	int fd = -1;
+
+	auto ReadFile(const QString &name) const -> QByteArray
+	{
+		QFile file(path + "/" + name);
+		return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray();
+	}
+
+	// Waits, up to timeoutMs, for cgroup.events to report no processes left.
+	// The kernel signals changes to it with POLLPRI.
+	auto WaitEmpty(int timeoutMs) const -> bool
+	{
+		const auto events = ::openat(fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+		if (events < 0)
+		{
+			return false;
+		}
+		QElapsedTimer timer;
+		timer.start();
+		bool empty = false;
+		while (true)
+		{
+			char buffer[256];
+			const auto got = ::pread(events, buffer, sizeof(buffer) - 1, 0);
+			empty = got > 0 && QByteArray(buffer, got).contains("populated 0");
+			const auto left = timeoutMs - timer.elapsed();
+			if (empty || got <= 0 || left <= 0)
+			{
+				break;
+			}
+			struct pollfd pfd{events, POLLPRI, 0};
+			::poll(&pfd, 1, int(left));
+		}
+		::close(events);
+		return empty;
+	}
+
+public:
+	PhaseCgroup() = default;
+	PhaseCgroup(const PhaseCgroup &) = delete;
+	PhaseCgroup &operator=(const PhaseCgroup &) = delete;
+	// Kills whatever the phase left running, e.g. daemons a script forked,
+	// since a populated cgroup cannot be removed.
+	~PhaseCgroup()
+	{
+		if (fd < 0)
+		{
+			return;
+		}
+		QFile kill(path + "/cgroup.kill");
+		if (kill.open(QIODevice::WriteOnly))
+		{
+			kill.write("1");
+			kill.close();
+		}
+		WaitEmpty(5000);
+		::close(fd);
+		if (::rmdir(QFile::encodeName(path).constData()) != 0)
+		{
+			qWarning() << "cannot remove cgroup" << path << qt_error_string(errno);
+		}
+	}
+
+	auto Create(const QString &parent) -> Fallible<>
+	{
+		QFile control(parent + "/cgroup.subtree_control");
+		if (control.open(QIODevice::WriteOnly))
+		{
+			control.write("+memory +io");
+		}
+		path = QString("%1/alpmbuild-%2-%3")
+				   .arg(parent)
+				   .arg(::getpid())
+				   .arg(QDateTime::currentMSecsSinceEpoch());
+		if (::mkdir(QFile::encodeName(path).constData(), 0755) != 0)
+		{
+			return Error{QString("cannot create cgroup %1: %2").arg(path, qt_error_string(errno))};
+		}
+		fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			const auto err = errno;
+			::rmdir(QFile::encodeName(path).constData());
+			return Error{QString("cannot open cgroup %1: %2").arg(path, qt_error_string(err))};
+		}
+		return std::monostate{};
+	}
+
+	auto Fd() const -> int { return fd; }
+
+	auto Attach(pid_t pid) const -> bool
+	{
+		QFile procs(path + "/cgroup.procs");
+		return procs.open(QIODevice::WriteOnly) && procs.write(QByteArray::number(pid)) > 0;
+	}
+
+	// Replaces what rusage reported with the cgroup's totals where the
+	// controllers provide them.
+	auto Collect(ResourceUsage &usage) const -> void
+	{
+		for (const auto &line : ReadFile("cpu.stat").split('\n'))
+		{
+			const auto fields = line.split(' ');
+			if (fields.size() == 2 && fields[0] == "user_usec")
+			{
+				usage.userUs = fields[1].toLongLong();
+				usage.cgroup = true;
+			}
+			else if (fields.size() == 2 && fields[0] == "system_usec")
+			{
+				usage.systemUs = fields[1].toLongLong();
+			}
+		}
+		if (const auto peak = ReadFile("memory.peak").trimmed(); !peak.isEmpty())
+		{
+			usage.maxRssBytes = peak.toLongLong();
+		}
+		const auto io = ReadFile("io.stat");
+		if (!io.isEmpty())
+		{
+			usage.readBytes = 0;
+			usage.writeBytes = 0;
+			for (const auto &line : io.split('\n'))
+			{
+				for (const auto &field : line.split(' '))
+				{
+					if (field.startsWith("rbytes="))
+					{
+						usage.readBytes += field.mid(7).toLongLong();
+					}
+					else if (field.startsWith("wbytes="))
+					{
+						usage.writeBytes += field.mid(7).toLongLong();
+					}
+				}
+			}
+		}
+	}
+};
+
+struct PhaseUsage
+{
+	QString phase;
+	ResourceUsage usage;
+};
+
+// What one build cost, phase by phase.
+struct ResourceReport
+{
+	QString pkgbase;
+	qint64 finished = 0;
+	QList<PhaseUsage> phases;
+
+	auto Total() const -> ResourceUsage
+	{
+		ResourceUsage total;
+		for (const auto &phase : phases)
+		{
+			total.wallUs += phase.usage.wallUs;
+			total.userUs += phase.usage.userUs;
+			total.systemUs += phase.usage.systemUs;
+			total.maxRssBytes = qMax(total.maxRssBytes, phase.usage.maxRssBytes);
+			total.readBytes += phase.usage.readBytes;
+			total.writeBytes += phase.usage.writeBytes;
+		}
+		return total;
+	}
+
+	auto ToJson() const -> QJsonObject
+	{
+		QJsonArray list;
+		for (const auto &phase : phases)
+		{
+			auto json = UsageToJson(phase.usage);
+			json["phase"] = phase.phase;
+			list << json;
+		}
+		return QJsonObject{
+			{"pkgbase", pkgbase},
+			{"finished", finished},
+			{"phases", list},
+			{"total", UsageToJson(Total())},
+		};
+	}
+
+	static auto FromJson(const QJsonObject &json) -> ResourceReport
+	{
+		ResourceReport report{json["pkgbase"].toString(), json["finished"].toInteger(), {}};
+		for (const auto &phase : json["phases"].toArray())
+		{
+			report.phases << PhaseUsage{phase["phase"].toString(), UsageFromJson(phase.toObject())};
+		}
+		return report;
+	}
+
+	auto Save(const QString &path) const -> Fallible<>
+	{
+		QSaveFile file(path);
+		if (!file.open(QIODevice::WriteOnly) || file.write(QJsonDocument(ToJson()).toJson()) < 0 ||
+			!file.commit())
+		{
+			return Error{QString("cannot write %1: %2").arg(path, file.errorString())};
+		}
+		return std::monostate{};
+	}
+};
+
+// Past reports, one JSON object per line, for estimating what the next build
+// of a package will cost.
+class BuildHistory
+{
+	QString path;
+
+public:
+	static auto DefaultPath() -> QString
+	{
+		auto base = QString::fromLocal8Bit(qgetenv("XDG_CACHE_HOME"));
+		if (base.isEmpty())
+		{
+			base = QDir::homePath() + "/.cache";
+		}
+		return base + "/alpmbuild++/history.jsonl";
+	}
+
+	explicit BuildHistory(const QString &path = DefaultPath()) : path(path) {}
+
+	auto Record(const ResourceReport &report) -> Fallible<>
+	{
+		QDir().mkpath(QFileInfo(path).path());
+		QFile file(path);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Append) ||
+			file.write(QJsonDocument(report.ToJson()).toJson(QJsonDocument::Compact) + "\n") < 0)
+		{
+			return Error{QString("cannot write %1: %2").arg(path, file.errorString())};
+		}
+		return std::monostate{};
+	}
+
+	auto Reports(const QString &pkgbase) const -> QList<ResourceReport>
+	{
+		QList<ResourceReport> ret;
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly))
+		{
+			return ret;
+		}
+		while (!file.atEnd())
+		{
+			const auto json = QJsonDocument::fromJson(file.readLine()).object();
+			if (json["pkgbase"].toString() == pkgbase)
+			{
+				ret << ResourceReport::FromJson(json);
+			}
+		}
+		return ret;
+	}
+
+	// The mean of the last `window` builds; nothing for unknown packages.
+	auto Estimate(const QString &pkgbase, int window = 5) const -> std::optional<ResourceUsage>
+	{
+		auto reports = Reports(pkgbase);
+		reports = reports.mid(qMax<qsizetype>(reports.size() - window, 0));
+		if (reports.isEmpty())
+		{
+			return std::nullopt;
+		}
+		ResourceUsage mean;
+		for (const auto &report : reports)
+		{
+			const auto total = report.Total();
+			mean.wallUs += total.wallUs / reports.size();
+			mean.userUs += total.userUs / reports.size();
+			mean.systemUs += total.systemUs / reports.size();
+			mean.maxRssBytes = qMax(mean.maxRssBytes, total.maxRssBytes);
+			mean.readBytes += total.readBytes / reports.size();
+			mean.writeBytes += total.writeBytes / reports.size();
+		}
+		return mean;
+	}
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <bit>
+#include <memory>
+#include <zstd.h>
+
+#include "error.h"
+
+// What a package's payload compression should aim for. Without a time budget
+// or a target ratio the writer's fixed level is used.
+struct CompressionBudget
+{
+	// Wall time compressing the payload may take.
+	qint64 timeMs = 0;
+	// Higher levels are not tried once one reaches this ratio.
+	double targetRatio = 0;
+	// Tried in order, so cheapest first.
+	QList<int> levels{3, 6, 9, 12, 16, 19};
+	// How much of the payload to buffer before deciding.
+	qint64 sampleBytes = 4 << 20;
+
+	auto Enabled() const -> bool { return timeMs > 0 || targetRatio > 0; }
+};
+
+struct CompressionDecision
+{
+	int level = 0;
+	// Zero leaves long-distance matching off.
+	int windowLog = 0;
+	qint64 expectedBytes = 0;
+	double ratio = 0;
+	double bytesPerSecond = 0;
+	QJsonArray trials;
+
+	auto ToJson() const -> QJsonObject
+	{
+		return QJsonObject{
+			{"level", level},
+			{"window_log", windowLog},
+			{"expected_bytes", expectedBytes},
+			{"ratio", ratio},
+			{"bytes_per_second", bytesPerSecond},
+			{"trials", trials},
+		};
+	}
+};
+
+// Compresses a few slices spread over the sample at each level, and keeps
+// the last level whose throughput would finish expectedBytes within the
+// budget, stopping early at the target ratio. The first level is kept even
+// if it is too slow, as nothing cheaper was offered. reach is how far back a
+// match may usefully point, i.e. the frame size of seekable output, or zero
+// for a single frame; long mode is turned on when that exceeds what the
+// level's own window covers, with the window no larger than the reach.
+auto ChooseCompression(const QByteArray &sample, qint64 expectedBytes, qint64 reach,
+					   const CompressionBudget &budget, int fallback) -> CompressionDecision
+{
+	constexpr qsizetype sliceBytes = 256 << 10;
+	constexpr qsizetype slices = 4;
+	QList<QByteArrayView> parts;
+	if (sample.size() <= sliceBytes * slices)
+	{
+		parts << QByteArrayView(sample);
+	}
+	else
+	{
+		for (qsizetype i = 0; i < slices; ++i)
+		{
+			parts << QByteArrayView(sample).sliced(i * (sample.size() - sliceBytes) / (slices - 1), sliceBytes);
+		}
+	}
+
+	CompressionDecision ret{.level = budget.levels.value(0, fallback), .expectedBytes = expectedBytes};
+	std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+	QByteArray out(ZSTD_compressBound(qMin(sample.size(), sliceBytes * slices)), Qt::Uninitialized);
+	for (const auto level : budget.levels)
+	{
+		qint64 in = 0;
+		qint64 compressed = 0;
+		QElapsedTimer timer;
+		timer.start();
+		for (const auto &part : std::as_const(parts))
+		{
+			const auto got =
+				ZSTD_compressCCtx(cctx.get(), out.data(), out.size(), part.data(), part.size(), level);
+			if (!ZSTD_isError(got))
+			{
+				in += part.size();
+				compressed += got;
+			}
+		}
+		const auto rate = in * 1e9 / qMax<qint64>(timer.nsecsElapsed(), 1);
+		const auto ratio = compressed > 0 ? double(in) / compressed : 1.0;
+		const auto estimateMs = qint64(expectedBytes * 1000 / qMax(rate, 1.0));
+		ret.trials << QJsonObject{
+			{"level", level},
+			{"ratio", ratio},
+			{"bytes_per_second", rate},
+			{"estimate_ms", estimateMs},
+		};
+		if (budget.timeMs > 0 && estimateMs > budget.timeMs && level != budget.levels.first())
+		{
+			break;
+		}
+		ret.level = level;
+		ret.ratio = ratio;
+		ret.bytesPerSecond = rate;
+		if (budget.targetRatio > 0 && ratio >= budget.targetRatio)
+		{
+			break;
+		}
+	}
+
+	// Levels up to 19 use windows of at most 8 MiB; 2^27 is as far as
+	// decoders go without being told to allow more.
+	const auto span = qMin(expectedBytes, reach > 0 ? reach : expectedBytes);
+	if (span > (8 << 20))
+	{
+		ret.windowLog = qMin(27, int(std::bit_width(quint64(span - 1))));
+	}
+	return ret;
+}
+
+// Decisions and how they turned out, one JSON object per line, for tuning
+// budgets and candidate levels.
+class CompressionLog
+{
+	QString path;
+
+public:
+	static auto DefaultPath() -> QString
+	{
+		auto base = QString::fromLocal8Bit(qgetenv("XDG_CACHE_HOME"));
+		if (base.isEmpty())
+		{
+			base = QDir::homePath() + "/.cache";
+		}
+		return base + "/alpmbuild++/compression.jsonl";
+	}
+
+	explicit CompressionLog(const QString &path = DefaultPath()) : path(path) {}
+
+	auto Record(const QJsonObject &entry) -> Fallible<>
+	{
+		QDir().mkpath(QFileInfo(path).path());
+		QFile file(path);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Append) ||
+			file.write(QJsonDocument(entry).toJson(QJsonDocument::Compact) + "\n") < 0)
+		{
+			return Error{QString("cannot write %1: %2").arg(path, file.errorString())};
+		}
+		return std::monostate{};
+	}
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <QByteArray>
+#include <QDataStream>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+struct SpecTag
+{
+	// Includes the qualifier, e.g. "Requires(post)".
+	QString name;
+	QString value;
+};
+
+// The preamble is the section with an empty name. Preamble and %package
+// sections hold tags; every other section holds its macro-expanded lines.
+struct SpecSection
+{
+	QString name;
+	QString arguments;
+	QList<SpecTag> tags;
+	QStringList lines;
+};
+
+struct Spec
+{
+	QList<SpecSection> sections;
+	QHash<QString, QString> macros;
+	// Absolute paths of the files pulled in with %include.
+	QStringList includes;
+	// Covers only what can change the built packages; see SpecParser.
+	QByteArray semanticHash;
+};
+
+auto operator<<(QDataStream &stream, const SpecTag &tag) -> QDataStream &
+{
+	return stream << tag.name << tag.value;
+}
+
+auto operator>>(QDataStream &stream, SpecTag &tag) -> QDataStream &
+{
+	return stream >> tag.name >> tag.value;
+}
+
+auto operator<<(QDataStream &stream, const SpecSection &section) -> QDataStream &
+{
+	return stream << section.name << section.arguments << section.tags << section.lines;
+}
+
+auto operator>>(QDataStream &stream, SpecSection &section) -> QDataStream &
+{
+	return stream >> section.name >> section.arguments >> section.tags >> section.lines;
+}
+
+// Everything but includes, which depend on where the contents came from.
+auto operator<<(QDataStream &stream, const Spec &spec) -> QDataStream &
+{
+	return stream << spec.sections << spec.macros << spec.semanticHash;
+}
+
+auto operator>>(QDataStream &stream, Spec &spec) -> QDataStream &
+{
+	return stream >> spec.sections >> spec.macros >> spec.semanticHash;
+}
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <optional>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ast.h"
+#include "error.h"
+
+// Parsed specs shared by every process of the user on the host through one
+// memory-mapped file, keyed by a hash of the spec's contents.
+//
+// The file is a header, an open-addressed table of record offsets and an
+// append-only record area; records hold offsets, never pointers, so any
+// process can map the file anywhere. Writers take flock() and publish a
+// record by storing its offset into the table only after the record is
+// complete, so readers take no lock at all. When the file fills up a writer
+// copies the most recently used records into a fresh file, renames it into
+// place and marks the old one retired, which tells processes still mapping
+// it to reopen.
+class SharedSpecCache
+{
+	static constexpr char Magic[8] = {'A', 'L', 'P', 'M', 'A', 'S', 'T', '1'};
+
+	struct Header
+	{
+		char magic[8];
+		quint32 slotCount;
+		quint32 reserved;
+		quint64 capacity;
+		std::atomic<quint64> tail;
+		std::atomic<quint64> count;
+		std::atomic<quint32> retired;
+	};
+
+	struct Record
+	{
+		char key[32];
+		quint32 size;
+		quint32 reserved;
+		// Milliseconds since the epoch of the last hit, for compaction.
+		std::atomic<qint64> used;
+	};
+
+	static_assert(std::atomic<quint64>::is_always_lock_free, "records are shared between processes");
+
+	static constexpr auto Align(quint64 size) -> quint64 { return (size + 7) & ~quint64(7); }
+	static constexpr auto SlotsOffset = Align(sizeof(Header));
+
+	struct Mapping
+	{
+		int fd = -1;
+		uchar *base = nullptr;
+		quint64 size = 0;
+
+		~Mapping()
+		{
+			if (base != nullptr)
+			{
+				::munmap(base, size);
+			}
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+		}
+
+		auto Head() const -> Header * { return reinterpret_cast<Header *>(base); }
+		auto Slots() const -> std::atomic<quint64> *
+		{
+			return reinterpret_cast<std::atomic<quint64> *>(base + SlotsOffset);
+		}
+		auto DataOffset() const -> quint64 { return Align(SlotsOffset + quint64(Head()->slotCount) * 8); }
+
+		auto At(quint64 offset) const -> Record *
+		{
+			if (offset < DataOffset() || offset + sizeof(Record) > size)
+			{
+				return nullptr;
+			}
+			const auto record = reinterpret_cast<Record *>(base + offset);
+			return offset + sizeof(Record) + record->size > size ? nullptr : record;
+		}
+
+		// The table slot holding key, or the empty slot where it would go.
+		auto Probe(const QByteArray &key, quint64 &offset) const -> quint32
+		{
+			const auto mask = Head()->slotCount - 1;
+			quint64 start;
+			std::memcpy(&start, key.constData(), sizeof start);
+			for (quint32 i = 0; i <= mask; ++i)
+			{
+				const auto slot = quint32((start + i) & mask);
+				offset = Slots()[slot].load(std::memory_order_acquire);
+				if (offset == 0)
+				{
+					return slot;
+				}
+				const auto record = At(offset);
+				if (record != nullptr && std::memcmp(record->key, key.constData(), sizeof record->key) == 0)
+				{
+					return slot;
+				}
+			}
+			offset = 0;
+			return mask + 1;
+		}
+	};
+
+	QString path;
+	quint64 capacity;
+	quint32 slotCount;
+	QMutex mutex;
+	std::shared_ptr<Mapping> current;
+	// flock() does not exclude threads sharing the descriptor.
+	QMutex writing;
+
+	auto Map(int fd) -> std::shared_ptr<Mapping>
+	{
+		auto mapping = std::make_shared<Mapping>();
+		mapping->fd = fd;
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || quint64(st.st_size) < SlotsOffset)
+		{
+			return nullptr;
+		}
+		mapping->size = st.st_size;
+		const auto base = ::mmap(nullptr, mapping->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			return nullptr;
+		}
+		mapping->base = static_cast<uchar *>(base);
+		const auto header = mapping->Head();
+		if (std::memcmp(header->magic, Magic, sizeof Magic) != 0 || header->capacity != mapping->size ||
+			header->slotCount == 0 || (header->slotCount & (header->slotCount - 1)) != 0 ||
+			mapping->DataOffset() >= mapping->size)
+		{
+			return nullptr;
+		}
+		return mapping;
+	}
+
+	// Sizes and initializes a new file; the caller holds its lock.
+	auto Initialize(int fd) -> bool
+	{
+		if (::ftruncate(fd, capacity) != 0)
+		{
+			return false;
+		}
+		Header header{};
+		std::memcpy(header.magic, Magic, sizeof Magic);
+		header.slotCount = slotCount;
+		header.capacity = capacity;
+		header.tail = Align(SlotsOffset + quint64(slotCount) * 8);
+		return ::pwrite(fd, &header, sizeof header, 0) == sizeof header;
+	}
+
+	// Outside a private directory anyone could have created the file first,
+	// so only a regular file of ours that nobody else can open is used.
+	auto Open() -> std::shared_ptr<Mapping>
+	{
+		const auto fd =
+			::open(QFile::encodeName(path).constData(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (fd < 0)
+		{
+			return nullptr;
+		}
+		struct stat st;
+		if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != ::getuid() || (st.st_mode & 077) != 0)
+		{
+			::close(fd);
+			return nullptr;
+		}
+		if (st.st_size == 0)
+		{
+			::flock(fd, LOCK_EX);
+			if (::fstat(fd, &st) == 0 && st.st_size == 0 && !Initialize(fd))
+			{
+				::flock(fd, LOCK_UN);
+				::close(fd);
+				return nullptr;
+			}
+			::flock(fd, LOCK_UN);
+		}
+		return Map(fd);
+	}
+
+	// The current mapping, reopened if another process retired it.
+	auto Current() -> std::shared_ptr<Mapping>
+	{
+		QMutexLocker lock(&mutex);
+		if (!current || current->Head()->retired.load(std::memory_order_acquire) != 0)
+		{
+			current = Open();
+		}
+		return current;
+	}
+
+	// Copies the most recently used records that fit in half the space into
+	// a new file and renames it over the old one. Returns the new mapping,
+	// locked; the old one is retired.
+	auto Compact(const std::shared_ptr<Mapping> &old) -> std::shared_ptr<Mapping>
+	{
+		auto name = QFile::encodeName(path + ".XXXXXX");
+		const auto fd = ::mkostemp(name.data(), O_CLOEXEC);
+		if (fd < 0)
+		{
+			return nullptr;
+		}
+		const auto staging = QFile::decodeName(name);
+		::flock(fd, LOCK_EX);
+		if (!Initialize(fd))
+		{
+			::close(fd);
+			::unlink(QFile::encodeName(staging).constData());
+			return nullptr;
+		}
+		auto fresh = Map(fd);
+		if (!fresh)
+		{
+			::unlink(QFile::encodeName(staging).constData());
+			return nullptr;
+		}
+
+		QList<const Record *> records;
+		for (quint32 i = 0; i < old->Head()->slotCount; ++i)
+		{
+			if (const auto record = old->At(old->Slots()[i].load(std::memory_order_acquire)))
+			{
+				records << record;
+			}
+		}
+		std::sort(records.begin(), records.end(), [](const Record *a, const Record *b) {
+			return a->used.load(std::memory_order_relaxed) > b->used.load(std::memory_order_relaxed);
+		});
+		const auto budget = fresh->DataOffset() + (capacity - fresh->DataOffset()) / 2;
+		for (const auto record : std::as_const(records))
+		{
+			if (fresh->Head()->count.load(std::memory_order_relaxed) >= slotCount / 4 ||
+				!Append(*fresh, QByteArray::fromRawData(record->key, sizeof record->key),
+						QByteArray::fromRawData(reinterpret_cast<const char *>(record + 1), record->size),
+						record->used.load(std::memory_order_relaxed), budget))
+			{
+				break;
+			}
+		}
+
+		if (::rename(QFile::encodeName(staging).constData(), QFile::encodeName(path).constData()) != 0)
+		{
+			::unlink(QFile::encodeName(staging).constData());
+			return nullptr;
+		}
+		old->Head()->retired.store(1, std::memory_order_release);
+		return fresh;
+	}
+
+	// Writes a record at the tail and publishes it; the caller holds the lock.
+	static auto Append(const Mapping &mapping, const QByteArray &key, const QByteArray &blob, qint64 used,
+					   quint64 limit) -> bool
+	{
+		const auto header = mapping.Head();
+		const auto offset = header->tail.load(std::memory_order_relaxed);
+		const auto end = offset + Align(sizeof(Record) + blob.size());
+		if (end > qMin(limit, mapping.size) || header->count.load(std::memory_order_relaxed) >= header->slotCount / 2)
+		{
+			return false;
+		}
+		quint64 existing;
+		const auto slot = mapping.Probe(key, existing);
+		if (existing != 0 || slot > header->slotCount - 1)
+		{
+			return existing != 0;
+		}
+		const auto record = reinterpret_cast<Record *>(mapping.base + offset);
+		std::memcpy(record->key, key.constData(), sizeof record->key);
+		record->size = blob.size();
+		record->used.store(used, std::memory_order_relaxed);
+		std::memcpy(record + 1, blob.constData(), blob.size());
+		header->tail.store(end, std::memory_order_relaxed);
+		header->count.fetch_add(1, std::memory_order_relaxed);
+		mapping.Slots()[slot].store(offset, std::memory_order_release);
+		return true;
+	}
+
+public:
+	// Bump the version whenever the parser's output for the same input changes.
+	static auto Key(const QByteArray &contents) -> QByteArray
+	{
+		QCryptographicHash hash(QCryptographicHash::Sha256);
+		hash.addData("alpmbuild++ ast v2");
+		hash.addData(contents);
+		return hash.result();
+	}
+
+	// $XDG_RUNTIME_DIR is private to the user and in memory; /dev/shm is
+	// shared, which Open() guards against.
+	static auto DefaultPath() -> QString
+	{
+		const auto runtime = QString::fromLocal8Bit(qgetenv("XDG_RUNTIME_DIR"));
+		if (!runtime.isEmpty() && QDir(runtime).exists())
+		{
+			return runtime + "/alpmbuild++-ast";
+		}
+		const auto directory = QDir("/dev/shm").exists() ? QString("/dev/shm") : QDir::tempPath();
+		return QString("%1/alpmbuild++-ast-%2").arg(directory).arg(::getuid());
+	}
+
+	explicit SharedSpecCache(const QString &path = DefaultPath(), quint64 capacity = 64 << 20,
+							 quint32 slotCount = 1 << 14)
+		: path(path), capacity(capacity), slotCount(slotCount)
+	{
+	}
+	SharedSpecCache(const SharedSpecCache &) = delete;
+	SharedSpecCache &operator=(const SharedSpecCache &) = delete;
+
+	auto Get(const QByteArray &key) -> std::optional<Spec>
+	{
+		const auto mapping = Current();
+		if (!mapping || key.size() != 32)
+		{
+			return std::nullopt;
+		}
+		quint64 offset;
+		mapping->Probe(key, offset);
+		const auto record = mapping->At(offset);
+		if (record == nullptr)
+		{
+			return std::nullopt;
+		}
+		record->used.store(QDateTime::currentMSecsSinceEpoch(), std::memory_order_relaxed);
+		QDataStream stream(QByteArray(reinterpret_cast<const char *>(record + 1), record->size));
+		Spec spec;
+		stream >> spec;
+		if (stream.status() != QDataStream::Ok)
+		{
+			return std::nullopt;
+		}
+		return spec;
+	}
+
+	auto Put(const QByteArray &key, const Spec &spec) -> Fallible<>
+	{
+		QByteArray blob;
+		QDataStream(&blob, QIODevice::WriteOnly) << spec;
+		if (key.size() != 32 || sizeof(Record) + blob.size() > capacity / 4)
+		{
+			return std::monostate{};
+		}
+		QMutexLocker lock(&writing);
+		for (auto attempt = 0; attempt < 2; ++attempt)
+		{
+			auto mapping = Current();
+			if (!mapping)
+			{
+				return Error{QString("cannot open %1: %2").arg(path, qt_error_string(errno))};
+			}
+			::flock(mapping->fd, LOCK_EX);
+			if (mapping->Head()->retired.load(std::memory_order_acquire) != 0)
+			{
+				// Compacted while we waited for the lock.
+				::flock(mapping->fd, LOCK_UN);
+				continue;
+			}
+			const auto now = QDateTime::currentMSecsSinceEpoch();
+			if (!Append(*mapping, key, blob, now, mapping->size))
+			{
+				const auto fresh = Compact(mapping);
+				::flock(mapping->fd, LOCK_UN);
+				if (!fresh)
+				{
+					return Error{QString("cannot compact %1").arg(path)};
+				}
+				Append(*fresh, key, blob, now, fresh->size);
+				::flock(fresh->fd, LOCK_UN);
+				QMutexLocker swap(&mutex);
+				current = fresh;
+				return std::monostate{};
+			}
+			::flock(mapping->fd, LOCK_UN);
+			return std::monostate{};
+		}
+		return std::monostate{};
+	}
+};
+
+// The cache every ReadSpec() consults; set ALPMBUILD_AST_CACHE=0 to bypass it.
+auto SharedSpecs() -> SharedSpecCache *
+{
+	static const auto enabled = qgetenv("ALPMBUILD_AST_CACHE") != "0";
+	static SharedSpecCache cache;
+	return enabled ? &cache : nullptr;
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QProcess>
+#include <QSaveFile>
+#include <QTemporaryFile>
+#include <QUrl>
+
+#include <memory>
+#include <optional>
+
+#include "checksums.h"
+#include "error.h"
+#include "spec.h"
+#include "store.h"
+
+struct BuildInputs
+{
+	QByteArray spec;
+	QList<QByteArray> sources;
+	// Resolved version of every build dependency, by package name.
+	QMap<QString, QString> dependencies;
+	QByteArray toolchain;
+};
+
+// Changelog entries and reflowed comments keep the same hash.
+auto SpecFileHash(const QString &path) -> Fallible<QByteArray>
+{
+	const auto spec = ReadSpec(path);
+	if (Failed(spec))
+	{
+		return std::get<Error>(spec);
+	}
+	return std::get<Spec>(spec).semanticHash;
+}
+
+// Compiler versions and the flags that end up in the produced binaries. MAKEFLAGS
+// is left out on purpose: -j changes how fast a build runs, not what it makes.
+auto ToolchainIdentity() -> QByteArray
+{
+	QByteArray identity;
+	auto version = [&identity](const QString &variable, const QString &fallback) {
+		auto program = QString::fromLocal8Bit(qgetenv(variable.toLatin1()));
+		if (program.isEmpty())
+		{
+			program = fallback;
+		}
+		QProcess process;
+		process.start(program, {"--version"});
+		process.waitForFinished();
+		identity += variable.toLatin1() + "=" + program.toLocal8Bit() + "\n" + process.readAllStandardOutput();
+	};
+	version("CC", "cc");
+	version("CXX", "c++");
+	for (const auto variable : {"CARCH", "CHOST", "CPPFLAGS", "CFLAGS", "CXXFLAGS", "LDFLAGS", "RUSTFLAGS"})
+	{
+		identity += QByteArray(variable) + "=" + qgetenv(variable) + "\n";
+	}
+	return identity;
+}
+
+auto BuildKey(const BuildInputs &inputs) -> QByteArray
+{
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	auto field = [&hash](const QByteArray &data) {
+		hash.addData(QByteArray::number(data.size()) + ":");
+		hash.addData(data);
+	};
+	field("alpmbuild++ build v2");
+	field(inputs.spec);
+	for (const auto &source : inputs.sources)
+	{
+		field(source.toLower());
+	}
+	for (auto it = inputs.dependencies.cbegin(); it != inputs.dependencies.cend(); ++it)
+	{
+		field(it.key().toUtf8());
+		field(it.value().toUtf8());
+	}
+	field(inputs.toolchain);
+	return hash.result().toHex();
+}
+
+// Where cached packages live. Names are "<key>/<file>"; Get returns false when
+// the object does not exist.
+class BuildCacheBackend
+{
+public:
+	virtual ~BuildCacheBackend() = default;
+	virtual auto Get(const QString &name, const QString &destination) -> Fallible<bool> = 0;
+	virtual auto Put(const QString &name, const QString &source) -> Fallible<> = 0;
+};
+
+class LocalCacheBackend : public BuildCacheBackend
+{
+	QString root;
+
+public:
+	static auto DefaultPath() -> QString
+	{
+		auto base = QString::fromLocal8Bit(qgetenv("XDG_CACHE_HOME"));
+		if (base.isEmpty())
+		{
+			base = QDir::homePath() + "/.cache";
+		}
+		return base + "/alpmbuild++/builds";
+	}
+
+	explicit LocalCacheBackend(const QString &root = DefaultPath()) : root(root) {}
+
+	auto Get(const QString &name, const QString &destination) -> Fallible<bool> override
+	{
+		const auto object = root + "/" + name;
+		if (!QFileInfo::exists(object))
+		{
+			return false;
+		}
+		QFile::remove(destination);
+		const auto cloned = CloneFile(object, destination);
+		if (Failed(cloned))
+		{
+			return std::get<Error>(cloned);
+		}
+		return true;
+	}
+
+	auto Put(const QString &name, const QString &source) -> Fallible<> override
+	{
+		const auto object = root + "/" + name;
+		QDir().mkpath(QFileInfo(object).path());
+		const auto staged = object + ".part";
+		QFile::remove(staged);
+		const auto cloned = CloneFile(source, staged);
+		if (Failed(cloned))
+		{
+			return cloned;
+		}
+		if (::rename(QFile::encodeName(staged).constData(), QFile::encodeName(object).constData()) != 0)
+		{
+			return Error{QString("cannot store %1: %2").arg(object, qt_error_string(errno))};
+		}
+		return std::monostate{};
+	}
+};
+
+// A plain HTTP object store: GET to read, PUT to write, 404 for a miss. Any
+// WebDAV server or a bucket behind a signing proxy works.
+class HttpCacheBackend : public BuildCacheBackend
+{
+	QNetworkAccessManager &network;
+	QUrl base;
+
+	auto Url(const QString &name) const -> QUrl
+	{
+		auto url = base;
+		url.setPath(base.path().chopped(base.path().endsWith('/') ? 1 : 0) + "/" + name);
+		return url;
+	}
+
+public:
+	HttpCacheBackend(QNetworkAccessManager &network, const QUrl &base) : network(network), base(base) {}
+
+	auto Get(const QString &name, const QString &destination) -> Fallible<bool> override
+	{
+		QSaveFile file(destination);
+		if (!file.open(QIODevice::WriteOnly))
+		{
+			return Error{QString("cannot write %1: %2").arg(destination, file.errorString())};
+		}
+		const auto reply = network.get(QNetworkRequest(Url(name)));
+		reply->setReadBufferSize(4 << 20);
+
+		QEventLoop loop;
+		bool ok = true;
+		QObject::connect(reply, &QNetworkReply::readyRead, &loop, [&] {
+			if (reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt() != 200)
+			{
+				return;
+			}
+			while (ok && reply->bytesAvailable() > 0)
+			{
+				ok = file.write(reply->read(1 << 20)) >= 0;
+			}
+			if (!ok)
+			{
+				reply->abort();
+			}
+		});
+		QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+		loop.exec();
+
+		const auto status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+		const auto networkError = reply->error();
+		const auto networkErrorString = reply->errorString();
+		if (ok && status == 200)
+		{
+			ok = file.write(reply->readAll()) >= 0;
+		}
+		reply->deleteLater();
+		if (status == 404)
+		{
+			file.cancelWriting();
+			return false;
+		}
+		if (!ok)
+		{
+			file.cancelWriting();
+			return Error{QString("cannot write %1: %2").arg(destination, file.errorString())};
+		}
+		if (networkError != QNetworkReply::NoError)
+		{
+			file.cancelWriting();
+			return Error{QString("%1: %2").arg(Url(name).toString(), networkErrorString)};
+		}
+		if (!file.commit())
+		{
+			return Error{QString("cannot write %1: %2").arg(destination, file.errorString())};
+		}
+		return true;
+	}
+
+	auto Put(const QString &name, const QString &source) -> Fallible<> override
+	{
+		QFile file(source);
+		if (!file.open(QIODevice::ReadOnly))
+		{
+			return Error{QString("cannot open %1: %2").arg(source, file.errorString())};
+		}
+		QNetworkRequest request(Url(name));
+		request.setHeader(QNetworkRequest::ContentTypeHeader, "application/octet-stream");
+		request.setHeader(QNetworkRequest::ContentLengthHeader, file.size());
+		const auto reply = network.put(request, &file);
+
+		QEventLoop loop;
+		QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+		loop.exec();
+
+		const auto networkError = reply->error();
+		const auto networkErrorString = reply->errorString();
+		reply->deleteLater();
+		if (networkError != QNetworkReply::NoError)
+		{
+			return Error{QString("%1: %2").arg(Url(name).toString(), networkErrorString)};
+		}
+		return std::monostate{};
+	}
+};
+
+// Each entry is the package files under <key>/ plus a <key>/manifest listing
+// "sha256  filename" per file. The manifest is written last, so an entry
+// without one is incomplete and treated as a miss.
+class BuildCache
+{
+	std::unique_ptr<BuildCacheBackend> backend;
+
+public:
+	explicit BuildCache(std::unique_ptr<BuildCacheBackend> backend) : backend(std::move(backend)) {}
+
+	// Places the cached packages for key in outdir and returns their paths, or
+	// nothing when the key was never stored.
+	auto Restore(const QByteArray &key, const QString &outdir) -> Fallible<std::optional<QStringList>>
+	{
+		const auto prefix = QString::fromLatin1(key) + "/";
+		QDir().mkpath(outdir);
+		const auto manifestPath = outdir + "/.manifest-" + QString::fromLatin1(key);
+		const auto got = backend->Get(prefix + "manifest", manifestPath);
+		if (Failed(got))
+		{
+			return std::get<Error>(got);
+		}
+		if (!std::get<bool>(got))
+		{
+			return std::nullopt;
+		}
+		QFile manifest(manifestPath);
+		if (!manifest.open(QIODevice::ReadOnly))
+		{
+			return Error{QString("cannot read %1: %2").arg(manifestPath, manifest.errorString())};
+		}
+		const auto lines = manifest.readAll().split('\n');
+		manifest.remove();
+
+		QStringList restored;
+		for (const auto &line : lines)
+		{
+			if (line.isEmpty())
+			{
+				continue;
+			}
+			const auto digest = line.left(64);
+			const auto name = QString::fromUtf8(line.mid(66));
+			if (name.isEmpty() || name.contains('/'))
+			{
+				return Error{QString("malformed cache manifest for %1").arg(QString::fromLatin1(key))};
+			}
+			const auto staged = outdir + "/." + name + ".part";
+			const auto fetched = backend->Get(prefix + name, staged);
+			if (Failed(fetched))
+			{
+				return std::get<Error>(fetched);
+			}
+			if (!std::get<bool>(fetched))
+			{
+				return std::nullopt;
+			}
+			const auto actual = FileSha256(staged);
+			if (Failed(actual))
+			{
+				return std::get<Error>(actual);
+			}
+			if (std::get<QByteArray>(actual) != digest)
+			{
+				QFile::remove(staged);
+				return Error{QString("cached %1 does not match its manifest").arg(name)};
+			}
+			const auto target = outdir + "/" + name;
+			if (::rename(QFile::encodeName(staged).constData(), QFile::encodeName(target).constData()) != 0)
+			{
+				return Error{QString("cannot move %1: %2").arg(target, qt_error_string(errno))};
+			}
+			restored << target;
+		}
+		return std::optional<QStringList>(restored);
+	}
+
+	auto Save(const QByteArray &key, const QStringList &packages) -> Fallible<>
+	{
+		const auto prefix = QString::fromLatin1(key) + "/";
+		QByteArray manifest;
+		for (const auto &package : packages)
+		{
+			const auto digest = FileSha256(package);
+			if (Failed(digest))
+			{
+				return std::get<Error>(digest);
+			}
+			const auto name = QFileInfo(package).fileName();
+			const auto put = backend->Put(prefix + name, package);
+			if (Failed(put))
+			{
+				return put;
+			}
+			manifest += std::get<QByteArray>(digest) + "  " + name.toUtf8() + "\n";
+		}
+
+		QTemporaryFile file;
+		if (!file.open() || file.write(manifest) != manifest.size() || !file.flush())
+		{
+			return Error{QString("cannot write cache manifest: %1").arg(file.errorString())};
+		}
+		return backend->Put(prefix + "manifest", file.fileName());
+	}
+};
@@ -0,0 +1,343 @@
+#pragma once
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSaveFile>
+
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#include "error.h"
+#include "extract.h"
+#include "zstdwriter.h"
+
+struct LogPhase
+{
+	QString name;
+	qint64 offset;
+};
+
+struct LogSegment
+{
+	qint64 offset;
+	qint64 size;
+	QString path;
+};
+
+// Captures one build's output. The most recent bytes stay in an in-memory ring
+// for error reports; everything is compressed to disk in segments of
+// segmentBytes, each a seekable zstd file of FrameBytes frames, and the oldest
+// segments are dropped once the compressed segments exceed maxBytes. An index
+// file maps log offsets to phases and segments so a phase can be read back by
+// decompressing only the frames it covers.
+class BuildLog
+{
+	QString directory;
+	qint64 segmentBytes;
+	qint64 maxBytes;
+	int level;
+	static constexpr qint64 FrameBytes = 1 << 20;
+
+	QMutex mutex;
+	QByteArray ring;
+	qint64 head = 0;
+	qint64 filled = 0;
+	qint64 written = 0;
+	QList<LogSegment> segments;
+	QList<LogPhase> phases;
+	std::unique_ptr<QFile> file;
+	std::unique_ptr<ZstdWriter> writer;
+	QString error;
+
+	auto Remember(const char *data, qint64 size) -> void
+	{
+		const auto capacity = ring.size();
+		if (size >= capacity)
+		{
+			std::memcpy(ring.data(), data + size - capacity, capacity);
+			head = 0;
+			filled = capacity;
+			return;
+		}
+		const auto first = qMin(size, capacity - head);
+		std::memcpy(ring.data() + head, data, first);
+		std::memcpy(ring.data(), data + first, size - first);
+		head = (head + size) % capacity;
+		filled = qMin(capacity, filled + size);
+	}
+
+	auto Recent(qint64 size) const -> QByteArray
+	{
+		const auto capacity = ring.size();
+		size = qMin(size, filled);
+		if (size <= 0)
+		{
+			return QByteArray();
+		}
+		const auto start = (head - size + capacity) % capacity;
+		if (start + size <= capacity)
+		{
+			return ring.mid(start, size);
+		}
+		return ring.mid(start) + ring.left(start + size - capacity);
+	}
+
+	auto SaveIndex() -> bool
+	{
+		QSaveFile index(directory + "/index");
+		if (!index.open(QIODevice::WriteOnly))
+		{
+			error = index.errorString();
+			return false;
+		}
+		for (const auto &phase : std::as_const(phases))
+		{
+			index.write("phase " + QByteArray::number(phase.offset) + " " + phase.name.toUtf8() + "\n");
+		}
+		for (const auto &segment : std::as_const(segments))
+		{
+			index.write("segment " + QByteArray::number(segment.offset) + " " +
+						QByteArray::number(segment.size) + " " + QFile::encodeName(segment.path) + "\n");
+		}
+		if (!index.commit())
+		{
+			error = index.errorString();
+			return false;
+		}
+		return true;
+	}
+
+	auto CloseSegment() -> bool
+	{
+		if (!writer)
+		{
+			return true;
+		}
+		const auto ended = writer->EndFrame() && writer->WriteSeekTable();
+		if (!ended)
+		{
+			error = writer->ErrorString();
+		}
+		writer.reset();
+		file.reset();
+		qint64 stored = 0;
+		for (const auto &segment : std::as_const(segments))
+		{
+			stored += QFileInfo(segment.path).size();
+		}
+		// The newest segment is kept whatever its size; segmentBytes bounds it.
+		while (stored > maxBytes && segments.size() > 1)
+		{
+			const auto dropped = segments.takeFirst();
+			stored -= QFileInfo(dropped.path).size();
+			QFile::remove(dropped.path);
+		}
+		return ended && SaveIndex();
+	}
+
+	auto OpenSegment() -> bool
+	{
+		const auto path = directory + QString("/%1.log.zst").arg(written, 16, 16, QChar('0'));
+		file = std::make_unique<QFile>(path);
+		if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			error = file->errorString();
+			file.reset();
+			return false;
+		}
+		writer = std::make_unique<ZstdWriter>(*file, level, 0, FrameBytes);
+		segments << LogSegment{written, 0, path};
+		return true;
+	}
+
+public:
+	// A log whose segments or ring would hold nothing refuses every write.
+	BuildLog(const QString &directory, qint64 segmentBytes = 16 << 20, qint64 maxBytes = 64 << 20,
+			 qint64 ringBytes = 1 << 20, int level = 3)
+		: directory(directory), segmentBytes(segmentBytes), maxBytes(maxBytes), level(level)
+	{
+		if (segmentBytes <= 0 || ringBytes <= 0)
+		{
+			error = "log segments and ring must be larger than 0 bytes";
+			return;
+		}
+		ring = QByteArray(ringBytes, Qt::Uninitialized);
+		QDir().mkpath(directory);
+	}
+	~BuildLog() { Finish(); }
+	BuildLog(const BuildLog &) = delete;
+	BuildLog &operator=(const BuildLog &) = delete;
+
+	auto BeginPhase(const QString &name) -> bool
+	{
+		QMutexLocker lock(&mutex);
+		if (ring.isEmpty())
+		{
+			return false;
+		}
+		phases << LogPhase{name, written};
+		return SaveIndex();
+	}
+
+	auto Write(const char *data, qint64 size) -> bool
+	{
+		QMutexLocker lock(&mutex);
+		if (ring.isEmpty())
+		{
+			return false;
+		}
+		Remember(data, size);
+		while (size > 0)
+		{
+			if (!writer && !OpenSegment())
+			{
+				return false;
+			}
+			auto &segment = segments.last();
+			const auto step = qMin(size, segmentBytes - segment.size);
+			if (!writer->Write(data, step))
+			{
+				error = writer->ErrorString();
+				return false;
+			}
+			segment.size += step;
+			written += step;
+			data += step;
+			size -= step;
+			if (segment.size == segmentBytes && !CloseSegment())
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// For RunOptions::sink.
+	auto Sink() -> std::function<bool(const char *, qint64)>
+	{
+		return [this](const char *data, qint64 size) { return Write(data, size); };
+	}
+
+	auto Finish() -> bool
+	{
+		QMutexLocker lock(&mutex);
+		return CloseSegment();
+	}
+
+	auto Tail(qint64 size) -> QByteArray
+	{
+		QMutexLocker lock(&mutex);
+		return Recent(size);
+	}
+
+	auto Phases() -> QList<LogPhase>
+	{
+		QMutexLocker lock(&mutex);
+		return phases;
+	}
+
+	// Reads [offset, offset + size) of the log. Recent bytes come from the ring;
+	// older ones are decoded from the segments covering them, and bytes whose
+	// segments were already dropped are reported as missing. Reading into the
+	// segment being written ends its current frame early but keeps writing
+	// the same segment.
+	auto Read(qint64 offset, qint64 size) -> Fallible<QByteArray>
+	{
+		QMutexLocker lock(&mutex);
+		size = qMin(size, written - offset);
+		if (size <= 0)
+		{
+			return QByteArray();
+		}
+		if (offset >= written - filled)
+		{
+			return Recent(written - offset).left(size);
+		}
+		if (!segments.isEmpty() && offset < segments.first().offset)
+		{
+			return Error{QString("log before offset %1 was discarded").arg(segments.first().offset)};
+		}
+		if (writer && offset + size > segments.last().offset && !(writer->EndFrame() && file->flush()))
+		{
+			error = writer->ErrorString().isEmpty() ? file->errorString() : writer->ErrorString();
+			return Error{error};
+		}
+
+		QByteArray ret;
+		for (const auto &segment : std::as_const(segments))
+		{
+			if (segment.offset + segment.size <= offset || segment.offset >= offset + size)
+			{
+				continue;
+			}
+			MappedFile mapped;
+			const auto opened = mapped.Open(segment.path);
+			if (Failed(opened))
+			{
+				return std::get<Error>(opened);
+			}
+			const auto from = qMax<qint64>(offset - segment.offset, 0);
+			const auto to = qMin(segment.size, offset + size - segment.offset);
+			// The segment being written has no seek table yet; its writer knows
+			// the frames.
+			const auto table = writer && segment.path == segments.last().path
+								   ? std::optional(writer->Frames())
+								   : ReadZstdSeekTable(mapped.data, mapped.size);
+			if (!table.has_value())
+			{
+				return Error{QString("%1 has no seek table").arg(segment.path)};
+			}
+			size_t at = 0;
+			qint64 start = 0;
+			for (const auto &frame : *table)
+			{
+				const auto end = start + frame.decompressedSize;
+				if (end > from && start < to)
+				{
+					const auto decoded = DecodeZstdFrame(mapped.data + at, frame.compressedSize, frame.decompressedSize);
+					if (Failed(decoded))
+					{
+						return std::get<Error>(decoded);
+					}
+					const auto skip = qMax<qint64>(from - start, 0);
+					ret += std::get<QByteArray>(decoded).mid(skip, qMin(end, to) - start - skip);
+				}
+				at += frame.compressedSize;
+				start = end;
+			}
+		}
+		return ret;
+	}
+
+	auto ReadPhase(const QString &name) -> Fallible<QByteArray>
+	{
+		qint64 from = -1;
+		qint64 to = 0;
+		{
+			QMutexLocker lock(&mutex);
+			to = written;
+			for (qsizetype i = 0; i < phases.size(); ++i)
+			{
+				if (phases[i].name == name)
+				{
+					from = phases[i].offset;
+					to = i + 1 < phases.size() ? phases[i + 1].offset : written;
+				}
+			}
+		}
+		if (from < 0)
+		{
+			return Error{QString("no phase %1 in the log").arg(name)};
+		}
+		return Read(from, to - from);
+	}
+
+	auto ErrorString() -> QString
+	{
+		QMutexLocker lock(&mutex);
+		return error;
+	}
+};
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <QDirIterator>
+#include <QFuture>
+#include <QHash>
+#include <QSet>
+#include <QTemporaryDir>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <climits>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "elfscan.h"
+#include "error.h"
+#include "jobserver.h"
+#include "package.h"
+#include "pkginfo.h"
+#include "strip.h"
+
+struct BuildrootOptions
+{
+	bool strip = true;
+	bool splitDebug = false;
+	bool compressDocs = true;
+	int level = 19;
+	// Picks the level per package instead when enabled.
+	CompressionBudget budget;
+	StripOptions stripOptions;
+};
+
+auto ArchiveTree(const PkgInfo &pkg, const QString &root, const QString &output, int level)
+	-> Fallible<>
+{
+	PackageWriter writer(root, output, level);
+	const QDir dir(root);
+	QDirIterator it(root, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot,
+					QDirIterator::Subdirectories);
+	while (it.hasNext())
+	{
+		const auto added = writer.AddEntry(dir.relativeFilePath(it.next()));
+		if (Failed(added))
+		{
+			return added;
+		}
+	}
+	return writer.Finish(pkg);
+}
+
+auto IsDocPage(const QString &relativePath) -> bool
+{
+	static const QStringList compressed{".gz", ".bz2", ".xz", ".zst", ".lz", ".lzma", ".Z"};
+	if (!relativePath.startsWith("usr/share/man/") && !relativePath.startsWith("usr/share/info/"))
+	{
+		return false;
+	}
+	if (relativePath == "usr/share/info/dir")
+	{
+		return false;
+	}
+	for (const auto &suffix : compressed)
+	{
+		if (relativePath.endsWith(suffix))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Renames symlinks under the man and info trees that point at a page which was
+// just compressed, so that foo.1.gz -> bar.1.gz keeps resolving.
+auto FixDocLinks(const QString &pkgdir, const QStringList &links, QSet<QString> compressed)
+	-> Fallible<QStringList>
+{
+	QStringList ret;
+	QStringList pending = links;
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		QStringList next;
+		for (const auto &link : std::as_const(pending))
+		{
+			const auto path = pkgdir + "/" + link;
+			char buffer[PATH_MAX];
+			const auto len = ::readlink(QFile::encodeName(path).constData(), buffer, sizeof buffer);
+			if (len <= 0)
+			{
+				next << link;
+				continue;
+			}
+			const auto target = QFile::decodeName(QByteArray(buffer, len));
+			const auto resolved = target.startsWith("/")
+				? QDir::cleanPath(target.mid(1))
+				: QDir::cleanPath(QFileInfo(link).path() + "/" + target);
+			if (!compressed.contains(resolved))
+			{
+				next << link;
+				continue;
+			}
+			if (!QFile::remove(path) || !QFile::link(target + ".gz", path + ".gz"))
+			{
+				return Error{QString("cannot relink %1").arg(link)};
+			}
+			compressed << link;
+			ret << link + ".gz";
+			changed = true;
+		}
+		pending = next;
+	}
+	return ret + pending;
+}
+
+// Walks the package root once. ELF files are scanned in parallel; strip
+// candidates are stripped on a pool bounded by the jobserver and man/info
+// pages are gzipped on the same pool, while everything else is archived on
+// this thread.
+auto PackageBuildroot(PkgInfo pkg, const QString &pkgdir, const QString &destdir,
+					  const BuildrootOptions &options) -> Fallible<QStringList>
+{
+	const QDir dir(pkgdir);
+	QStringList entries;
+	QStringList regular;
+	QHash<QPair<dev_t, ino_t>, QStringList> pages;
+	QStringList pageLinks;
+	QDirIterator it(pkgdir, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot,
+					QDirIterator::Subdirectories);
+	while (it.hasNext())
+	{
+		const auto path = it.next();
+		const auto relativePath = dir.relativeFilePath(path);
+		const auto info = it.fileInfo();
+		entries << relativePath;
+		if (options.compressDocs && IsDocPage(relativePath))
+		{
+			struct stat st;
+			if (info.isSymLink())
+			{
+				pageLinks << relativePath;
+				continue;
+			}
+			else if (info.isFile() && ::lstat(QFile::encodeName(path).constData(), &st) == 0)
+			{
+				pages[qMakePair(st.st_dev, st.st_ino)] << relativePath;
+				continue;
+			}
+		}
+		if (info.isFile() && !info.isSymLink())
+		{
+			regular << path;
+		}
+	}
+
+	const auto elfs = ScanElfFiles(regular);
+	AddElfMetadata(pkg, elfs);
+
+	// Hard links to one binary are stripped once and relinked afterwards.
+	QHash<QPair<dev_t, ino_t>, QStringList> groups;
+	QHash<QString, ElfInfo> candidates;
+	QSet<QString> deferred(pageLinks.begin(), pageLinks.end());
+	QSet<QString> compressed;
+	for (const auto &group : std::as_const(pages))
+	{
+		for (const auto &page : group)
+		{
+			deferred << page;
+			compressed << page;
+		}
+	}
+	if (options.strip)
+	{
+		for (const auto &elf : elfs)
+		{
+			struct stat st;
+			if (!IsStripCandidate(elf) || ::stat(QFile::encodeName(elf.path).constData(), &st) != 0)
+			{
+				continue;
+			}
+			const auto relativePath = dir.relativeFilePath(elf.path);
+			groups[qMakePair(st.st_dev, st.st_ino)] << relativePath;
+			candidates[relativePath] = elf;
+			deferred << relativePath;
+		}
+	}
+
+	QTemporaryDir debugDir(destdir + "/.debug-XXXXXX");
+	auto stripOptions = options.stripOptions;
+	if (options.splitDebug)
+	{
+		stripOptions.debugRoot = debugDir.path();
+	}
+
+	const auto output = destdir + "/" + PackageFileName(pkg);
+	PackageWriter writer(pkgdir, output, options.level);
+	writer.SetBudget(options.budget);
+	QThreadPool pool;
+	QList<QFuture<Fallible<>>> tasks;
+
+	for (const auto &group : std::as_const(groups))
+	{
+		tasks << QtConcurrent::run(&pool, [&, group]() -> Fallible<> {
+			const auto first = group.first();
+			{
+				JobToken token;
+				const auto stripped = StripFile(pkgdir, first, candidates.value(first), stripOptions);
+				if (Failed(stripped))
+				{
+					return stripped;
+				}
+			}
+			for (const auto &other : group.mid(1))
+			{
+				const auto from = QFile::encodeName(pkgdir + "/" + first);
+				const auto to = QFile::encodeName(pkgdir + "/" + other);
+				if (::unlink(to.constData()) != 0 || ::link(from.constData(), to.constData()) != 0)
+				{
+					return Error{QString("cannot relink %1: %2").arg(other, qt_error_string(errno))};
+				}
+			}
+			for (const auto &path : group)
+			{
+				const auto added = writer.AddEntry(path);
+				if (Failed(added))
+				{
+					return added;
+				}
+			}
+			return std::monostate{};
+		});
+	}
+
+	for (const auto &group : std::as_const(pages))
+	{
+		tasks << QtConcurrent::run(&pool, [&, group]() -> Fallible<> {
+			const auto first = pkgdir + "/" + group.first();
+			const auto gzipped = GzipFile(first, first + ".gz");
+			if (Failed(gzipped))
+			{
+				return gzipped;
+			}
+			QFile::remove(first);
+			for (const auto &other : group.mid(1))
+			{
+				const auto from = QFile::encodeName(first + ".gz");
+				const auto to = QFile::encodeName(pkgdir + "/" + other);
+				if (::unlink(to.constData()) != 0 ||
+					::link(from.constData(), (to + ".gz").constData()) != 0)
+				{
+					return Error{QString("cannot relink %1: %2").arg(other, qt_error_string(errno))};
+				}
+			}
+			for (const auto &path : group)
+			{
+				const auto added = writer.AddEntry(path + ".gz");
+				if (Failed(added))
+				{
+					return added;
+				}
+			}
+			return std::monostate{};
+		});
+	}
+
+	Fallible<> result = std::monostate{};
+	for (const auto &entry : std::as_const(entries))
+	{
+		if (deferred.contains(entry))
+		{
+			continue;
+		}
+		result = writer.AddEntry(entry);
+		if (Failed(result))
+		{
+			break;
+		}
+	}
+	pool.waitForDone();
+	for (const auto &task : std::as_const(tasks))
+	{
+		if (!Failed(result))
+		{
+			result = task.result();
+		}
+	}
+	if (Failed(result))
+	{
+		return std::get<Error>(result);
+	}
+
+	const auto links = FixDocLinks(pkgdir, pageLinks, compressed);
+	if (Failed(links))
+	{
+		return std::get<Error>(links);
+	}
+	for (const auto &link : std::get<QStringList>(links))
+	{
+		result = writer.AddEntry(link);
+		if (Failed(result))
+		{
+			return std::get<Error>(result);
+		}
+	}
+
+	result = writer.Finish(pkg);
+	if (Failed(result))
+	{
+		return std::get<Error>(result);
+	}
+	QStringList outputs{output};
+
+	if (options.splitDebug && !QDir(debugDir.path()).isEmpty())
+	{
+		PkgInfo debug;
+		debug.pkgname = pkg.pkgname + "-debug";
+		debug.pkgbase = pkg.pkgbase.isEmpty() ? pkg.pkgname : pkg.pkgbase;
+		debug.pkgver = pkg.pkgver;
+		debug.pkgdesc = "Detached debugging symbols for " + pkg.pkgname;
+		debug.url = pkg.url;
+		debug.packager = pkg.packager;
+		debug.arch = pkg.arch;
+		debug.builddate = pkg.builddate;
+		debug.license = pkg.license;
+
+		const auto debugOutput = destdir + "/" + PackageFileName(debug);
+		result = ArchiveTree(debug, debugDir.path(), debugOutput, options.level);
+		if (Failed(result))
+		{
+			return std::get<Error>(result);
+		}
+		outputs << debugOutput;
+	}
+	return outputs;
+}
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QSaveFile>
+#include <QtConcurrent>
+
+#include <fcntl.h>
+#include <optional>
+#include <sys/stat.h>
+
+#include "error.h"
+
+struct FileIdentity
+{
+	quint64 dev = 0;
+	quint64 ino = 0;
+	quint64 size = 0;
+	qint64 mtime = 0;
+	qint64 ctime = 0;
+
+	bool operator==(const FileIdentity &) const = default;
+};
+
+auto qHash(const FileIdentity &id, size_t seed = 0) -> size_t
+{
+	return qHashMulti(seed, id.dev, id.ino, id.size, id.mtime, id.ctime);
+}
+
+auto operator<<(QDataStream &stream, const FileIdentity &id) -> QDataStream &
+{
+	return stream << id.dev << id.ino << id.size << id.mtime << id.ctime;
+}
+
+auto operator>>(QDataStream &stream, FileIdentity &id) -> QDataStream &
+{
+	return stream >> id.dev >> id.ino >> id.size >> id.mtime >> id.ctime;
+}
+
+auto StatIdentity(const QString &path) -> std::optional<FileIdentity>
+{
+	struct statx stx;
+	const auto mask = STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME;
+	if (::statx(AT_FDCWD, QFile::encodeName(path).constData(), 0, mask, &stx) != 0 ||
+		!S_ISREG(stx.stx_mode))
+	{
+		return std::nullopt;
+	}
+	auto ns = [](const struct statx_timestamp &ts) {
+		return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	};
+	return FileIdentity{
+		.dev = (quint64(stx.stx_dev_major) << 32) | stx.stx_dev_minor,
+		.ino = stx.stx_ino,
+		.size = stx.stx_size,
+		.mtime = ns(stx.stx_mtime),
+		.ctime = ns(stx.stx_ctime),
+	};
+}
+
+auto FileSha256(const QString &path) -> Fallible<QByteArray>
+{
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		return Error{QString("cannot open %1: %2").arg(path, file.errorString())};
+	}
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	QByteArray buffer(1 << 20, Qt::Uninitialized);
+	qint64 got;
+	while ((got = file.read(buffer.data(), buffer.size())) > 0)
+	{
+		hash.addData(QByteArrayView(buffer.constData(), got));
+	}
+	if (got < 0)
+	{
+		return Error{QString("cannot read %1: %2").arg(path, file.errorString())};
+	}
+	return hash.result().toHex();
+}
+
+struct CachedDigest
+{
+	// Where the file was last seen, so stale entries can be pruned.
+	QString path;
+	QByteArray sha256;
+};
+
+auto operator<<(QDataStream &stream, const CachedDigest &entry) -> QDataStream &
+{
+	return stream << entry.path << entry.sha256;
+}
+
+auto operator>>(QDataStream &stream, CachedDigest &entry) -> QDataStream &
+{
+	return stream >> entry.path >> entry.sha256;
+}
+
+// Remembers the sha256 of files by (device, inode, size, mtime, ctime). ctime
+// is part of the key because it cannot be set back from userspace, so a file
+// rewritten and then `touch -d`'d to its old mtime still misses.
+class ChecksumCache
+{
+	static constexpr quint32 Magic = 0x616c6373;
+	static constexpr quint32 Version = 2;
+
+	QString path;
+	QMutex mutex;
+	QHash<FileIdentity, CachedDigest> digests;
+	bool dirty = false;
+
+	static auto Load(const QString &path) -> QHash<FileIdentity, CachedDigest>
+	{
+		QHash<FileIdentity, CachedDigest> ret;
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly))
+		{
+			return ret;
+		}
+		QDataStream stream(&file);
+		quint32 magic, version;
+		stream >> magic >> version;
+		if (magic != Magic || version != Version)
+		{
+			return ret;
+		}
+		stream >> ret;
+		if (stream.status() != QDataStream::Ok)
+		{
+			ret.clear();
+		}
+		return ret;
+	}
+
+public:
+	static auto DefaultPath() -> QString
+	{
+		auto base = QString::fromLocal8Bit(qgetenv("XDG_CACHE_HOME"));
+		if (base.isEmpty())
+		{
+			base = QDir::homePath() + "/.cache";
+		}
+		return base + "/alpmbuild++/checksums";
+	}
+
+	explicit ChecksumCache(const QString &path = DefaultPath()) : path(path), digests(Load(path)) {}
+
+	auto Lookup(const QString &file) -> std::optional<QByteArray>
+	{
+		const auto id = StatIdentity(file);
+		if (!id.has_value())
+		{
+			return std::nullopt;
+		}
+		QMutexLocker lock(&mutex);
+		const auto it = digests.constFind(*id);
+		if (it == digests.constEnd())
+		{
+			return std::nullopt;
+		}
+		return it->sha256;
+	}
+
+	// Hashes the file and caches the result, unless it changed while being read.
+	auto Compute(const QString &file) -> Fallible<QByteArray>
+	{
+		const auto before = StatIdentity(file);
+		const auto digest = FileSha256(file);
+		if (Failed(digest))
+		{
+			return digest;
+		}
+		const auto after = StatIdentity(file);
+		if (before.has_value() && before == after)
+		{
+			QMutexLocker lock(&mutex);
+			digests.insert(*after, CachedDigest{QFileInfo(file).absoluteFilePath(), std::get<QByteArray>(digest)});
+			dirty = true;
+		}
+		return digest;
+	}
+
+	auto Digest(const QString &file) -> Fallible<QByteArray>
+	{
+		if (const auto cached = Lookup(file); cached.has_value())
+		{
+			return *cached;
+		}
+		return Compute(file);
+	}
+
+	// Merges with whatever other processes saved meanwhile, and drops entries
+	// whose file was since removed, replaced or modified.
+	auto Save() -> Fallible<>
+	{
+		QMutexLocker lock(&mutex);
+		if (!dirty)
+		{
+			return std::monostate{};
+		}
+		auto merged = Load(path);
+		merged.insert(digests);
+		merged.removeIf([](const QHash<FileIdentity, CachedDigest>::iterator it) {
+			return StatIdentity(it.value().path) != it.key();
+		});
+
+		QDir().mkpath(QFileInfo(path).absolutePath());
+		QSaveFile file(path);
+		if (!file.open(QIODevice::WriteOnly))
+		{
+			return Error{QString("cannot write %1: %2").arg(path, file.errorString())};
+		}
+		QDataStream stream(&file);
+		stream << Magic << Version << merged;
+		if (!file.commit())
+		{
+			return Error{QString("cannot write %1: %2").arg(path, file.errorString())};
+		}
+		dirty = false;
+		return std::monostate{};
+	}
+};
+
+struct SourceChecksum
+{
+	QString path;
+	QString sha256;
+};
+
+// Checks each source against its expected sha256. Hits cost a statx; misses
+// are hashed in parallel.
+auto VerifySha256Sums(ChecksumCache &cache, const QList<SourceChecksum> &sources) -> Fallible<>
+{
+	QList<SourceChecksum> misses;
+	QStringList mismatches;
+	for (const auto &source : sources)
+	{
+		if (source.sha256.compare("SKIP", Qt::CaseInsensitive) == 0)
+		{
+			continue;
+		}
+		const auto cached = cache.Lookup(source.path);
+		if (!cached.has_value())
+		{
+			misses << source;
+		}
+		else if (cached->compare(source.sha256.toLatin1(), Qt::CaseInsensitive) != 0)
+		{
+			mismatches << source.path;
+		}
+	}
+
+	const auto computed = QtConcurrent::blockingMapped<QList<Fallible<QByteArray>>>(
+		misses, [&cache](const SourceChecksum &source) { return cache.Compute(source.path); });
+	for (qsizetype i = 0; i < misses.size(); ++i)
+	{
+		if (Failed(computed[i]))
+		{
+			return std::get<Error>(computed[i]);
+		}
+		if (std::get<QByteArray>(computed[i]).compare(misses[i].sha256.toLatin1(),
+													   Qt::CaseInsensitive) != 0)
+		{
+			mismatches << misses[i].path;
+		}
+	}
+
+	const auto saved = cache.Save();
+	if (!mismatches.isEmpty())
+	{
+		return Error{"sha256 mismatch: " + mismatches.join(", ")};
+	}
+	return saved;
+}
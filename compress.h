@@ -0,0 +1,78 @@
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "error.h"
+
+// Writes destination as `gzip -n` would: no name and a zero timestamp in the
+// header, so the output only depends on the content.
+auto GzipFile(const QString &source, const QString &destination, int level = 9) -> Fallible<>
+{
+	QFile in(source);
+	QFile out(destination);
+	if (!in.open(QIODevice::ReadOnly))
+	{
+		return Error{QString("cannot open %1: %2").arg(source, in.errorString())};
+	}
+	if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+	{
+		return Error{QString("cannot create %1: %2").arg(destination, out.errorString())};
+	}
+
+	z_stream stream{};
+	if (deflateInit2(&stream, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		return Error{QString("cannot initialise deflate for %1").arg(source)};
+	}
+
+	QByteArray input(1 << 16, Qt::Uninitialized);
+	QByteArray output(1 << 16, Qt::Uninitialized);
+	int flush = Z_NO_FLUSH;
+	int status = Z_OK;
+	do
+	{
+		const auto got = in.read(input.data(), input.size());
+		if (got < 0)
+		{
+			deflateEnd(&stream);
+			return Error{QString("cannot read %1: %2").arg(source, in.errorString())};
+		}
+		flush = in.atEnd() ? Z_FINISH : Z_NO_FLUSH;
+		stream.next_in = reinterpret_cast<Bytef *>(input.data());
+		stream.avail_in = uInt(got);
+		do
+		{
+			stream.next_out = reinterpret_cast<Bytef *>(output.data());
+			stream.avail_out = uInt(output.size());
+			status = deflate(&stream, flush);
+			const auto have = output.size() - stream.avail_out;
+			if (out.write(output.constData(), have) != have)
+			{
+				deflateEnd(&stream);
+				return Error{QString("cannot write %1: %2").arg(destination, out.errorString())};
+			}
+		} while (stream.avail_out == 0);
+	} while (flush != Z_FINISH);
+	deflateEnd(&stream);
+
+	if (status != Z_STREAM_END)
+	{
+		return Error{QString("cannot compress %1").arg(source)};
+	}
+
+	struct stat st;
+	if (::fstat(in.handle(), &st) == 0)
+	{
+		const struct timespec times[2] = {st.st_atim, st.st_mtim};
+		::fchmod(out.handle(), st.st_mode & 07777);
+		out.flush();
+		::futimens(out.handle(), times);
+	}
+	return std::monostate{};
+}
@@ -0,0 +1,527 @@
+#pragma once
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutex>
+#include <QNetworkAccessManager>
+#include <QPointer>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <unistd.h>
+
+#include "buildcache.h"
+#include "checksums.h"
+#include "error.h"
+#include "spec.h"
+#include "watch.h"
+
+auto SpecToJson(const Spec &spec) -> QJsonObject
+{
+	QJsonArray tags;
+	QJsonArray sections;
+	for (const auto &section : spec.sections)
+	{
+		for (const auto &tag : section.tags)
+		{
+			tags << QJsonObject{{"name", tag.name}, {"value", tag.value}, {"package", section.arguments}};
+		}
+		if (!section.name.isEmpty())
+		{
+			sections << QJsonObject{{"name", section.name}, {"arguments", section.arguments}};
+		}
+	}
+	QJsonObject macros;
+	for (auto it = spec.macros.cbegin(); it != spec.macros.cend(); ++it)
+	{
+		macros[it.key()] = ExpandMacros(it.value(), spec.macros);
+	}
+	return QJsonObject{
+		{"hash", QString::fromLatin1(spec.semanticHash)},
+		{"tags", tags},
+		{"sections", sections},
+		{"macros", macros},
+	};
+}
+
+enum class RequestPriority
+{
+	Interactive,
+	Batch,
+};
+
+// Runs daemon requests on its own pool. Interactive requests are started
+// ahead of batch ones, batch requests never take the last thread, and no
+// client runs more than clientLimit requests at once, so an editor is not
+// stuck behind a mass re-index.
+class RequestScheduler
+{
+	struct Job
+	{
+		quint64 client;
+		RequestPriority priority;
+		std::function<void()> run;
+	};
+
+	QThreadPool pool;
+	QMutex mutex;
+	QList<Job> pending;
+	QHash<quint64, int> running;
+	int batchRunning = 0;
+	int batchLimit;
+	int clientLimit;
+
+	auto Eligible(const Job &job) const -> bool
+	{
+		return running.value(job.client) < clientLimit &&
+			   (job.priority == RequestPriority::Interactive || batchRunning < batchLimit);
+	}
+
+	// Called with the mutex held.
+	auto Pump() -> void
+	{
+		for (const auto priority : {RequestPriority::Interactive, RequestPriority::Batch})
+		{
+			for (qsizetype i = 0; i < pending.size();)
+			{
+				if (pending[i].priority != priority || !Eligible(pending[i]))
+				{
+					++i;
+					continue;
+				}
+				const auto job = pending.takeAt(i);
+				++running[job.client];
+				batchRunning += job.priority == RequestPriority::Batch;
+				pool.start(
+					[this, job] {
+						job.run();
+						QMutexLocker lock(&mutex);
+						if (--running[job.client] == 0)
+						{
+							running.remove(job.client);
+						}
+						batchRunning -= job.priority == RequestPriority::Batch;
+						Pump();
+					},
+					job.priority == RequestPriority::Interactive ? 1 : 0);
+			}
+		}
+	}
+
+public:
+	explicit RequestScheduler(int clientLimit = 4) : clientLimit(clientLimit)
+	{
+		pool.setMaxThreadCount(qMax(2, QThread::idealThreadCount()));
+		batchLimit = pool.maxThreadCount() - 1;
+	}
+	~RequestScheduler()
+	{
+		{
+			QMutexLocker lock(&mutex);
+			pending.clear();
+		}
+		pool.waitForDone();
+	}
+
+	auto Submit(quint64 client, RequestPriority priority, std::function<void()> run) -> void
+	{
+		QMutexLocker lock(&mutex);
+		pending << Job{client, priority, run};
+		Pump();
+	}
+};
+
+// Serves JSON-line requests on a unix socket so editors and CI hooks skip
+// process startup and find grammars, specs, checksums and the toolchain
+// identity already loaded. Each line is {"id", "method", "params", "priority"}
+// with priority "interactive" (the default) or "batch"; each reply is {"id",
+// "result"} or {"id", "error"}, possibly out of order. {"method": "cancel",
+// "params": {"id"}} stops a queued or running request of the same client, and
+// {"method": "subscribe"} makes the connection receive --watch events. The
+// "edit" method keeps editor buffers parsed incrementally.
+class Daemon
+{
+	QLocalServer server;
+	SpecIndex specs;
+	ChecksumCache checksums;
+	QMutex toolchainMutex;
+	std::optional<QByteArray> toolchain;
+	QMutex inflightMutex;
+	QHash<quint64, QHash<QByteArray, std::shared_ptr<std::atomic_bool>>> inflight;
+	quint64 clients = 0;
+	QList<QPointer<QLocalSocket>> subscribers;
+	std::unique_ptr<SpecWatcher> watcher;
+	struct Document
+	{
+		QMutex mutex;
+		IncrementalSpec spec;
+		explicit Document(const QByteArray &contents) : spec(contents) {}
+	};
+	QMutex documentsMutex;
+	QHash<QString, std::shared_ptr<Document>> documents;
+	// Last, so running requests finish before the rest is torn down.
+	RequestScheduler scheduler;
+
+	auto Toolchain() -> QByteArray
+	{
+		QMutexLocker lock(&toolchainMutex);
+		if (!toolchain.has_value())
+		{
+			toolchain = ToolchainIdentity();
+		}
+		return *toolchain;
+	}
+
+	auto Parse(const QJsonObject &params, const std::atomic_bool *cancel) -> Fallible<QJsonObject>
+	{
+		if (params.contains("contents"))
+		{
+			const auto spec = ParseSpec(params["contents"].toString().toUtf8(), cancel);
+			if (Failed(spec))
+			{
+				return std::get<Error>(spec);
+			}
+			return SpecToJson(std::get<Spec>(spec));
+		}
+		const auto spec = specs.Get(params["path"].toString(), cancel);
+		if (Failed(spec))
+		{
+			return std::get<Error>(spec);
+		}
+		return SpecToJson(*std::get<std::shared_ptr<const Spec>>(spec));
+	}
+
+	// Keeps editor buffers parsed: {"document", "contents"} opens or replaces
+	// one, {"document", "offset", "removed", "inserted"} edits it in UTF-8
+	// bytes and {"document", "close": true} drops it.
+	auto Edit(const QJsonObject &params, const std::atomic_bool *cancel) -> Fallible<QJsonObject>
+	{
+		const auto name = params["document"].toString();
+		std::shared_ptr<Document> document;
+		{
+			QMutexLocker lock(&documentsMutex);
+			if (params["close"].toBool())
+			{
+				documents.remove(name);
+				return QJsonObject{};
+			}
+			if (params.contains("contents"))
+			{
+				documents[name] = std::make_shared<Document>(params["contents"].toString().toUtf8());
+			}
+			document = documents.value(name);
+		}
+		if (!document)
+		{
+			return Error{QString("no open document %1").arg(name)};
+		}
+		QMutexLocker lock(&document->mutex);
+		const auto spec = params.contains("contents")
+							  ? document->spec.Parse(cancel)
+							  : document->spec.Edit(params["offset"].toInteger(), params["removed"].toInteger(),
+													params["inserted"].toString().toUtf8(), cancel);
+		if (Failed(spec))
+		{
+			return std::get<Error>(spec);
+		}
+		return SpecToJson(std::get<Spec>(spec));
+	}
+
+	// One of "tag", "macro", "section" or "expand" against a spec.
+	auto Query(const QJsonObject &params, const std::atomic_bool *cancel) -> Fallible<QJsonObject>
+	{
+		const auto got = specs.Get(params["path"].toString(), cancel);
+		if (Failed(got))
+		{
+			return std::get<Error>(got);
+		}
+		const auto &spec = *std::get<std::shared_ptr<const Spec>>(got);
+		QJsonArray values;
+		if (params.contains("tag"))
+		{
+			const auto name = params["tag"].toString();
+			for (const auto &section : spec.sections)
+			{
+				for (const auto &tag : section.tags)
+				{
+					if (tag.name.compare(name, Qt::CaseInsensitive) == 0)
+					{
+						values << tag.value;
+					}
+				}
+			}
+		}
+		else if (params.contains("macro"))
+		{
+			const auto name = params["macro"].toString();
+			if (spec.macros.contains(name))
+			{
+				values << ExpandMacros(spec.macros.value(name), spec.macros);
+			}
+		}
+		else if (params.contains("section"))
+		{
+			for (const auto &section : spec.sections)
+			{
+				if (section.name == params["section"].toString())
+				{
+					values << QJsonArray::fromStringList(section.lines);
+				}
+			}
+		}
+		else if (params.contains("expand"))
+		{
+			values << ExpandMacros(params["expand"].toString(), spec.macros);
+		}
+		else
+		{
+			return Error{"query needs one of tag, macro, section or expand"};
+		}
+		return QJsonObject{{"values", values}};
+	}
+
+	// Resolves the build cache key and, on a hit, restores the packages into
+	// outdir. Running the build itself on a miss is left to the caller.
+	auto Build(const QJsonObject &params, const std::atomic_bool *cancel) -> Fallible<QJsonObject>
+	{
+		const auto got = specs.Get(params["path"].toString(), cancel);
+		if (Failed(got))
+		{
+			return std::get<Error>(got);
+		}
+		BuildInputs inputs{std::get<std::shared_ptr<const Spec>>(got)->semanticHash, {}, {}, Toolchain()};
+		for (const auto &source : params["sources"].toArray())
+		{
+			if (cancel->load())
+			{
+				return Error{"cancelled"};
+			}
+			const auto digest = checksums.Digest(source.toString());
+			if (Failed(digest))
+			{
+				return std::get<Error>(digest);
+			}
+			inputs.sources << std::get<QByteArray>(digest);
+		}
+		// A cache that cannot be written only costs rehashing next time, so
+		// the build goes on and the response carries the failure.
+		const auto saved = checksums.Save();
+		const auto dependencies = params["dependencies"].toObject();
+		for (auto it = dependencies.constBegin(); it != dependencies.constEnd(); ++it)
+		{
+			inputs.dependencies[it.key()] = it.value().toString();
+		}
+		const auto key = BuildKey(inputs);
+
+		QNetworkAccessManager network;
+		const auto location = params["cache"].toString();
+		std::unique_ptr<BuildCacheBackend> backend;
+		if (location.startsWith("http://") || location.startsWith("https://"))
+		{
+			backend = std::make_unique<HttpCacheBackend>(network, QUrl(location));
+		}
+		else
+		{
+			backend = std::make_unique<LocalCacheBackend>(location.isEmpty() ? LocalCacheBackend::DefaultPath()
+																		 : location);
+		}
+		BuildCache cache(std::move(backend));
+		const auto restored = cache.Restore(key, params["outdir"].toString(QDir::currentPath()));
+		if (Failed(restored))
+		{
+			return std::get<Error>(restored);
+		}
+		const auto packages = std::get<std::optional<QStringList>>(restored);
+		QJsonObject ret{{"key", QString::fromLatin1(key)}, {"cached", packages.has_value()}};
+		if (packages.has_value())
+		{
+			ret["packages"] = QJsonArray::fromStringList(*packages);
+		}
+		if (Failed(saved))
+		{
+			ret["warnings"] = QJsonArray{std::get<Error>(saved).message};
+		}
+		return ret;
+	}
+
+	auto Dispatch(const QJsonObject &request, const std::atomic_bool *cancel) -> QJsonObject
+	{
+		const auto method = request["method"].toString();
+		const auto params = request["params"].toObject();
+		Fallible<QJsonObject> result = Error{QString("unknown method %1").arg(method)};
+		if (cancel->load())
+		{
+			result = Error{"cancelled"};
+		}
+		else if (method == "parse")
+		{
+			result = Parse(params, cancel);
+		}
+		else if (method == "edit")
+		{
+			result = Edit(params, cancel);
+		}
+		else if (method == "query")
+		{
+			result = Query(params, cancel);
+		}
+		else if (method == "build")
+		{
+			result = Build(params, cancel);
+		}
+
+		QJsonObject reply{{"id", request["id"]}};
+		if (Failed(result))
+		{
+			reply["error"] = std::get<Error>(result).message;
+		}
+		else
+		{
+			reply["result"] = std::get<QJsonObject>(result);
+		}
+		return reply;
+	}
+
+	static auto RequestKey(const QJsonValue &id) -> QByteArray
+	{
+		return QJsonDocument(QJsonArray{id}).toJson(QJsonDocument::Compact);
+	}
+
+	auto Cancel(quint64 client, const QJsonValue &id) -> bool
+	{
+		QMutexLocker lock(&inflightMutex);
+		const auto token = inflight.value(client).value(RequestKey(id));
+		if (token)
+		{
+			token->store(true);
+		}
+		return token != nullptr;
+	}
+
+	auto Submit(quint64 client, QPointer<QLocalSocket> socket, const QJsonObject &request) -> void
+	{
+		const auto key = RequestKey(request["id"]);
+		auto token = std::make_shared<std::atomic_bool>(false);
+		{
+			QMutexLocker lock(&inflightMutex);
+			inflight[client][key] = token;
+		}
+		const auto priority = request["priority"].toString() == "batch" ? RequestPriority::Batch
+																		 : RequestPriority::Interactive;
+		scheduler.Submit(client, priority, [this, client, socket, request, key, token] {
+			const auto reply = Dispatch(request, token.get());
+			{
+				QMutexLocker lock(&inflightMutex);
+				auto &requests = inflight[client];
+				if (requests.value(key) == token)
+				{
+					requests.remove(key);
+				}
+				if (requests.isEmpty())
+				{
+					inflight.remove(client);
+				}
+			}
+			QMetaObject::invokeMethod(
+				qApp, [socket, reply] { Reply(socket, reply); }, Qt::QueuedConnection);
+		});
+	}
+
+	auto Accept() -> void
+	{
+		while (server.hasPendingConnections())
+		{
+			const auto client = ++clients;
+			QPointer<QLocalSocket> socket = server.nextPendingConnection();
+			QObject::connect(socket, &QLocalSocket::disconnected, socket, [this, client, socket] {
+				QMutexLocker lock(&inflightMutex);
+				for (const auto &token : inflight.value(client))
+				{
+					token->store(true);
+				}
+				socket->deleteLater();
+			});
+			QObject::connect(socket, &QLocalSocket::readyRead, socket, [this, client, socket] {
+				while (socket && socket->canReadLine())
+				{
+					QJsonParseError error;
+					const auto document = QJsonDocument::fromJson(socket->readLine(), &error);
+					if (!document.isObject())
+					{
+						Reply(socket, QJsonObject{{"error", error.errorString()}});
+						continue;
+					}
+					const auto request = document.object();
+					if (request["method"].toString() == "cancel")
+					{
+						const auto found = Cancel(client, request["params"].toObject()["id"]);
+						Reply(socket, QJsonObject{{"id", request["id"]}, {"result", QJsonObject{{"cancelled", found}}}});
+						continue;
+					}
+					if (request["method"].toString() == "subscribe")
+					{
+						subscribers << socket;
+						Reply(socket, QJsonObject{{"id", request["id"]}, {"result", QJsonObject{}}});
+						continue;
+					}
+					Submit(client, socket, request);
+				}
+			});
+		}
+	}
+
+	static auto Reply(QPointer<QLocalSocket> socket, const QJsonObject &reply) -> void
+	{
+		if (socket)
+		{
+			socket->write(QJsonDocument(reply).toJson(QJsonDocument::Compact) + "\n");
+		}
+	}
+
+public:
+	static auto DefaultSocket() -> QString
+	{
+		const auto runtime = QString::fromLocal8Bit(qgetenv("XDG_RUNTIME_DIR"));
+		if (!runtime.isEmpty())
+		{
+			return runtime + "/alpmbuild++.sock";
+		}
+		return QString("%1/alpmbuild++-%2.sock").arg(QDir::tempPath()).arg(::getuid());
+	}
+
+	auto Listen(const QString &path = DefaultSocket()) -> Fallible<>
+	{
+		QLocalServer::removeServer(path);
+		server.setSocketOptions(QLocalServer::UserAccessOption);
+		if (!server.listen(path))
+		{
+			return Error{QString("cannot listen on %1: %2").arg(path, server.errorString())};
+		}
+		QObject::connect(&server, &QLocalServer::newConnection, &server, [this] { Accept(); });
+		return std::monostate{};
+	}
+
+	// Keeps the spec index current for everything under root and forwards
+	// change events to subscribed clients.
+	auto Watch(const QString &root) -> Fallible<>
+	{
+		watcher = std::make_unique<SpecWatcher>(specs, [this](const QJsonObject &event) {
+			subscribers.removeAll(nullptr);
+			for (const auto &socket : std::as_const(subscribers))
+			{
+				Reply(socket, event);
+			}
+		});
+		return watcher->Watch(root);
+	}
+};
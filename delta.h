@@ -0,0 +1,342 @@
+#pragma once
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QtEndian>
+
+#include <bit>
+#include <memory>
+// For ZSTD_getFrameHeader; the static section has its own include guard, so
+// this works even after <zstd.h> was included without it.
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+
+#include "checksums.h"
+#include "error.h"
+#include "extract.h"
+#include "zstdwriter.h"
+
+// A delta package carries a new package relative to the previous version of
+// it. The new package's uncompressed payload is compressed once more, with
+// the previous version's uncompressed payload as a zstd prefix over a window
+// covering both, so everything the versions share costs next to nothing.
+//
+// The applier has to reproduce the package file byte for byte, as its
+// sha256 is in the repository database. So the delta also records how to
+// recompress each frame: the writer re-encodes every frame with ZstdWriter
+// and keeps the recipe that reproduces it exactly: a level, plus the frame
+// header's window log for long-distance matching and whether it was written
+// by worker threads, whose output differs from single-threaded output.
+// Frames that no candidate reproduces, and skippable frames such as the seek
+// table, are carried verbatim.
+//
+// Layout: "ALPMDLT1", a little-endian u32 header size, a JSON header, then
+// one zstd frame.
+constexpr char DeltaMagic[] = "ALPMDLT1";
+
+auto ReadWhole(ChunkSource source) -> Fallible<QByteArray>
+{
+	QByteArray ret;
+	while (true)
+	{
+		const auto chunk = source();
+		if (Failed(chunk))
+		{
+			return chunk;
+		}
+		if (std::get<QByteArray>(chunk).isEmpty())
+		{
+			return ret;
+		}
+		ret += std::get<QByteArray>(chunk);
+	}
+}
+
+auto UncompressedPayload(const QString &package) -> Fallible<QByteArray>
+{
+	const auto source = OpenDecompressor(package);
+	if (Failed(source))
+	{
+		return std::get<Error>(source);
+	}
+	return ReadWhole(std::get<ChunkSource>(source));
+}
+
+// A frame as ZstdWriter writes it with the recipe's level, window_log and
+// workers, or nothing if the writer fails.
+auto EncodeFrame(const QByteArray &content, const QJsonObject &recipe) -> QByteArray
+{
+	QBuffer buffer;
+	buffer.open(QIODevice::WriteOnly);
+	ZstdWriter writer(buffer, recipe["level"].toInt(), recipe["workers"].toInt());
+	if (recipe["window_log"].toInt() > 0)
+	{
+		writer.SetLongWindow(recipe["window_log"].toInt());
+	}
+	if (!writer.Write(content.constData(), content.size()) || !writer.EndFrame())
+	{
+		return QByteArray();
+	}
+	return buffer.data();
+}
+
+// levels are tried after the recipe that matched the previous frame, which
+// usually matches them all. A frame no candidate reproduces costs a dozen
+// levels times two worker and window settings, so after the first such frame
+// only the last matching recipe is tried: one writer made the whole package.
+auto WriteDelta(const QString &previous, const QString &current, const QString &delta, int level = 19,
+				const QList<int> &levels = {19, 3, 6, 9, 12, 16}) -> Fallible<>
+{
+	const auto base = UncompressedPayload(previous);
+	if (Failed(base))
+	{
+		return std::get<Error>(base);
+	}
+	MappedFile mapped;
+	const auto opened = mapped.Open(current);
+	if (Failed(opened))
+	{
+		return opened;
+	}
+	if (mapped.size < 4 || qFromLittleEndian<quint32>(mapped.data) != ZSTD_MAGICNUMBER)
+	{
+		return Error{QString("%1: delta packages need zstd").arg(current)};
+	}
+
+	QJsonArray frames;
+	QByteArray data;
+	QJsonObject matched;
+	auto exhausted = false;
+	size_t at = 0;
+	while (at < mapped.size)
+	{
+		const auto length = ZSTD_findFrameCompressedSize(mapped.data + at, mapped.size - at);
+		if (ZSTD_isError(length))
+		{
+			return Error{QString("%1: corrupt zstd stream: %2").arg(current, ZSTD_getErrorName(length))};
+		}
+		const auto frame = mapped.data + at;
+		const auto original = QByteArray::fromRawData(reinterpret_cast<const char *>(frame), length);
+		at += length;
+		if (!ZSTD_isSkippableFrame(frame, length))
+		{
+			// A package's frames can be far larger than extraction decodes
+			// whole; they only have to be indexable.
+			const auto decoded = DecodeZstdFrame(frame, length, 0, UINT32_MAX);
+			if (Failed(decoded))
+			{
+				return Error{QString("%1: %2").arg(current, std::get<Error>(decoded).message)};
+			}
+			const auto &content = std::get<QByteArray>(decoded);
+			ZSTD_frameHeader header;
+			const auto windowLog = ZSTD_getFrameHeader(&header, frame, length) == 0 && header.windowSize > 0
+									   ? int(std::bit_width(header.windowSize - 1))
+									   : 0;
+			QList<QJsonObject> candidates;
+			if (!matched.isEmpty())
+			{
+				candidates << matched;
+			}
+			for (const auto candidate : exhausted ? QList<int>() : levels)
+			{
+				for (const auto workers : {0, 1})
+				{
+					for (const auto window : {0, windowLog})
+					{
+						QJsonObject recipe{{"level", candidate}};
+						if (window > 0)
+						{
+							recipe["window_log"] = window;
+						}
+						if (workers > 0)
+						{
+							recipe["workers"] = workers;
+						}
+						if (!candidates.contains(recipe))
+						{
+							candidates << recipe;
+						}
+					}
+				}
+			}
+			auto reproduced = false;
+			for (const auto &candidate : std::as_const(candidates))
+			{
+				if (EncodeFrame(content, candidate) == original)
+				{
+					matched = candidate;
+					reproduced = true;
+					break;
+				}
+			}
+			if (reproduced)
+			{
+				auto recipe = matched;
+				recipe["size"] = content.size();
+				frames << recipe;
+				data += content;
+				continue;
+			}
+			exhausted = true;
+		}
+		frames << QJsonObject{{"raw", original.size()}};
+		data += original;
+	}
+
+	const auto &prefix = std::get<QByteArray>(base);
+	const auto bounds = ZSTD_cParam_getBounds(ZSTD_c_windowLog);
+	const auto windowLog =
+		qBound(bounds.lowerBound, int(std::bit_width(quint64(prefix.size() + data.size()))), bounds.upperBound);
+	std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+	ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_checksumFlag, 1);
+	ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_enableLongDistanceMatching, 1);
+	ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_windowLog, windowLog);
+	ZSTD_CCtx_refPrefix(cctx.get(), prefix.constData(), prefix.size());
+	QByteArray compressed(ZSTD_compressBound(data.size()), Qt::Uninitialized);
+	const auto got =
+		ZSTD_compress2(cctx.get(), compressed.data(), compressed.size(), data.constData(), data.size());
+	if (ZSTD_isError(got))
+	{
+		return Error{QString("cannot compress %1: %2").arg(delta, ZSTD_getErrorName(got))};
+	}
+	compressed.truncate(got);
+
+	const auto baseSum = FileSha256(previous);
+	const auto sum = FileSha256(current);
+	if (Failed(baseSum) || Failed(sum))
+	{
+		return std::get<Error>(Failed(baseSum) ? baseSum : sum);
+	}
+	const QJsonObject description{
+		{"base_sha256", QString::fromLatin1(std::get<QByteArray>(baseSum))},
+		{"sha256", QString::fromLatin1(std::get<QByteArray>(sum))},
+		{"zstd", ZSTD_versionString()},
+		{"window_log", windowLog},
+		{"frames", frames},
+	};
+	const auto header = QJsonDocument(description).toJson(QJsonDocument::Compact);
+
+	QSaveFile out(delta);
+	QByteArray size(4, Qt::Uninitialized);
+	qToLittleEndian<quint32>(header.size(), size.data());
+	if (!out.open(QIODevice::WriteOnly) || out.write(DeltaMagic, 8) != 8 || out.write(size) != 4 ||
+		out.write(header) != header.size() || out.write(compressed) != compressed.size() || !out.commit())
+	{
+		return Error{QString("cannot write %1: %2").arg(delta, out.errorString())};
+	}
+	return std::monostate{};
+}
+
+// Rebuilds the new package from the previous one and a delta, and checks it
+// against the sha256 the delta was made for.
+auto ApplyDelta(const QString &previous, const QString &delta, const QString &output) -> Fallible<>
+{
+	MappedFile mapped;
+	const auto opened = mapped.Open(delta);
+	if (Failed(opened))
+	{
+		return opened;
+	}
+	const auto bytes = QByteArray::fromRawData(reinterpret_cast<const char *>(mapped.data), mapped.size);
+	if (bytes.size() < 12 || !bytes.startsWith(DeltaMagic))
+	{
+		return Error{QString("%1: not a delta package").arg(delta)};
+	}
+	const auto headerSize = qFromLittleEndian<quint32>(bytes.constData() + 8);
+	if (12 + qsizetype(headerSize) > bytes.size())
+	{
+		return Error{QString("%1: truncated").arg(delta)};
+	}
+	const auto header = QJsonDocument::fromJson(bytes.mid(12, headerSize)).object();
+	const auto baseSum = FileSha256(previous);
+	if (Failed(baseSum))
+	{
+		return std::get<Error>(baseSum);
+	}
+	if (std::get<QByteArray>(baseSum) != header["base_sha256"].toString().toLatin1())
+	{
+		return Error{QString("%1 is not the package %2 was made against").arg(previous, delta)};
+	}
+
+	const auto base = UncompressedPayload(previous);
+	if (Failed(base))
+	{
+		return std::get<Error>(base);
+	}
+	const auto &prefix = std::get<QByteArray>(base);
+	const auto payload = reinterpret_cast<const uchar *>(bytes.constData()) + 12 + headerSize;
+	const auto payloadSize = size_t(bytes.size()) - 12 - headerSize;
+	// The payload is exactly the frames the header lists, and recompressed
+	// frames decode to at most 4 GiB as the writer decoded them; a payload
+	// claiming anything else is refused before it is allocated.
+	quint64 framesSize = 0;
+	for (const auto &value : header["frames"].toArray())
+	{
+		const auto frame = value.toObject();
+		const auto size = frame.contains("raw") ? frame["raw"].toInteger() : frame["size"].toInteger();
+		if (size < 0 || (!frame.contains("raw") && size > UINT32_MAX))
+		{
+			return Error{QString("%1: corrupt header").arg(delta)};
+		}
+		framesSize += quint64(size);
+	}
+	const auto windowLog = header["window_log"].toInt();
+	const auto bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+	const auto contentSize = ZSTD_getFrameContentSize(payload, payloadSize);
+	if (windowLog < bounds.lowerBound || windowLog > bounds.upperBound ||
+		contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR ||
+		contentSize != framesSize || qsizetype(contentSize) < 0)
+	{
+		return Error{QString("%1: corrupt payload").arg(delta)};
+	}
+	std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+	ZSTD_DCtx_setParameter(dctx.get(), ZSTD_d_windowLogMax, windowLog);
+	ZSTD_DCtx_refPrefix(dctx.get(), prefix.constData(), prefix.size());
+	QByteArray data(qsizetype(contentSize), Qt::Uninitialized);
+	const auto got = ZSTD_decompressDCtx(dctx.get(), data.data(), data.size(), payload, payloadSize);
+	if (ZSTD_isError(got) || got != contentSize)
+	{
+		return Error{QString("%1: %2").arg(delta, ZSTD_isError(got) ? ZSTD_getErrorName(got) : "short payload")};
+	}
+
+	QSaveFile out(output);
+	if (!out.open(QIODevice::WriteOnly))
+	{
+		return Error{QString("cannot create %1: %2").arg(output, out.errorString())};
+	}
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	qsizetype at = 0;
+	for (const auto &value : header["frames"].toArray())
+	{
+		const auto frame = value.toObject();
+		const auto size = frame.contains("raw") ? frame["raw"].toInteger() : frame["size"].toInteger();
+		if (size < 0 || at + size > data.size())
+		{
+			return Error{QString("%1: frames exceed the payload").arg(delta)};
+		}
+		const auto chunk = QByteArray::fromRawData(data.constData() + at, size);
+		at += size;
+		const auto encoded = frame.contains("raw") ? chunk : EncodeFrame(chunk, frame);
+		hash.addData(encoded);
+		if (out.write(encoded) != encoded.size())
+		{
+			return Error{QString("cannot write %1: %2").arg(output, out.errorString())};
+		}
+	}
+	if (hash.result().toHex() != header["sha256"].toString().toLatin1())
+	{
+		return Error{QString("%1 does not rebuild the package (made with zstd %2, this is %3)")
+						 .arg(delta, header["zstd"].toString(), ZSTD_versionString())};
+	}
+	if (!out.commit())
+	{
+		return Error{QString("cannot write %1: %2").arg(output, out.errorString())};
+	}
+	return std::monostate{};
+}
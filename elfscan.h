@@ -0,0 +1,317 @@
+#pragma once
+
+#include <QDirIterator>
+#include <QFile>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QSysInfo>
+#include <QtConcurrent>
+#include <QtEndian>
+
+#include <cstring>
+#include <elf.h>
+#include <fcntl.h>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pkginfo.h"
+
+struct ElfInfo
+{
+	QString path;
+	QString soname;
+	QStringList needed;
+	QString machine;
+	QString buildId;
+	int bits = 0;
+	int type = ET_NONE;
+	bool hasSymbols = false;
+	bool hasDebugInfo = false;
+};
+
+auto ElfMachineName(int machine) -> QString
+{
+	switch (machine)
+	{
+	case EM_X86_64:
+		return "x86_64";
+	case EM_386:
+		return "i686";
+	case EM_AARCH64:
+		return "aarch64";
+	case EM_ARM:
+		return "armv7h";
+	case EM_RISCV:
+		return "riscv64";
+	case EM_PPC64:
+		return "powerpc64";
+	}
+	return QString("unknown-%1").arg(machine);
+}
+
+template <class Ehdr, class Shdr, class Dyn>
+auto ReadElfSections(const uchar *data, quint64 size, bool swap, ElfInfo &info)
+	-> bool
+{
+	auto rd = [swap](auto value) { return swap ? qbswap(value) : value; };
+
+	if (size < sizeof(Ehdr))
+	{
+		return false;
+	}
+	Ehdr ehdr;
+	std::memcpy(&ehdr, data, sizeof ehdr);
+	info.type = rd(ehdr.e_type);
+	info.machine = ElfMachineName(rd(ehdr.e_machine));
+
+	const quint64 shoff = rd(ehdr.e_shoff);
+	const quint64 shnum = rd(ehdr.e_shnum);
+	const quint64 shentsize = rd(ehdr.e_shentsize);
+	if (shoff == 0 || shentsize < sizeof(Shdr) || shoff > size ||
+		shnum * shentsize > size - shoff)
+	{
+		return true;
+	}
+	auto section = [&](quint64 i) -> Shdr {
+		Shdr shdr;
+		std::memcpy(&shdr, data + shoff + i * shentsize, sizeof shdr);
+		return shdr;
+	};
+	auto inBounds = [size](quint64 offset, quint64 length) {
+		return offset <= size && length <= size - offset;
+	};
+
+	const quint64 shstrndx = rd(ehdr.e_shstrndx);
+	const char *names = nullptr;
+	quint64 namesSize = 0;
+	if (shstrndx < shnum)
+	{
+		const auto shstrtab = section(shstrndx);
+		if (inBounds(rd(shstrtab.sh_offset), rd(shstrtab.sh_size)))
+		{
+			names = reinterpret_cast<const char *>(data + rd(shstrtab.sh_offset));
+			namesSize = rd(shstrtab.sh_size);
+		}
+	}
+	auto sectionName = [&](const Shdr &shdr) -> QByteArray {
+		const quint64 offset = rd(shdr.sh_name);
+		if (names == nullptr || offset >= namesSize)
+		{
+			return QByteArray();
+		}
+		return QByteArray(names + offset, qstrnlen(names + offset, namesSize - offset));
+	};
+
+	for (quint64 i = 0; i < shnum; ++i)
+	{
+		const auto shdr = section(i);
+		const auto type = rd(shdr.sh_type);
+		if (type == SHT_SYMTAB)
+		{
+			info.hasSymbols = true;
+		}
+		else if (type == SHT_PROGBITS || type == SHT_NOBITS)
+		{
+			const auto name = sectionName(shdr);
+			if (name.startsWith(".debug_") || name.startsWith(".zdebug_"))
+			{
+				info.hasDebugInfo = true;
+			}
+		}
+		else if (type == SHT_NOTE && sectionName(shdr) == ".note.gnu.build-id")
+		{
+			const quint64 offset = rd(shdr.sh_offset);
+			const quint64 length = rd(shdr.sh_size);
+			if (inBounds(offset, length) && length >= 3 * sizeof(quint32))
+			{
+				quint32 note[3];
+				std::memcpy(note, data + offset, sizeof note);
+				const quint64 namesz = (rd(note[0]) + 3) & ~quint64(3);
+				const quint64 descsz = rd(note[1]);
+				if (rd(note[2]) == NT_GNU_BUILD_ID && sizeof note + namesz + descsz <= length)
+				{
+					const auto desc = data + offset + sizeof note + namesz;
+					info.buildId = QString::fromLatin1(
+						QByteArray(reinterpret_cast<const char *>(desc), descsz).toHex());
+				}
+			}
+		}
+
+		if (type != SHT_DYNAMIC || rd(shdr.sh_link) >= shnum)
+		{
+			continue;
+		}
+		const auto strtab = section(rd(shdr.sh_link));
+		const quint64 stroff = rd(strtab.sh_offset);
+		const quint64 strsize = rd(strtab.sh_size);
+		const quint64 dynoff = rd(shdr.sh_offset);
+		const quint64 dynsize = rd(shdr.sh_size);
+		if (!inBounds(stroff, strsize) || !inBounds(dynoff, dynsize))
+		{
+			return false;
+		}
+		auto string = [&](quint64 offset) -> QString {
+			if (offset >= strsize)
+			{
+				return QString();
+			}
+			const auto str = reinterpret_cast<const char *>(data + stroff + offset);
+			return QString::fromUtf8(str, qstrnlen(str, strsize - offset));
+		};
+
+		for (quint64 at = 0; at + sizeof(Dyn) <= dynsize; at += sizeof(Dyn))
+		{
+			Dyn dyn;
+			std::memcpy(&dyn, data + dynoff + at, sizeof dyn);
+			const auto tag = rd(dyn.d_tag);
+			if (tag == DT_NULL)
+			{
+				break;
+			}
+			else if (tag == DT_SONAME)
+			{
+				info.soname = string(rd(dyn.d_un.d_val));
+			}
+			else if (tag == DT_NEEDED)
+			{
+				info.needed << string(rd(dyn.d_un.d_val));
+			}
+		}
+	}
+	return true;
+}
+
+auto ReadElf(const QString &path) -> std::optional<ElfInfo>
+{
+	const auto fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return std::nullopt;
+	}
+
+	uchar ident[EI_NIDENT];
+	struct stat st;
+	if (::pread(fd, ident, sizeof ident, 0) != sizeof ident ||
+		std::memcmp(ident, ELFMAG, SELFMAG) != 0 || ::fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		return std::nullopt;
+	}
+
+	const auto size = quint64(st.st_size);
+	const auto map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+	{
+		return std::nullopt;
+	}
+
+	ElfInfo info;
+	info.path = path;
+	const auto data = static_cast<const uchar *>(map);
+	const bool littleEndian = ident[EI_DATA] == ELFDATA2LSB;
+	const bool swap = littleEndian != (QSysInfo::ByteOrder == QSysInfo::LittleEndian);
+	bool ok = false;
+	if (ident[EI_CLASS] == ELFCLASS64)
+	{
+		info.bits = 64;
+		ok = ReadElfSections<Elf64_Ehdr, Elf64_Shdr, Elf64_Dyn>(data, size, swap, info);
+	}
+	else if (ident[EI_CLASS] == ELFCLASS32)
+	{
+		info.bits = 32;
+		ok = ReadElfSections<Elf32_Ehdr, Elf32_Shdr, Elf32_Dyn>(data, size, swap, info);
+	}
+	::munmap(map, size);
+
+	if (!ok)
+	{
+		return std::nullopt;
+	}
+	return info;
+}
+
+auto ScanElfFiles(const QStringList &paths) -> QList<ElfInfo>
+{
+	const auto scanned =
+		QtConcurrent::blockingMapped<QList<std::optional<ElfInfo>>>(paths, ReadElf);
+
+	QList<ElfInfo> ret;
+	for (const auto &item : scanned)
+	{
+		if (item.has_value())
+		{
+			ret << *item;
+		}
+	}
+	return ret;
+}
+
+auto ScanElfTree(const QString &root) -> QList<ElfInfo>
+{
+	QStringList paths;
+	QDirIterator it(root, QDir::Files | QDir::Hidden | QDir::NoSymLinks,
+					QDirIterator::Subdirectories);
+	while (it.hasNext())
+	{
+		paths << it.next();
+	}
+	return ScanElfFiles(paths);
+}
+
+// libfoo.so.1.2 with 64-bit class becomes libfoo.so=1.2-64, matching makepkg.
+// The version follows the last ".so.", and unversioned sonames such as
+// libfoo.so give nothing, as makepkg skips them too.
+auto SonameDependency(const QString &soname, int bits) -> QString
+{
+	const auto at = soname.lastIndexOf(".so.");
+	if (at <= 0 || at + 4 == soname.size())
+	{
+		return QString();
+	}
+	const auto name = soname.left(at + 3);
+	const auto version = soname.mid(at + 4);
+	return QString("%1=%2-%3").arg(name, version).arg(bits);
+}
+
+auto AddElfMetadata(PkgInfo &pkg, const QList<ElfInfo> &elfs) -> void
+{
+	QSet<QString> sonames;
+	for (const auto &elf : elfs)
+	{
+		if (elf.type == ET_DYN && !elf.soname.isEmpty())
+		{
+			sonames << elf.soname;
+			const auto provide = SonameDependency(elf.soname, elf.bits);
+			if (!provide.isEmpty() && !pkg.provides.contains(provide))
+			{
+				pkg.provides << provide;
+			}
+		}
+	}
+
+	for (const auto &elf : elfs)
+	{
+		for (const auto &needed : elf.needed)
+		{
+			if (sonames.contains(needed))
+			{
+				continue;
+			}
+			const auto depend = SonameDependency(needed, elf.bits);
+			if (!depend.isEmpty() && !pkg.depends.contains(depend))
+			{
+				pkg.depends << depend;
+			}
+		}
+	}
+
+	if (pkg.arch == "any" && !elfs.isEmpty())
+	{
+		qWarning() << pkg.pkgname << "is arch=any but contains ELF files, e.g."
+				   << elfs.first().path << "for" << elfs.first().machine;
+	}
+}
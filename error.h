@@ -0,0 +1,18 @@
+#pragma once
+
+#include <QString>
+#include <variant>
+
+struct Error
+{
+	QString message;
+};
+
+template <class T = std::monostate>
+using Fallible = std::variant<T, Error>;
+
+template <class T>
+auto Failed(const Fallible<T> &result) -> bool
+{
+	return std::holds_alternative<Error>(result);
+}
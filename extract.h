@@ -0,0 +1,724 @@
+#pragma once
+
+#include <QDir>
+#include <QFile>
+#include <QFuture>
+#include <QMutex>
+#include <QQueue>
+#include <QSemaphore>
+#include <QSet>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <fcntl.h>
+#include <lzma.h>
+#include <memory>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "error.h"
+#include "tar.h"
+#include "zstdwriter.h"
+
+struct MappedFile
+{
+	const uchar *data = nullptr;
+	size_t size = 0;
+
+	MappedFile() = default;
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	~MappedFile()
+	{
+		if (data != nullptr)
+		{
+			::munmap(const_cast<uchar *>(data), size);
+		}
+	}
+
+	auto Open(const QString &path) -> Fallible<>
+	{
+		const auto fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			return Error{QString("cannot open %1: %2").arg(path, qt_error_string(errno))};
+		}
+		struct stat st;
+		::fstat(fd, &st);
+		size = st.st_size;
+		if (size > 0)
+		{
+			const auto map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			data = map == MAP_FAILED ? nullptr : static_cast<const uchar *>(map);
+		}
+		::close(fd);
+		if (size > 0 && data == nullptr)
+		{
+			return Error{QString("cannot map %1: %2").arg(path, qt_error_string(errno))};
+		}
+		return std::monostate{};
+	}
+};
+
+using ChunkSource = std::function<Fallible<QByteArray>()>;
+
+// Decodes independent frames on the global pool, keeping a bounded window of
+// frames in flight, and hands the results out in order.
+auto ParallelFrames(std::shared_ptr<MappedFile> file, QList<QPair<size_t, size_t>> frames,
+					std::function<Fallible<QByteArray>(const uchar *, size_t)> decode)
+	-> ChunkSource
+{
+	struct State
+	{
+		qsizetype next = 0;
+		QQueue<QFuture<Fallible<QByteArray>>> inflight;
+	};
+	auto state = std::make_shared<State>();
+	const auto window = 2 * QThread::idealThreadCount();
+
+	return [file, frames, decode, state, window]() -> Fallible<QByteArray> {
+		while (true)
+		{
+			while (state->inflight.size() < window && state->next < frames.size())
+			{
+				const auto frame = frames[state->next++];
+				state->inflight.enqueue(QtConcurrent::run([file, frame, decode] {
+					return decode(file->data + frame.first, frame.second);
+				}));
+			}
+			if (state->inflight.isEmpty())
+			{
+				return QByteArray();
+			}
+			const auto result = state->inflight.dequeue().result();
+			if (Failed(result) || !std::get<QByteArray>(result).isEmpty())
+			{
+				return result;
+			}
+		}
+	};
+}
+
+// Frames are decoded whole on the pool, a window of them at a time, when
+// each fits in this; a file with any larger or unsized frame is streamed.
+constexpr quint64 ParallelFrameLimit = 16 << 20;
+
+// sizeHint stands in for the content size streamed frames leave out of
+// their header, e.g. from a seek table, and must agree with it otherwise.
+// Frames claiming more than limit bytes fail before anything is allocated.
+auto DecodeZstdFrame(const uchar *data, size_t size, size_t sizeHint = 0, quint64 limit = ParallelFrameLimit)
+	-> Fallible<QByteArray>
+{
+	thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(),
+																		   ZSTD_freeDCtx);
+	if (ZSTD_isSkippableFrame(data, size))
+	{
+		return QByteArray();
+	}
+
+	auto contentSize = ZSTD_getFrameContentSize(data, size);
+	if (contentSize == ZSTD_CONTENTSIZE_ERROR)
+	{
+		return Error{"corrupt zstd frame header"};
+	}
+	if (contentSize == ZSTD_CONTENTSIZE_UNKNOWN && sizeHint > 0)
+	{
+		contentSize = sizeHint;
+	}
+	else if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && sizeHint > 0 && contentSize != sizeHint)
+	{
+		return Error{QString("zstd frame holds %1 bytes, its index says %2").arg(contentSize).arg(sizeHint)};
+	}
+	if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize > limit)
+	{
+		return Error{QString("zstd frame of %1 bytes exceeds the %2 byte limit").arg(contentSize).arg(limit)};
+	}
+	if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN)
+	{
+		QByteArray out(qsizetype(contentSize), Qt::Uninitialized);
+		const auto got = ZSTD_decompressDCtx(dctx.get(), out.data(), out.size(), data, size);
+		if (ZSTD_isError(got))
+		{
+			return Error{ZSTD_getErrorName(got)};
+		}
+		out.truncate(got);
+		return out;
+	}
+
+	QByteArray out;
+	QByteArray buffer(ZSTD_DStreamOutSize(), Qt::Uninitialized);
+	ZSTD_DCtx_reset(dctx.get(), ZSTD_reset_session_only);
+	ZSTD_inBuffer input{data, size, 0};
+	while (input.pos < input.size)
+	{
+		ZSTD_outBuffer output{buffer.data(), size_t(buffer.size()), 0};
+		const auto ret = ZSTD_decompressStream(dctx.get(), &output, &input);
+		if (ZSTD_isError(ret))
+		{
+			return Error{ZSTD_getErrorName(ret)};
+		}
+		out.append(buffer.constData(), output.pos);
+		if (quint64(out.size()) > limit)
+		{
+			return Error{QString("zstd frame exceeds the %1 byte limit").arg(limit)};
+		}
+		if (ret == 0)
+		{
+			break;
+		}
+	}
+	return out;
+}
+
+// Streams the whole file through one decoder, up to a megabyte and never
+// past the end of a frame per call, on the calling thread. For readers that stop early and should not pay for frames
+// they never reach, and for frames too large to decode into one buffer.
+auto SequentialZstdSource(std::shared_ptr<MappedFile> file) -> ChunkSource
+{
+	struct State
+	{
+		std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx{ZSTD_createDCtx(), ZSTD_freeDCtx};
+		ZSTD_inBuffer input{};
+		// ZSTD_decompressStream's last hint, non-zero inside a frame.
+		size_t pending = 0;
+	};
+	auto state = std::make_shared<State>();
+	state->input = ZSTD_inBuffer{file->data, file->size, 0};
+	return [file, state]() -> Fallible<QByteArray> {
+		QByteArray out(1 << 20, Qt::Uninitialized);
+		ZSTD_outBuffer output{out.data(), size_t(out.size()), 0};
+		while (output.pos < output.size)
+		{
+			if (state->input.pos == state->input.size && state->pending == 0)
+			{
+				break;
+			}
+			const auto produced = output.pos;
+			const auto consumed = state->input.pos;
+			state->pending = ZSTD_decompressStream(state->dctx.get(), &output, &state->input);
+			if (ZSTD_isError(state->pending))
+			{
+				return Error{QString("corrupt zstd stream: %1").arg(ZSTD_getErrorName(state->pending))};
+			}
+			if (output.pos == produced && state->input.pos == consumed)
+			{
+				return Error{"truncated zstd stream"};
+			}
+			// A chunk ends with its frame, so a reader that stops early
+			// never decodes the frames after the one it wanted.
+			if (state->pending == 0 && output.pos > 0)
+			{
+				break;
+			}
+		}
+		out.truncate(output.pos);
+		return out;
+	};
+}
+
+auto ZstdSource(std::shared_ptr<MappedFile> file) -> Fallible<ChunkSource>
+{
+	// Seekable files list their frames at the end, sizes included.
+	if (const auto table = ReadZstdSeekTable(file->data, file->size))
+	{
+		QList<QPair<size_t, size_t>> frames;
+		QHash<size_t, size_t> sizes;
+		size_t at = 0;
+		for (const auto &frame : *table)
+		{
+			if (frame.decompressedSize > ParallelFrameLimit)
+			{
+				return SequentialZstdSource(file);
+			}
+			frames << qMakePair(at, size_t(frame.compressedSize));
+			sizes[at] = frame.decompressedSize;
+			at += frame.compressedSize;
+		}
+		const auto base = file->data;
+		return ParallelFrames(file, frames, [base, sizes](const uchar *data, size_t size) {
+			return DecodeZstdFrame(data, size, sizes.value(data - base));
+		});
+	}
+
+	QList<QPair<size_t, size_t>> frames;
+	size_t at = 0;
+	while (at < file->size)
+	{
+		const auto length = ZSTD_findFrameCompressedSize(file->data + at, file->size - at);
+		if (ZSTD_isError(length))
+		{
+			return Error{QString("corrupt zstd stream: %1").arg(ZSTD_getErrorName(length))};
+		}
+		const auto contentSize = ZSTD_getFrameContentSize(file->data + at, length);
+		if (!ZSTD_isSkippableFrame(file->data + at, length) &&
+			(contentSize == ZSTD_CONTENTSIZE_UNKNOWN || contentSize == ZSTD_CONTENTSIZE_ERROR ||
+			 contentSize > ParallelFrameLimit))
+		{
+			return SequentialZstdSource(file);
+		}
+		frames << qMakePair(at, length);
+		at += length;
+	}
+	return ParallelFrames(file, frames, [](const uchar *data, size_t size) { return DecodeZstdFrame(data, size); });
+}
+
+// xz files written with `xz -T` consist of independent blocks, which liblzma's
+// threaded decoder spreads over the cores; single-block files decode serially.
+auto XzSource(std::shared_ptr<MappedFile> file) -> Fallible<ChunkSource>
+{
+	auto stream = std::shared_ptr<lzma_stream>(new lzma_stream{}, [](lzma_stream *strm) {
+		lzma_end(strm);
+		delete strm;
+	});
+	lzma_mt options{};
+	options.flags = LZMA_CONCATENATED;
+	options.threads = quint32(QThread::idealThreadCount());
+	options.memlimit_threading = lzma_physmem() / 4;
+	options.memlimit_stop = UINT64_MAX;
+	if (lzma_stream_decoder_mt(stream.get(), &options) != LZMA_OK)
+	{
+		return Error{"cannot initialise xz decoder"};
+	}
+	stream->next_in = file->data;
+	stream->avail_in = file->size;
+
+	return [file, stream]() -> Fallible<QByteArray> {
+		QByteArray out(1 << 20, Qt::Uninitialized);
+		stream->next_out = reinterpret_cast<uint8_t *>(out.data());
+		stream->avail_out = out.size();
+		const auto ret = lzma_code(stream.get(), LZMA_FINISH);
+		if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+		{
+			return Error{QString("corrupt xz stream (%1)").arg(int(ret))};
+		}
+		out.truncate(out.size() - stream->avail_out);
+		return out;
+	};
+}
+
+// BGZF-style gzip, as written by bgzip, records each member's size in its
+// header and is split and inflated in parallel; any other gzip stream is
+// inflated serially.
+auto GzipMembers(const MappedFile &file) -> QList<QPair<size_t, size_t>>
+{
+	QList<QPair<size_t, size_t>> members;
+	size_t at = 0;
+	while (at + 18 <= file.size)
+	{
+		const auto header = file.data + at;
+		const bool extra = header[0] == 0x1f && header[1] == 0x8b && (header[3] & 0x04);
+		const size_t xlen = header[10] | (header[11] << 8);
+		if (!extra || xlen < 6 || header[12] != 'B' || header[13] != 'C')
+		{
+			return {};
+		}
+		const size_t blockSize = (header[16] | (header[17] << 8)) + 1;
+		members << qMakePair(at, blockSize);
+		at += blockSize;
+	}
+	return at == file.size ? members : QList<QPair<size_t, size_t>>();
+}
+
+auto InflateMember(const uchar *data, size_t size) -> Fallible<QByteArray>
+{
+	z_stream stream{};
+	inflateInit2(&stream, MAX_WBITS + 16);
+	stream.next_in = const_cast<Bytef *>(data);
+	stream.avail_in = uInt(size);
+	QByteArray out;
+	QByteArray buffer(1 << 16, Qt::Uninitialized);
+	int ret;
+	do
+	{
+		stream.next_out = reinterpret_cast<Bytef *>(buffer.data());
+		stream.avail_out = uInt(buffer.size());
+		ret = inflate(&stream, Z_NO_FLUSH);
+		out.append(buffer.constData(), buffer.size() - stream.avail_out);
+	} while (ret == Z_OK);
+	inflateEnd(&stream);
+	if (ret != Z_STREAM_END)
+	{
+		return Error{"corrupt gzip stream"};
+	}
+	return out;
+}
+
+auto GzipSource(std::shared_ptr<MappedFile> file) -> Fallible<ChunkSource>
+{
+	const auto members = GzipMembers(*file);
+	if (!members.isEmpty())
+	{
+		return ParallelFrames(file, members, InflateMember);
+	}
+
+	auto stream = std::shared_ptr<z_stream>(new z_stream{}, [](z_stream *strm) {
+		inflateEnd(strm);
+		delete strm;
+	});
+	inflateInit2(stream.get(), MAX_WBITS + 32);
+	stream->next_in = const_cast<Bytef *>(file->data);
+	stream->avail_in = 0;
+
+	return [file, stream]() -> Fallible<QByteArray> {
+		// avail_in is 32 bits wide, so larger files are fed in pieces.
+		const auto feed = [&file, &stream] {
+			if (stream->avail_in == 0)
+			{
+				const size_t consumed = stream->next_in - file->data;
+				stream->avail_in = uInt(qMin<size_t>(file->size - consumed, UINT_MAX));
+			}
+			return stream->avail_in > 0;
+		};
+		QByteArray out(1 << 20, Qt::Uninitialized);
+		stream->next_out = reinterpret_cast<Bytef *>(out.data());
+		stream->avail_out = uInt(out.size());
+		while (stream->avail_out > 0)
+		{
+			feed();
+			const auto ret = inflate(stream.get(), Z_NO_FLUSH);
+			if (ret == Z_STREAM_END)
+			{
+				if (!feed())
+				{
+					break;
+				}
+				inflateReset(stream.get());
+			}
+			else if (ret == Z_BUF_ERROR)
+			{
+				break;
+			}
+			else if (ret != Z_OK)
+			{
+				return Error{"corrupt gzip stream"};
+			}
+		}
+		out.truncate(out.size() - stream->avail_out);
+		return out;
+	};
+}
+
+// Sequential sources decode zstd only as far as the reader gets instead of
+// running ahead on the pool.
+auto OpenDecompressor(const QString &archive, bool sequential = false) -> Fallible<ChunkSource>
+{
+	auto file = std::make_shared<MappedFile>();
+	const auto opened = file->Open(archive);
+	if (Failed(opened))
+	{
+		return std::get<Error>(opened);
+	}
+	::madvise(const_cast<uchar *>(file->data), file->size, MADV_SEQUENTIAL);
+
+	const auto magic = QByteArray::fromRawData(reinterpret_cast<const char *>(file->data),
+											   qMin<qsizetype>(file->size, 512));
+	if (magic.startsWith("\x28\xb5\x2f\xfd"))
+	{
+		if (sequential)
+		{
+			return SequentialZstdSource(file);
+		}
+		return ZstdSource(file);
+	}
+	if (magic.startsWith(QByteArray("\xfd" "7zXZ\0", 6)))
+	{
+		return XzSource(file);
+	}
+	if (magic.startsWith("\x1f\x8b"))
+	{
+		return GzipSource(file);
+	}
+	if (magic.size() == 512 && magic.mid(257, 5) == "ustar")
+	{
+		auto done = std::make_shared<bool>(false);
+		return ChunkSource([file, done]() -> Fallible<QByteArray> {
+			if (*done)
+			{
+				return QByteArray();
+			}
+			*done = true;
+			return QByteArray::fromRawData(reinterpret_cast<const char *>(file->data), file->size);
+		});
+	}
+	return Error{QString("%1: unsupported archive format").arg(archive)};
+}
+
+auto SafeMemberPath(const QString &path) -> bool
+{
+	if (path.isEmpty() || path.startsWith('/'))
+	{
+		return false;
+	}
+	for (const auto &part : path.split('/'))
+	{
+		if (part == "..")
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// A member written in parts by several tasks; its metadata is applied once
+// the last of them lets go.
+struct ExtractedFile
+{
+	int fd;
+	mode_t mode;
+	time_t mtime;
+
+	ExtractedFile(int fd, qint64 mode, qint64 mtime) : fd(fd), mode(mode_t(mode)), mtime(time_t(mtime)) {}
+	ExtractedFile(const ExtractedFile &) = delete;
+	ExtractedFile &operator=(const ExtractedFile &) = delete;
+	~ExtractedFile()
+	{
+		const struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+		::fchmod(fd, mode & 07777);
+		::futimens(fd, times);
+		::close(fd);
+	}
+};
+
+// Opens a directory below root without following symlinks on the way, so a
+// symlink from an archive cannot redirect what is created under it.
+auto OpenBeneath(const QString &root, const QString &relative) -> int
+{
+	auto fd = ::open(QFile::encodeName(root).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	for (const auto &part : relative.split('/', Qt::SkipEmptyParts))
+	{
+		if (fd < 0)
+		{
+			break;
+		}
+		if (part == ".")
+		{
+			continue;
+		}
+		const auto next =
+			::openat(fd, QFile::encodeName(part).constData(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		const auto err = errno;
+		::close(fd);
+		errno = err;
+		fd = next;
+	}
+	return fd;
+}
+
+// Extracts a .tar.{zst,xz,gz} with the decoder spread over the cores. The
+// reading thread creates directories as it meets them, so file contents can be
+// written by the pool in any order; hard links, symlinks and directory
+// metadata are applied once every write has landed. Symlinks come last and
+// are made in parents opened without following symlinks, so no member, e.g.
+// a/passwd after a -> /etc, is ever written through one.
+auto ExtractArchive(const QString &archive, const QString &destination) -> Fallible<>
+{
+	const auto source = OpenDecompressor(archive);
+	if (Failed(source))
+	{
+		return std::get<Error>(source);
+	}
+	TarReader reader(std::get<ChunkSource>(source));
+
+	// Bytes of file content read but not yet written, in 64 KiB units.
+	constexpr int budgetUnit = 64 << 10;
+	constexpr qint64 partBytes = 4 << 20;
+	QSemaphore budget(4096);
+	QThreadPool writers;
+	QMutex mutex;
+	QStringList errors;
+	QSet<QString> created;
+	QList<TarEntry> hardlinks;
+	QList<TarEntry> symlinks;
+	QList<TarEntry> directories;
+
+	auto makeParent = [&](const QString &path) {
+		const auto parent = QFileInfo(path).path();
+		if (!created.contains(parent))
+		{
+			QDir().mkpath(parent);
+			created << parent;
+		}
+	};
+
+	Fallible<> result = std::monostate{};
+	while (true)
+	{
+		const auto next = reader.Next();
+		if (Failed(next))
+		{
+			result = std::get<Error>(next);
+			break;
+		}
+		const auto entry = std::get<std::optional<TarEntry>>(next);
+		if (!entry.has_value())
+		{
+			break;
+		}
+		if (!SafeMemberPath(entry->path))
+		{
+			result = Error{QString("%1: refusing to extract %2").arg(archive, entry->path)};
+			break;
+		}
+		const auto path = destination + "/" + entry->path;
+
+		if (entry->type == '5')
+		{
+			QDir().mkpath(path);
+			created << QDir::cleanPath(path);
+			directories << *entry;
+		}
+		else if (entry->type == '2')
+		{
+			makeParent(path);
+			symlinks << *entry;
+		}
+		else if (entry->type == '1')
+		{
+			hardlinks << *entry;
+		}
+		else if (entry->type == '0' || entry->type == '7')
+		{
+			makeParent(path);
+			if (entry->size <= partBytes)
+			{
+				// Budget is taken before the data is buffered, so the reader
+				// waits for the writers instead of running ahead of them.
+				const int units = int(qMax<qint64>(1, (entry->size + budgetUnit - 1) / budgetUnit));
+				budget.acquire(units);
+				const auto data = reader.ReadData(entry->size);
+				if (Failed(data))
+				{
+					budget.release(units);
+					result = std::get<Error>(data);
+					break;
+				}
+				writers.start([&, path, units, mode = entry->mode, mtime = time_t(entry->mtime),
+							   content = std::get<QByteArray>(data)] {
+					QFile file(path);
+					QFile::remove(path);
+					if (!file.open(QIODevice::WriteOnly) || file.write(content) != content.size())
+					{
+						QMutexLocker lock(&mutex);
+						errors << QString("cannot write %1: %2").arg(path, file.errorString());
+					}
+					else
+					{
+						file.flush();
+						const struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+						::fchmod(file.handle(), mode & 07777);
+						::futimens(file.handle(), times);
+					}
+					budget.release(units);
+				});
+				continue;
+			}
+
+			// Larger members are written a part at a time at their offsets.
+			::unlink(QFile::encodeName(path).constData());
+			const auto fd = ::open(QFile::encodeName(path).constData(),
+								   O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+			if (fd < 0)
+			{
+				result = Error{QString("cannot create %1: %2").arg(path, qt_error_string(errno))};
+				break;
+			}
+			const auto output = std::make_shared<ExtractedFile>(fd, entry->mode, entry->mtime);
+			for (qint64 offset = 0; offset < entry->size; offset += partBytes)
+			{
+				const auto length = qMin(partBytes, entry->size - offset);
+				const int units = int((length + budgetUnit - 1) / budgetUnit);
+				budget.acquire(units);
+				const auto part = reader.ReadPart(length);
+				if (Failed(part))
+				{
+					budget.release(units);
+					result = std::get<Error>(part);
+					break;
+				}
+				writers.start([&, path, output, offset, units, content = std::get<QByteArray>(part)] {
+					if (::pwrite(output->fd, content.constData(), content.size(), offset) != content.size())
+					{
+						QMutexLocker lock(&mutex);
+						errors << QString("cannot write %1: %2").arg(path, qt_error_string(errno));
+					}
+					budget.release(units);
+				});
+			}
+			if (Failed(result))
+			{
+				break;
+			}
+			const auto padded = reader.SkipPadding(entry->size);
+			if (Failed(padded))
+			{
+				result = padded;
+				break;
+			}
+			continue;
+		}
+
+		const bool hasData = entry->type != '1' && entry->type != '2' && entry->type != '5';
+		const auto skipped = reader.SkipData(hasData ? entry->size : 0);
+		if (Failed(skipped))
+		{
+			result = skipped;
+			break;
+		}
+	}
+	writers.waitForDone();
+
+	if (!Failed(result) && !errors.isEmpty())
+	{
+		result = Error{errors.join('\n')};
+	}
+	if (Failed(result))
+	{
+		return result;
+	}
+
+	for (const auto &link : std::as_const(hardlinks))
+	{
+		const auto path = destination + "/" + link.path;
+		makeParent(path);
+		::unlink(QFile::encodeName(path).constData());
+		if (!SafeMemberPath(link.linkTarget) ||
+			::link(QFile::encodeName(destination + "/" + link.linkTarget).constData(),
+				   QFile::encodeName(path).constData()) != 0)
+		{
+			return Error{QString("cannot create hard link %1").arg(path)};
+		}
+	}
+	for (const auto &link : std::as_const(symlinks))
+	{
+		const auto path = destination + "/" + link.path;
+		const auto name = QFile::encodeName(QFileInfo(link.path).fileName());
+		const auto parent = OpenBeneath(destination, QFileInfo(link.path).path());
+		if (parent >= 0)
+		{
+			::unlinkat(parent, name.constData(), 0);
+		}
+		if (parent < 0 || ::symlinkat(QFile::encodeName(link.linkTarget).constData(), parent, name.constData()) != 0)
+		{
+			const auto err = errno;
+			if (parent >= 0)
+			{
+				::close(parent);
+			}
+			return Error{QString("cannot create symlink %1: %2").arg(path, qt_error_string(err))};
+		}
+		::close(parent);
+	}
+	for (auto it = directories.crbegin(); it != directories.crend(); ++it)
+	{
+		const auto path = QFile::encodeName(destination + "/" + it->path);
+		const struct timespec times[2] = {{time_t(it->mtime), 0}, {time_t(it->mtime), 0}};
+		::chmod(path.constData(), (it->mode & 07777) | 0700);
+		::utimensat(AT_FDCWD, path.constData(), times, 0);
+	}
+	return std::monostate{};
+}
@@ -0,0 +1,563 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QProcess>
+#include <QTemporaryDir>
+#include <QUrl>
+
+#include <functional>
+#include <memory>
+
+#include "error.h"
+#include "extract.h"
+#include "store.h"
+
+auto IsArchive(const QString &name) -> bool
+{
+	static const QStringList suffixes{
+		".tar", ".tar.gz", ".tgz", ".tar.bz2", ".tbz2", ".tar.xz", ".txz",
+		".tar.zst", ".tzst", ".tar.lz", ".tar.lzma", ".zip", ".7z",
+	};
+	for (const auto &suffix : suffixes)
+	{
+		if (name.endsWith(suffix, Qt::CaseInsensitive))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// Receives a source as it is downloaded: hashes it, keeps a copy in the store's
+// staging area and, for archives, feeds bsdtar so extraction runs while the
+// rest of the file is still arriving.
+class SourceSink
+{
+	static constexpr qint64 MaxPending = 8 << 20;
+
+	QCryptographicHash hash{QCryptographicHash::Sha256};
+	QFile staged;
+	QProcess extractor;
+	bool extracting = false;
+	// The tail of bsdtar's stderr, read as it comes so a chatty archive
+	// cannot fill the pipe and stall extraction.
+	QByteArray diagnostics;
+	QString error;
+
+	auto DrainDiagnostics() -> void
+	{
+		diagnostics += extractor.readAllStandardError();
+		if (diagnostics.size() > (64 << 10))
+		{
+			diagnostics = diagnostics.right(64 << 10);
+		}
+	}
+
+public:
+	auto Open(const QString &stagedPath, const QString &extractTo) -> bool
+	{
+		staged.setFileName(stagedPath);
+		if (!staged.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			error = staged.errorString();
+			return false;
+		}
+		if (!extractTo.isEmpty())
+		{
+			extractor.setStandardOutputFile(QProcess::nullDevice());
+			extractor.setReadChannel(QProcess::StandardError);
+			extractor.start("bsdtar", {"-x", "-f", "-", "-C", extractTo});
+			if (!extractor.waitForStarted(-1))
+			{
+				error = "bsdtar: " + extractor.errorString();
+				return false;
+			}
+			extracting = true;
+		}
+		return true;
+	}
+
+	auto Write(const char *data, qint64 size) -> bool
+	{
+		hash.addData(QByteArrayView(data, size));
+		if (staged.write(data, size) != size)
+		{
+			error = staged.errorString();
+			return false;
+		}
+		if (extracting && extractor.state() == QProcess::Running)
+		{
+			extractor.write(data, size);
+			extractor.waitForReadyRead(0);
+			DrainDiagnostics();
+			while (extractor.bytesToWrite() > MaxPending)
+			{
+				const auto written = extractor.waitForBytesWritten(-1);
+				DrainDiagnostics();
+				if (!written)
+				{
+					break;
+				}
+			}
+		}
+		return true;
+	}
+
+	auto Close() -> bool
+	{
+		staged.close();
+		if (extracting)
+		{
+			extractor.closeWriteChannel();
+			extractor.waitForFinished(-1);
+			DrainDiagnostics();
+			if (extractor.exitStatus() != QProcess::NormalExit || extractor.exitCode() != 0)
+			{
+				error = "bsdtar: " + QString::fromLocal8Bit(diagnostics).trimmed();
+				return false;
+			}
+		}
+		return true;
+	}
+
+	auto Digest() -> QByteArray { return hash.result().toHex(); }
+	auto ErrorString() const -> QString { return error; }
+};
+
+auto StreamUrl(QNetworkAccessManager &network, const QUrl &url, SourceSink &sink) -> Fallible<>
+{
+	if (url.isLocalFile())
+	{
+		QFile file(url.toLocalFile());
+		if (!file.open(QIODevice::ReadOnly))
+		{
+			return Error{QString("cannot open %1: %2").arg(file.fileName(), file.errorString())};
+		}
+		QByteArray buffer(1 << 20, Qt::Uninitialized);
+		qint64 got;
+		while ((got = file.read(buffer.data(), buffer.size())) > 0)
+		{
+			if (!sink.Write(buffer.constData(), got))
+			{
+				return Error{sink.ErrorString()};
+			}
+		}
+		if (got < 0)
+		{
+			return Error{file.errorString()};
+		}
+		return std::monostate{};
+	}
+
+	QNetworkRequest request(url);
+	request.setAttribute(QNetworkRequest::RedirectPolicyAttribute,
+						 QNetworkRequest::NoLessSafeRedirectPolicy);
+	const auto reply = network.get(request);
+	reply->setReadBufferSize(4 << 20);
+
+	QEventLoop loop;
+	bool ok = true;
+	QObject::connect(reply, &QNetworkReply::readyRead, &loop, [&] {
+		while (ok && reply->bytesAvailable() > 0)
+		{
+			const auto chunk = reply->read(1 << 20);
+			ok = sink.Write(chunk.constData(), chunk.size());
+		}
+		if (!ok)
+		{
+			reply->abort();
+		}
+	});
+	QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
+	loop.exec();
+
+	const auto rest = reply->readAll();
+	if (ok && !rest.isEmpty())
+	{
+		ok = sink.Write(rest.constData(), rest.size());
+	}
+	const auto networkError = reply->error();
+	const auto networkErrorString = reply->errorString();
+	reply->deleteLater();
+	if (!ok)
+	{
+		return Error{sink.ErrorString()};
+	}
+	if (networkError != QNetworkReply::NoError)
+	{
+		return Error{QString("%1: %2").arg(url.toString(), networkErrorString)};
+	}
+	return std::monostate{};
+}
+
+auto CommitExtracted(const QString &staging, const QString &srcdir) -> Fallible<>
+{
+	const QDir extracted(staging);
+	for (const auto &entry : extracted.entryList(QDir::AllEntries | QDir::Hidden | QDir::System |
+												 QDir::NoDotAndDotDot))
+	{
+		const auto target = srcdir + "/" + entry;
+		if (QFileInfo(target).isDir() && !QFileInfo(target).isSymLink())
+		{
+			QDir(target).removeRecursively();
+		}
+		else
+		{
+			QFile::remove(target);
+		}
+		if (!QDir().rename(extracted.filePath(entry), target))
+		{
+			return Error{QString("cannot move %1 into %2").arg(entry, srcdir)};
+		}
+	}
+	return std::monostate{};
+}
+
+// Downloads url while hashing it and, for archives, extracting it into a
+// staging directory next to srcdir. The extracted tree is moved into srcdir,
+// and the download added to the store, only if the sha256 matches.
+auto FetchSource(QNetworkAccessManager &network, SourceStore &store, const QUrl &url,
+				 const QByteArray &sha256, const QString &srcdir) -> Fallible<>
+{
+	const auto name = QFileInfo(url.path()).fileName();
+	const bool skipCheck = sha256.compare("SKIP", Qt::CaseInsensitive) == 0;
+	QDir().mkpath(srcdir);
+
+	auto from = url;
+	if (!skipCheck && store.Contains(sha256.toLower()))
+	{
+		if (!IsArchive(name))
+		{
+			return store.Checkout(sha256.toLower(), srcdir + "/" + name);
+		}
+		const auto object = store.ObjectPath(sha256.toLower());
+		QTemporaryDir staging(srcdir + "/.extract-XXXXXX");
+		if (!Failed(ExtractArchive(object, staging.path())))
+		{
+			const auto checkedOut = store.Checkout(sha256.toLower(), srcdir + "/" + name);
+			if (Failed(checkedOut))
+			{
+				return checkedOut;
+			}
+			return CommitExtracted(staging.path(), srcdir);
+		}
+		from = QUrl::fromLocalFile(object);
+	}
+
+	QTemporaryDir staging(srcdir + "/.extract-XXXXXX");
+	SourceSink sink;
+	const auto stagedPath = store.StagingPath();
+	if (!sink.Open(stagedPath, IsArchive(name) ? staging.path() : QString()))
+	{
+		QFile::remove(stagedPath);
+		return Error{sink.ErrorString()};
+	}
+
+	const auto streamed = StreamUrl(network, from, sink);
+	const bool closed = sink.Close();
+	if (Failed(streamed) || !closed)
+	{
+		QFile::remove(stagedPath);
+		return Failed(streamed) ? std::get<Error>(streamed) : Error{sink.ErrorString()};
+	}
+
+	const auto digest = sink.Digest();
+	if (!skipCheck && digest.compare(sha256, Qt::CaseInsensitive) != 0)
+	{
+		QFile::remove(stagedPath);
+		return Error{QString("%1: sha256 mismatch, expected %2 got %3")
+						 .arg(name, QString::fromLatin1(sha256), QString::fromLatin1(digest))};
+	}
+
+	const auto adopted = store.Adopt(stagedPath, digest);
+	if (Failed(adopted))
+	{
+		return std::get<Error>(adopted);
+	}
+	const auto checkedOut = store.Checkout(digest, srcdir + "/" + name);
+	if (Failed(checkedOut))
+	{
+		return checkedOut;
+	}
+
+	return CommitExtracted(staging.path(), srcdir);
+}
+
+struct FetchRequest
+{
+	QUrl url;
+	QByteArray sha256;
+};
+
+// Downloads a batch of sources into the store over one QNetworkAccessManager,
+// so connections to the mirror are kept alive and reused. Large files served
+// with Accept-Ranges are split into parallel range requests written straight
+// into their place in the staged file. At most `limit` requests are in flight.
+class Fetcher
+{
+	struct Download
+	{
+		FetchRequest request;
+		QString staged;
+		QCryptographicHash hash{QCryptographicHash::Sha256};
+		bool streamed = false;
+		int pending = 0;
+		QString error;
+	};
+
+	QNetworkAccessManager &network;
+	SourceStore &store;
+	int limit;
+	int active = 0;
+	QList<std::function<void()>> queue;
+	QEventLoop loop;
+	int remaining = 0;
+	QList<std::shared_ptr<Download>> downloads;
+	QList<Fallible<QByteArray>> results;
+
+public:
+	qint64 rangeThreshold = 32 << 20;
+	int rangeParts = 4;
+
+	Fetcher(QNetworkAccessManager &network, SourceStore &store, int limit = 8)
+		: network(network), store(store), limit(limit)
+	{
+	}
+
+	auto FetchAll(const QList<FetchRequest> &requests) -> QList<Fallible<QByteArray>>
+	{
+		results.clear();
+		downloads.clear();
+		QHash<QString, qsizetype> seen;
+		QList<qsizetype> slots;
+
+		for (const auto &request : requests)
+		{
+			const auto key = request.sha256.compare("SKIP", Qt::CaseInsensitive) == 0
+				? request.url.toString()
+				: QString::fromLatin1(request.sha256.toLower());
+			if (const auto it = seen.constFind(key); it != seen.constEnd())
+			{
+				slots << *it;
+				continue;
+			}
+			seen[key] = results.size();
+			slots << results.size();
+
+			if (key != request.url.toString() && store.Contains(key.toLatin1()))
+			{
+				results << key.toLatin1();
+				downloads << nullptr;
+				continue;
+			}
+
+			results << Error{QString("%1: not fetched").arg(request.url.toString())};
+			auto download = std::make_shared<Download>();
+			download->request = request;
+			download->staged = store.StagingPath();
+			downloads << download;
+
+			if (request.url.isLocalFile())
+			{
+				QFile::remove(download->staged);
+				const auto cloned = CloneFile(request.url.toLocalFile(), download->staged);
+				download->error = Failed(cloned) ? std::get<Error>(cloned).message : QString();
+				Finish(results.size() - 1);
+				continue;
+			}
+			++remaining;
+			const auto index = results.size() - 1;
+			Schedule([this, index] { Probe(index); });
+		}
+
+		if (remaining > 0)
+		{
+			loop.exec();
+		}
+
+		QList<Fallible<QByteArray>> ret;
+		for (const auto slot : slots)
+		{
+			ret << results[slot];
+		}
+		return ret;
+	}
+
+private:
+	auto Schedule(std::function<void()> start) -> void
+	{
+		queue << start;
+		Pump();
+	}
+
+	auto Pump() -> void
+	{
+		while (active < limit && !queue.isEmpty())
+		{
+			++active;
+			queue.takeFirst()();
+		}
+	}
+
+	auto Release() -> void
+	{
+		--active;
+		Pump();
+	}
+
+	auto Probe(qsizetype index) -> void
+	{
+		const auto download = downloads[index];
+		const auto reply = network.head(QNetworkRequest(download->request.url));
+		QObject::connect(reply, &QNetworkReply::finished, &loop, [this, index, reply] {
+			const auto download = downloads[index];
+			reply->deleteLater();
+			Release();
+
+			const auto size = reply->header(QNetworkRequest::ContentLengthHeader).toLongLong();
+			const bool ranged = reply->error() == QNetworkReply::NoError &&
+								reply->rawHeader("Accept-Ranges") == "bytes" &&
+								size >= rangeThreshold;
+			if (!ranged)
+			{
+				download->streamed = true;
+				download->pending = 1;
+				Schedule([this, index] { Transfer(index, -1, -1); });
+				return;
+			}
+
+			QFile file(download->staged);
+			if (!file.open(QIODevice::ReadWrite) || !file.resize(size))
+			{
+				download->error = file.errorString();
+				Done(index);
+				return;
+			}
+			const auto part = (size + rangeParts - 1) / rangeParts;
+			for (qint64 from = 0; from < size; from += part)
+			{
+				const auto to = qMin(from + part, size) - 1;
+				++download->pending;
+				Schedule([this, index, from, to] { Transfer(index, from, to); });
+			}
+		});
+	}
+
+	auto Transfer(qsizetype index, qint64 from, qint64 to) -> void
+	{
+		const auto download = downloads[index];
+		QNetworkRequest request(download->request.url);
+		request.setAttribute(QNetworkRequest::RedirectPolicyAttribute,
+							 QNetworkRequest::NoLessSafeRedirectPolicy);
+		if (from >= 0)
+		{
+			request.setRawHeader("Range", QString("bytes=%1-%2").arg(from).arg(to).toLatin1());
+		}
+
+		auto file = std::make_shared<QFile>(download->staged);
+		if (!file->open(QIODevice::ReadWrite) || !file->seek(qMax<qint64>(from, 0)))
+		{
+			download->error = file->errorString();
+			Release();
+			PartDone(index);
+			return;
+		}
+
+		const auto reply = network.get(request);
+		QObject::connect(reply, &QNetworkReply::readyRead, &loop, [download, reply, file] {
+			const auto data = reply->readAll();
+			if (download->streamed)
+			{
+				download->hash.addData(data);
+			}
+			if (file->write(data) != data.size())
+			{
+				download->error = file->errorString();
+				reply->abort();
+			}
+		});
+		QObject::connect(reply, &QNetworkReply::finished, &loop, [this, index, from, reply, file] {
+			const auto download = downloads[index];
+			const auto status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+			if (download->error.isEmpty() && reply->error() != QNetworkReply::NoError)
+			{
+				download->error = reply->errorString();
+			}
+			else if (download->error.isEmpty() && from >= 0 && status != 206)
+			{
+				download->error = QString("server ignored range request (HTTP %1)").arg(status);
+			}
+			file->close();
+			reply->deleteLater();
+			Release();
+			PartDone(index);
+		});
+	}
+
+	auto PartDone(qsizetype index) -> void
+	{
+		if (--downloads[index]->pending > 0)
+		{
+			return;
+		}
+		Done(index);
+	}
+
+	// Settles a scheduled download, and ends the batch after the last one.
+	auto Done(qsizetype index) -> void
+	{
+		Finish(index);
+		if (--remaining == 0)
+		{
+			loop.quit();
+		}
+	}
+
+	auto Finish(qsizetype index) -> void
+	{
+		const auto download = downloads[index];
+		const auto url = download->request.url.toString();
+		if (!download->error.isEmpty())
+		{
+			QFile::remove(download->staged);
+			results[index] = Error{QString("%1: %2").arg(url, download->error)};
+			return;
+		}
+
+		QByteArray digest;
+		if (download->streamed)
+		{
+			digest = download->hash.result().toHex();
+		}
+		else
+		{
+			const auto hashed = FileSha256(download->staged);
+			if (Failed(hashed))
+			{
+				QFile::remove(download->staged);
+				results[index] = std::get<Error>(hashed);
+				return;
+			}
+			digest = std::get<QByteArray>(hashed);
+		}
+
+		const auto expected = download->request.sha256;
+		if (expected.compare("SKIP", Qt::CaseInsensitive) != 0 &&
+			digest.compare(expected, Qt::CaseInsensitive) != 0)
+		{
+			QFile::remove(download->staged);
+			results[index] = Error{QString("%1: sha256 mismatch, expected %2 got %3")
+									   .arg(url, QString::fromLatin1(expected),
+											QString::fromLatin1(digest))};
+			return;
+		}
+		results[index] = store.Adopt(download->staged, digest);
+	}
+};
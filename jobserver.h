@@ -0,0 +1,165 @@
+#pragma once
+
+#include <QDebug>
+#include <QFile>
+#include <QMutex>
+#include <QRegularExpression>
+#include <QSemaphore>
+#include <QThread>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+// Client for the GNU make jobserver; without one, falls back to a local
+// semaphore sized to the machine. A jobserver that stops handing out tokens
+// is given up on, after which only the implicit token is used, so never more
+// jobs run than make allowed.
+class Jobserver
+{
+	int readFd = -1;
+	int writeFd = -1;
+	bool ownsFds = false;
+	QMutex mutex;
+	bool broken = false;
+	QSemaphore implicit{1};
+	QSemaphore local;
+
+	// Blocks until a token arrives, waiting out a non-blocking pipe, or
+	// returns -1 once the jobserver is unusable.
+	auto ReadToken() -> int
+	{
+		while (true)
+		{
+			char token;
+			const auto got = ::read(readFd, &token, 1);
+			if (got == 1)
+			{
+				return uchar(token);
+			}
+			if (got < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			{
+				pollfd wait{readFd, POLLIN, 0};
+				::poll(&wait, 1, -1);
+				continue;
+			}
+			const auto reason = got == 0 ? QString("end of file") : qt_error_string(errno);
+			QMutexLocker lock(&mutex);
+			if (!broken)
+			{
+				broken = true;
+				qWarning().noquote() << "jobserver unusable, running one job at a time:" << reason;
+			}
+			return -1;
+		}
+	}
+
+	static auto ValidFd(int fd) -> bool { return fd >= 0 && ::fcntl(fd, F_GETFD) != -1; }
+
+public:
+	static constexpr int Implicit = -1;
+	static constexpr int Local = -2;
+
+	Jobserver() : local(qMax(0, QThread::idealThreadCount() - 1))
+	{
+		const auto flags = QString::fromLocal8Bit(qgetenv("MAKEFLAGS"));
+		const QRegularExpression fifo("--jobserver-auth=fifo:(\\S+)");
+		const QRegularExpression fds("--jobserver-(?:auth|fds)=(\\d+),(\\d+)");
+
+		if (const auto match = fifo.match(flags); match.hasMatch())
+		{
+			readFd = ::open(QFile::encodeName(match.captured(1)).constData(),
+							O_RDWR | O_CLOEXEC);
+			writeFd = readFd;
+			ownsFds = readFd >= 0;
+		}
+		else if (const auto match = fds.match(flags); match.hasMatch())
+		{
+			readFd = match.captured(1).toInt();
+			writeFd = match.captured(2).toInt();
+			if (!ValidFd(readFd) || !ValidFd(writeFd))
+			{
+				readFd = writeFd = -1;
+			}
+		}
+	}
+	~Jobserver()
+	{
+		if (ownsFds)
+		{
+			::close(readFd);
+		}
+	}
+
+	static auto Global() -> Jobserver &
+	{
+		static Jobserver jobserver;
+		return jobserver;
+	}
+
+	auto Acquire() -> int
+	{
+		if (implicit.tryAcquire())
+		{
+			return Implicit;
+		}
+		if (readFd < 0)
+		{
+			local.acquire();
+			return Local;
+		}
+		{
+			QMutexLocker lock(&mutex);
+			if (broken)
+			{
+				lock.unlock();
+				implicit.acquire();
+				return Implicit;
+			}
+		}
+		if (const auto token = ReadToken(); token >= 0)
+		{
+			return token;
+		}
+		implicit.acquire();
+		return Implicit;
+	}
+
+	auto Release(int token) -> void
+	{
+		if (token == Implicit)
+		{
+			implicit.release();
+		}
+		else if (token == Local)
+		{
+			local.release();
+		}
+		else
+		{
+			const char byte = char(token);
+			while (::write(writeFd, &byte, 1) < 0 && errno == EINTR)
+			{
+			}
+		}
+	}
+};
+
+struct JobToken
+{
+	Jobserver &jobserver;
+	int token;
+
+	JobToken(Jobserver &jobserver = Jobserver::Global())
+		: jobserver(jobserver), token(jobserver.Acquire())
+	{
+	}
+	~JobToken() { jobserver.Release(token); }
+	JobToken(const JobToken &) = delete;
+	JobToken &operator=(const JobToken &) = delete;
+};
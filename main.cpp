@@ -1,39 +1,395 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
 #include <QDebug>
-#include <QString>
+#include <QTextStream>
 
-struct Statement
-{
-	QString lhs;
-	QString rhs;
-};
+#include "buildlog.h"
+#include "buildroot.h"
+#include "daemon.h"
+#include "delta.h"
+#include "elfscan.h"
+#include "fetch.h"
+#include "patch.h"
+#include "query.h"
+#include "repodb.h"
+#include "runner.h"
+#include "snapshot.h"
 
-QDebug operator<<(QDebug debug, const Statement &data)
+int main(int argc, char *argv[])
 {
-	QDebugStateSaver saver(debug);
-	debug.nospace() << "Statement('" << data.lhs << "','" << data.rhs << "')";
-	return debug;
-}
+	QCoreApplication app(argc, argv);
 
-#include "parser.h"
-
-auto colon = String(":");
-auto stringUntil = [](QChar ch) -> Parser<QString>* {
-	return ParseToken([ch](QChar comp) -> bool {
-		return ch != comp;
-	});
-};
-auto untilColon = stringUntil(':');
-auto untilNewlines = stringUntil(':');
-auto statement = untilColon->Before(untilColon)->ThenAlso(untilNewlines)->Map<Statement>([](std::tuple<QString, QString> tuple) -> Statement {
-	auto [lhs, rhs] = tuple;
-	return Statement {
-		.lhs = lhs,
-		.rhs = rhs
-	};
-});
+	QCommandLineParser cli;
+	cli.addHelpOption();
+	const QCommandLineOption daemonOption("daemon", "Serve requests on a unix socket.");
+	const QCommandLineOption socketOption("socket", "Socket path for --daemon.", "path", Daemon::DefaultSocket());
+	const QCommandLineOption watchOption("watch", "Reindex specs under a directory as they change.", "directory");
+	const QCommandLineOption repoOption("repo", "Add the given packages to a repository database.", "database");
+	const QCommandLineOption removeOption("remove", "Remove a package from the --repo database.", "pkgname");
+	const QCommandLineOption listOption("list", "With query, list the members of the packages.");
+	const QCommandLineOption levelOption("level", "zstd level for package.", "level", "19");
+	const QCommandLineOption budgetOption("budget-ms", "Time package compression may take, choosing the level.",
+										  "ms");
+	const QCommandLineOption noStripOption("no-strip", "Do not strip binaries in package.");
+	const QCommandLineOption splitDebugOption("split-debug", "Keep the debug info package strips.");
+	const QCommandLineOption noCompressDocsOption("no-compress-docs", "Leave man and info pages uncompressed.");
+	const QCommandLineOption sha256Option("sha256", "Expected sha256 of the fetch URL in the same position.", "sum");
+	const QCommandLineOption stripOption({"p", "strip"}, "Leading path components patch removes.", "n", "1");
+	const QCommandLineOption reverseOption({"R", "reverse"}, "Apply patches in reverse.");
+	const QCommandLineOption fuzzOption("fuzz", "Context lines a patch hunk may ignore.", "n", "0");
+	const QCommandLineOption sourceOption("source", "A source file prepare's snapshot depends on.", "path");
+	const QCommandLineOption cgroupOption("cgroup", "Delegated cgroup v2 directory to account run phases in.",
+										  "directory");
+	cli.addOptions({daemonOption, socketOption, watchOption, repoOption, removeOption, listOption, levelOption,
+					budgetOption, noStripOption, splitDebugOption, noCompressDocsOption, sha256Option, stripOption,
+					reverseOption, fuzzOption, sourceOption, cgroupOption});
+	cli.addPositionalArgument("packages", "Packages for --repo.", "[packages...]");
+	cli.addPositionalArgument("query", "Print .PKGINFO, or the members with --list, of packages.",
+							  "[query packages...]");
+	cli.addPositionalArgument("delta", "Write a delta package from the previous version of a package.",
+							  "[delta previous current delta]");
+	cli.addPositionalArgument("apply-delta", "Rebuild a package from its previous version and a delta.",
+							  "[apply-delta previous delta output]");
+	cli.addPositionalArgument("sonames", "Print the soname provides and depends of the ELF files under root.",
+							  "[sonames root]");
+	cli.addPositionalArgument("package", "Strip and archive pkgdir into destdir, described by a .PKGINFO.",
+							  "[package pkginfo pkgdir destdir]");
+	cli.addPositionalArgument("fetch", "Fetch sources into srcdir through the source store, extracting archives.",
+							  "[fetch srcdir urls...]");
+	cli.addPositionalArgument("extract", "Extract a .tar.{zst,xz,gz} into a directory.",
+							  "[extract archive directory]");
+	cli.addPositionalArgument("patch", "Apply patches to srcdir.", "[patch srcdir patches...]");
+	cli.addPositionalArgument("prepare", "Run a prep script and patches in srcdir, or restore their snapshot.",
+							  "[prepare srcdir script patches...]");
+	cli.addPositionalArgument("run", "Run scripts as named phases, logging them and their usage to logdir.",
+							  "[run logdir phase script...]");
+	cli.process(app);
 
-int main(int argc, char *argv[])
-{
-	qDebug() << statement->Parse("lhs: rhs\n");
-	return 0;
+	if (cli.isSet(daemonOption))
+	{
+		Daemon daemon;
+		auto started = daemon.Listen(cli.value(socketOption));
+		if (!Failed(started) && cli.isSet(watchOption))
+		{
+			started = daemon.Watch(cli.value(watchOption));
+		}
+		if (Failed(started))
+		{
+			qCritical().noquote() << std::get<Error>(started).message;
+			return 1;
+		}
+		return app.exec();
+	}
+
+	if (cli.isSet(watchOption))
+	{
+		SpecIndex specs;
+		QTextStream out(stdout);
+		SpecWatcher watcher(specs, [&out](const QJsonObject &event) {
+			out << QJsonDocument(event).toJson(QJsonDocument::Compact) << Qt::endl;
+		});
+		const auto watching = watcher.Watch(cli.value(watchOption));
+		if (Failed(watching))
+		{
+			qCritical().noquote() << std::get<Error>(watching).message;
+			return 1;
+		}
+		return app.exec();
+	}
+
+	if (cli.isSet(repoOption))
+	{
+		RepoDatabase database(cli.value(repoOption));
+		auto applied = database.Open();
+		if (!Failed(applied))
+		{
+			applied = database.Apply(cli.positionalArguments(), cli.values(removeOption));
+		}
+		if (Failed(applied))
+		{
+			qCritical().noquote() << std::get<Error>(applied).message;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (cli.positionalArguments().value(0) == "query")
+	{
+		QTextStream out(stdout);
+		for (const auto &package : cli.positionalArguments().mid(1))
+		{
+			if (cli.isSet(listOption))
+			{
+				const auto members = ListPackage(package);
+				if (Failed(members))
+				{
+					qCritical().noquote() << std::get<Error>(members).message;
+					return 1;
+				}
+				for (const auto &member : std::get<QList<TarEntry>>(members))
+				{
+					out << member.path << Qt::endl;
+				}
+				continue;
+			}
+			const auto info = ReadPackageMember(package, ".PKGINFO");
+			if (Failed(info))
+			{
+				qCritical().noquote() << std::get<Error>(info).message;
+				return 1;
+			}
+			out << QString::fromUtf8(std::get<QByteArray>(info));
+		}
+		return 0;
+	}
+
+	const auto verb = cli.positionalArguments().value(0);
+	if ((verb == "delta" || verb == "apply-delta") && cli.positionalArguments().size() == 4)
+	{
+		const auto arguments = cli.positionalArguments();
+		const auto done = verb == "delta" ? WriteDelta(arguments[1], arguments[2], arguments[3])
+										  : ApplyDelta(arguments[1], arguments[2], arguments[3]);
+		if (Failed(done))
+		{
+			qCritical().noquote() << std::get<Error>(done).message;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (verb == "sonames" && cli.positionalArguments().size() == 2)
+	{
+		PkgInfo pkg;
+		AddElfMetadata(pkg, ScanElfTree(cli.positionalArguments()[1]));
+		QTextStream out(stdout);
+		for (const auto &provide : std::as_const(pkg.provides))
+		{
+			out << "provides = " << provide << Qt::endl;
+		}
+		for (const auto &depend : std::as_const(pkg.depends))
+		{
+			out << "depend = " << depend << Qt::endl;
+		}
+		return 0;
+	}
+
+	if (verb == "package" && cli.positionalArguments().size() == 4)
+	{
+		const auto arguments = cli.positionalArguments();
+		QFile info(arguments[1]);
+		if (!info.open(QIODevice::ReadOnly))
+		{
+			qCritical().noquote() << QString("cannot open %1: %2").arg(info.fileName(), info.errorString());
+			return 1;
+		}
+		BuildrootOptions options;
+		options.strip = !cli.isSet(noStripOption);
+		options.splitDebug = cli.isSet(splitDebugOption);
+		options.compressDocs = !cli.isSet(noCompressDocsOption);
+		options.level = cli.value(levelOption).toInt();
+		options.budget.timeMs = cli.value(budgetOption).toLongLong();
+		QDir().mkpath(arguments[3]);
+		const auto packaged = PackageBuildroot(ParsePkgInfo(info.readAll()), arguments[2], arguments[3], options);
+		if (Failed(packaged))
+		{
+			qCritical().noquote() << std::get<Error>(packaged).message;
+			return 1;
+		}
+		QTextStream out(stdout);
+		for (const auto &path : std::get<QStringList>(packaged))
+		{
+			out << path << Qt::endl;
+		}
+		return 0;
+	}
+
+	if (verb == "fetch" && cli.positionalArguments().size() >= 3)
+	{
+		const auto arguments = cli.positionalArguments();
+		QNetworkAccessManager network;
+		SourceStore store;
+		QList<FetchRequest> requests;
+		for (qsizetype i = 2; i < arguments.size(); ++i)
+		{
+			requests << FetchRequest{QUrl::fromUserInput(arguments[i], QDir::currentPath()),
+									 cli.values(sha256Option).value(i - 2, "SKIP").toLatin1()};
+		}
+		// The whole batch is downloaded into the store concurrently first, so
+		// placing each source into srcdir is then a store checkout.
+		Fetcher fetcher(network, store);
+		const auto fetched = fetcher.FetchAll(requests);
+		QTextStream out(stdout);
+		for (qsizetype i = 0; i < requests.size(); ++i)
+		{
+			auto placed = Failed(fetched[i]) ? Fallible<>(std::get<Error>(fetched[i])) : Fallible<>();
+			if (!Failed(placed))
+			{
+				placed = FetchSource(network, store, requests[i].url, std::get<QByteArray>(fetched[i]),
+									 arguments[1]);
+			}
+			if (Failed(placed))
+			{
+				qCritical().noquote() << std::get<Error>(placed).message;
+				return 1;
+			}
+			out << std::get<QByteArray>(fetched[i]) << "  " << requests[i].url.toString() << Qt::endl;
+		}
+		return 0;
+	}
+
+	if (verb == "extract" && cli.positionalArguments().size() == 3)
+	{
+		QDir().mkpath(cli.positionalArguments()[2]);
+		const auto extracted = ExtractArchive(cli.positionalArguments()[1], cli.positionalArguments()[2]);
+		if (Failed(extracted))
+		{
+			qCritical().noquote() << std::get<Error>(extracted).message;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (verb == "patch" && cli.positionalArguments().size() >= 3)
+	{
+		const auto arguments = cli.positionalArguments();
+		const PatchOptions options{cli.value(stripOption).toInt(), cli.isSet(reverseOption),
+								   cli.value(fuzzOption).toInt()};
+		QList<PatchFile> patches;
+		for (const auto &path : arguments.mid(2))
+		{
+			patches << PatchFile{path, options};
+		}
+		const auto patched = ApplyPatches(arguments[1], patches);
+		if (Failed(patched))
+		{
+			qCritical().noquote() << std::get<Error>(patched).message;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (verb == "prepare" && cli.positionalArguments().size() >= 3)
+	{
+		const auto arguments = cli.positionalArguments();
+		const auto srcdir = QFileInfo(arguments[1]).absoluteFilePath();
+		ChecksumCache checksums;
+		PrepInputs inputs{{}, {}, arguments[2]};
+		QList<PatchFile> patches;
+		const PatchOptions options{cli.value(stripOption).toInt(), cli.isSet(reverseOption),
+								   cli.value(fuzzOption).toInt()};
+		for (const auto &path : cli.values(sourceOption) + arguments.mid(3))
+		{
+			const auto digest = checksums.Digest(path);
+			if (Failed(digest))
+			{
+				qCritical().noquote() << std::get<Error>(digest).message;
+				return 1;
+			}
+			if (inputs.sources.size() < cli.values(sourceOption).size())
+			{
+				inputs.sources << std::get<QByteArray>(digest);
+			}
+			else
+			{
+				inputs.patches << std::get<QByteArray>(digest);
+				patches << PatchFile{path, options};
+			}
+		}
+		checksums.Save();
+
+		PrepSnapshots snapshots;
+		const auto key = PrepKey(inputs);
+		if (snapshots.Contains(key))
+		{
+			const auto restored = snapshots.Restore(key, srcdir);
+			if (Failed(restored))
+			{
+				qCritical().noquote() << std::get<Error>(restored).message;
+				return 1;
+			}
+			return 0;
+		}
+		RunOptions run;
+		run.workingDirectory = srcdir;
+		run.logPath = srcdir + "/.prep.log";
+		run.echo = true;
+		const auto ran = RunScript(inputs.script, run);
+		if (Failed(ran))
+		{
+			qCritical().noquote() << std::get<Error>(ran).message;
+			return 1;
+		}
+		if (!std::get<RunResult>(ran).Succeeded())
+		{
+			qCritical().noquote() << "prep script failed, see" << run.logPath;
+			return 1;
+		}
+		QFile::remove(run.logPath);
+		auto prepared = ApplyPatches(srcdir, patches);
+		if (!Failed(prepared))
+		{
+			prepared = snapshots.Save(key, srcdir);
+			snapshots.Prune(8);
+		}
+		if (Failed(prepared))
+		{
+			qCritical().noquote() << std::get<Error>(prepared).message;
+			return 1;
+		}
+		return 0;
+	}
+
+	if (verb == "run" && cli.positionalArguments().size() >= 4 && cli.positionalArguments().size() % 2 == 0)
+	{
+		const auto arguments = cli.positionalArguments();
+		const auto logdir = QFileInfo(arguments[1]).absoluteFilePath();
+		BuildLog log(logdir);
+		ResourceReport report{QFileInfo(logdir).fileName(), 0, {}};
+		for (qsizetype i = 2; i < arguments.size(); i += 2)
+		{
+			RunOptions options;
+			options.workingDirectory = QDir::currentPath();
+			options.sink = log.Sink();
+			options.echo = true;
+			options.cgroup = cli.value(cgroupOption);
+			if (!log.BeginPhase(arguments[i]))
+			{
+				qCritical().noquote() << log.ErrorString();
+				return 1;
+			}
+			const auto ran = RunScript(arguments[i + 1], options);
+			if (Failed(ran))
+			{
+				qCritical().noquote() << std::get<Error>(ran).message;
+				return 1;
+			}
+			const auto &result = std::get<RunResult>(ran);
+			report.phases << PhaseUsage{arguments[i], result.usage};
+			if (!result.Succeeded())
+			{
+				qCritical().noquote() << arguments[i] << "failed:";
+				qCritical().noquote() << QString::fromLocal8Bit(result.tail);
+				return 1;
+			}
+		}
+		if (!log.Finish())
+		{
+			qCritical().noquote() << log.ErrorString();
+			return 1;
+		}
+		report.finished = QDateTime::currentSecsSinceEpoch();
+		auto recorded = report.Save(logdir + "/usage.json");
+		if (!Failed(recorded))
+		{
+			recorded = BuildHistory().Record(report);
+		}
+		if (Failed(recorded))
+		{
+			qCritical().noquote() << std::get<Error>(recorded).message;
+			return 1;
+		}
+		return 0;
+	}
+
+	cli.showHelp(1);
 }
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QSaveFile>
+#include <QTemporaryFile>
+
+#include <memory>
+#include <optional>
+#include <utility>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "adaptive.h"
+#include "error.h"
+#include "pkginfo.h"
+#include "tar.h"
+#include "zstdwriter.h"
+
+auto PackageFileName(const PkgInfo &pkg) -> QString
+{
+	return QString("%1-%2-%3.pkg.tar.zst").arg(pkg.pkgname, pkg.pkgver, pkg.arch);
+}
+
+// Archives a package root into a .pkg.tar.zst. Entries may be added from any
+// thread and in any order; they go into a body stream while the tree is still
+// being processed, and Finish() prepends the metadata as its own zstd frame so
+// .PKGINFO stays the first member without buffering the payload. The payload
+// is cut into frames of frameSize bytes, indexed by a seek table at the end;
+// a frameSize of zero writes one frame and no table. With a budget the level
+// is chosen after sampling the start of the payload instead. The default
+// frameSize is DefaultFrameSize, or one frame when the budget picks a long
+// window, since matches cannot reach across frames.
+class PackageWriter
+{
+	QString root;
+	QString output;
+	int level;
+	// Negative until StartCompressor() settles the default.
+	qint64 frameSize;
+	QMutex mutex;
+	QTemporaryFile body;
+	std::unique_ptr<ZstdWriter> compressor;
+	std::unique_ptr<TarWriter> tar;
+	QHash<QPair<dev_t, ino_t>, QString> inodes;
+	qint64 installedSize = 0;
+	QString error;
+	CompressionBudget budget;
+	qint64 expectedBytes = 0;
+	std::optional<CompressionDecision> decision;
+	QByteArray pending;
+	qint64 streamed = 0;
+	qint64 compressNs = 0;
+
+	// Everything under root, which the payload will be about the size of.
+	auto ExpectedBytes() const -> qint64
+	{
+		qint64 total = 0;
+		QDirIterator it(root, QDir::Files | QDir::Hidden | QDir::System | QDir::NoSymLinks,
+						QDirIterator::Subdirectories);
+		while (it.hasNext())
+		{
+			it.next();
+			total += it.fileInfo().size();
+		}
+		return total;
+	}
+
+	auto StartCompressor() -> bool
+	{
+		auto chosen = level;
+		if (budget.Enabled())
+		{
+			decision = ChooseCompression(pending, expectedBytes, qMax<qint64>(frameSize, 0), budget, level);
+			chosen = decision->level;
+		}
+		if (frameSize < 0)
+		{
+			frameSize = decision.has_value() && decision->windowLog > 0 ? 0 : DefaultFrameSize;
+		}
+		compressor = std::make_unique<ZstdWriter>(body, chosen, 0, frameSize);
+		if (decision.has_value() && decision->windowLog > 0)
+		{
+			compressor->SetLongWindow(decision->windowLog);
+		}
+		const auto data = std::exchange(pending, QByteArray());
+		return Compress(data.constData(), data.size());
+	}
+
+	auto Compress(const char *data, qint64 size) -> bool
+	{
+		QElapsedTimer timer;
+		timer.start();
+		const auto ok = compressor->Write(data, size);
+		compressNs += timer.nsecsElapsed();
+		return ok;
+	}
+
+	// Tar output is held back until the budget has its sample.
+	auto Output(const char *data, qint64 size) -> bool
+	{
+		streamed += size;
+		if (compressor)
+		{
+			return Compress(data, size);
+		}
+		pending.append(data, size);
+		return (budget.Enabled() && pending.size() < budget.sampleBytes) || StartCompressor();
+	}
+
+	auto CompressorError() const -> QString { return compressor ? compressor->ErrorString() : QString(); }
+
+	auto Fail(const QString &message) -> Error
+	{
+		if (error.isEmpty())
+		{
+			error = message;
+		}
+		return Error{error};
+	}
+
+public:
+	static constexpr qint64 DefaultFrameSize = 8 << 20;
+
+	PackageWriter(const QString &root, const QString &output, int level = 19, qint64 frameSize = -1)
+		: root(root), output(output), level(level), frameSize(frameSize), body(output + ".body.XXXXXX")
+	{
+		if (!body.open())
+		{
+			error = body.errorString();
+			return;
+		}
+		tar = std::make_unique<TarWriter>([this](const char *data, qint64 size) { return Output(data, size); });
+	}
+
+	// Before the first AddEntry(). Walks the root for the payload size
+	// before taking the lock, so other threads are not held up meanwhile.
+	auto SetBudget(const CompressionBudget &value) -> void
+	{
+		const auto expected = value.Enabled() ? ExpectedBytes() : 0;
+		QMutexLocker lock(&mutex);
+		budget = value;
+		expectedBytes = expected;
+	}
+
+	auto AddEntry(const QString &relativePath) -> Fallible<>
+	{
+		QMutexLocker lock(&mutex);
+		if (!error.isEmpty())
+		{
+			return Error{error};
+		}
+
+		const auto path = root + "/" + relativePath;
+		struct stat st;
+		if (::lstat(QFile::encodeName(path).constData(), &st) != 0)
+		{
+			return Fail(QString("cannot stat %1: %2").arg(path, qt_error_string(errno)));
+		}
+
+		TarEntry entry;
+		entry.path = relativePath;
+		entry.mode = st.st_mode;
+		entry.mtime = st.st_mtime;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			entry.type = '5';
+			entry.path += "/";
+			if (!tar->WriteEntry(entry))
+			{
+				return Fail(CompressorError());
+			}
+		}
+		else if (S_ISLNK(st.st_mode))
+		{
+			entry.type = '2';
+			QByteArray target(st.st_size + 1, Qt::Uninitialized);
+			const auto len = ::readlink(QFile::encodeName(path).constData(), target.data(), target.size());
+			if (len < 0)
+			{
+				return Fail(QString("cannot read link %1: %2").arg(path, qt_error_string(errno)));
+			}
+			entry.linkTarget = QFile::decodeName(target.left(len));
+			if (!tar->WriteEntry(entry))
+			{
+				return Fail(CompressorError());
+			}
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			const auto key = qMakePair(st.st_dev, st.st_ino);
+			if (st.st_nlink > 1 && inodes.contains(key))
+			{
+				entry.type = '1';
+				entry.linkTarget = inodes[key];
+				if (!tar->WriteEntry(entry))
+				{
+					return Fail(CompressorError());
+				}
+				return std::monostate{};
+			}
+			inodes[key] = relativePath;
+
+			QFile file(path);
+			if (!file.open(QIODevice::ReadOnly))
+			{
+				return Fail(QString("cannot open %1: %2").arg(path, file.errorString()));
+			}
+			entry.size = st.st_size;
+			installedSize += st.st_size;
+			if (!tar->WriteEntry(entry, file))
+			{
+				return Fail(QString("cannot archive %1: %2").arg(path, CompressorError()));
+			}
+		}
+		else
+		{
+			return Fail(QString("%1 is not a regular file, directory or symlink").arg(path));
+		}
+		return std::monostate{};
+	}
+
+	auto Finish(PkgInfo pkg) -> Fallible<>
+	{
+		QMutexLocker lock(&mutex);
+		if (!error.isEmpty())
+		{
+			return Error{error};
+		}
+		if (!tar->Finish() || (!compressor && !StartCompressor()) || !compressor->EndFrame() ||
+			!body.flush())
+		{
+			return Fail(CompressorError());
+		}
+
+		pkg.size = installedSize;
+		QSaveFile out(output);
+		if (!out.open(QIODevice::WriteOnly))
+		{
+			return Fail(out.errorString());
+		}
+
+		QList<ZstdSeekEntry> frames;
+		{
+			ZstdWriter head(out, level);
+			TarWriter headTar([&head](const char *data, qint64 size) {
+				return head.Write(data, size);
+			});
+			TarEntry info;
+			info.path = ".PKGINFO";
+			info.mtime = pkg.builddate;
+			if (!headTar.WriteEntry(info, SerializePkgInfo(pkg)) || !head.EndFrame())
+			{
+				return Fail(head.ErrorString());
+			}
+			frames = head.Frames() + compressor->Frames();
+		}
+
+		body.seek(0);
+		QByteArray buffer(1 << 20, Qt::Uninitialized);
+		qint64 got;
+		while ((got = body.read(buffer.data(), buffer.size())) > 0)
+		{
+			if (out.write(buffer.constData(), got) != got)
+			{
+				return Fail(out.errorString());
+			}
+		}
+		if (got < 0 || (frameSize > 0 && out.write(ZstdSeekTable(frames)) < 0) || !out.commit())
+		{
+			return Fail(out.errorString());
+		}
+
+		if (decision.has_value())
+		{
+			auto entry = decision->ToJson();
+			entry["pkgname"] = pkg.pkgname;
+			entry["pkgver"] = pkg.pkgver;
+			entry["budget_ms"] = budget.timeMs;
+			entry["target_ratio"] = budget.targetRatio;
+			entry["payload_bytes"] = streamed;
+			entry["compressed_bytes"] = body.size();
+			entry["compress_ms"] = compressNs / 1000000;
+			// Only for tuning; a package is not worth failing over it.
+			CompressionLog().Record(entry);
+		}
+		return std::monostate{};
+	}
+};
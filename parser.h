@@ -2,12 +2,58 @@
 
 #include <QBuffer>
 #include <QDebug>
+#include <QHash>
+#include <any>
+#include <atomic>
 #include <variant>
 
+struct MemoEntry
+{
+	qint64 End;
+	// One past the last byte the parser looked at, which may be past End.
+	qint64 Examined;
+	std::any Value;
+};
+
 struct Context
 {
 	QBuffer Buf;
 	qint64 FailedAt;
+	// Set from another thread to make every primitive fail.
+	const std::atomic_bool *Cancel = nullptr;
+	// Successful results of Memoized parsers by (parser, start position).
+	QHash<QPair<quintptr, qint64>, MemoEntry> Memo;
+	qint64 Examined = 0;
+
+	bool Cancelled() const { return Cancel != nullptr && Cancel->load(std::memory_order_relaxed); }
+	// Primitives call this after reading, so memo entries know what they saw.
+	void Examine() { Examined = qMax(Examined, Buf.pos()); }
+
+	// Replaces `removed` bytes at `offset` with `inserted`. Memo entries that
+	// never looked at the edited bytes survive, moved if they come after it.
+	void ApplyEdit(qint64 offset, qint64 removed, const QByteArray &inserted)
+	{
+		Buf.buffer().replace(offset, removed, inserted);
+		Buf.seek(0);
+		const auto delta = inserted.size() - removed;
+		QHash<QPair<quintptr, qint64>, MemoEntry> kept;
+		kept.reserve(Memo.size());
+		for (auto it = Memo.cbegin(); it != Memo.cend(); ++it)
+		{
+			const auto start = it.key().second;
+			if (it->Examined < offset)
+			{
+				kept.insert(it.key(), *it);
+			}
+			else if (start >= offset + removed)
+			{
+				kept.insert(qMakePair(it.key().first, start + delta),
+							MemoEntry{it->End + delta, it->Examined + delta, it->Value});
+			}
+		}
+		Memo = std::move(kept);
+		Examined = 0;
+	}
 };
 
 struct Failure
@@ -79,6 +125,11 @@ QDebug operator<<(QDebug debug, const Result<T> &data)
 	return debug;
 }
 
+auto CancelledFailure(const Context &ctx) -> Failure
+{
+	return Failure{"", "<cancelled>", ctx.Buf.pos()};
+}
+
 template <class T>
 Result<T> NewFailure(const Failure &fail)
 {
@@ -116,6 +167,14 @@ public:
 		ctx->Buf.open(QIODevice::ReadOnly);
 		return this->operator()(*ctx);
 	}
+	Result<T> ParseBytes(const QByteArray &bytes, const std::atomic_bool *cancel = nullptr)
+	{
+		Context local{};
+		local.Cancel = cancel;
+		local.Buf.setData(bytes);
+		local.Buf.open(QIODevice::ReadOnly);
+		return this->operator()(local);
+	}
 	template <class F>
 	Parser<F> *Map(std::function<F(T)> mapper)
 	{
@@ -353,6 +412,30 @@ public:
 				}
 			});
 	}
+	// Remembers successful results in the Context so reparsing after an edit
+	// only runs this parser again where the edit touched what it read.
+	Parser<T> *Memoized()
+	{
+		return ParserFrom<T>([this](Context &ctx) -> Result<T> {
+			const auto key = qMakePair(quintptr(this), ctx.Buf.pos());
+			const auto it = ctx.Memo.constFind(key);
+			if (it != ctx.Memo.constEnd())
+			{
+				ctx.Buf.seek(it->End);
+				ctx.Examined = qMax(ctx.Examined, it->Examined);
+				return std::any_cast<Result<T>>(it->Value);
+			}
+			const auto outer = ctx.Examined;
+			ctx.Examined = key.second;
+			const auto result = this->operator()(ctx);
+			if (std::holds_alternative<T>(result))
+			{
+				ctx.Memo.insert(key, MemoEntry{ctx.Buf.pos(), ctx.Examined, result});
+			}
+			ctx.Examined = qMax(outer, ctx.Examined);
+			return result;
+		});
+	}
 	Parser<QString> *ManyString()
 	{
 		return this->Many()->template Map<QString>(
@@ -422,7 +505,12 @@ auto String(const QString &str) -> Parser<QString> *
 	return ParserFrom<QString>([str](Context &ctx) -> Result<QString> {
 		Holder hold(ctx);
 		Result<QString> res;
+		if (ctx.Cancelled())
+		{
+			return NewFailure<QString>(CancelledFailure(ctx));
+		}
 		const auto read = ctx.Buf.read(str.length());
+		ctx.Examine();
 		if (read.length() < str.length())
 		{
 			res = Failure{str, QString(read)};
@@ -457,6 +545,7 @@ auto SkipWhitespace =
 		{
 			ctx.Buf.read(&ch, 1);
 		} while (QChar(ch).isSpace() && !ctx.Buf.atEnd());
+		ctx.Examine();
 		ctx.Buf.seek(ctx.Buf.pos() - 1);
 		return NewSuccess<std::monostate>({});
 	});
@@ -466,8 +555,13 @@ auto ParseToken(std::function<bool(QChar)> fn) -> Parser<QString> *
 	return ParserFrom<QString>([fn](Context &ctx) -> Result<QString> {
 		Holder hold(ctx);
 		Result<QString> res;
+		if (ctx.Cancelled())
+		{
+			return NewFailure<QString>(CancelledFailure(ctx));
+		}
 		char ch = 0;
 		const auto read = ctx.Buf.read(&ch, 1);
+		ctx.Examine();
 		if (read == 0)
 		{
 			res = Failure{"", "<EOF>"};
@@ -497,7 +591,12 @@ auto GoIdentifier = Map<QString>(
 auto Any =
 	ParserFrom<QChar>([](Context &ctx) -> Result<QChar> {
 		char ch = 0;
+		if (ctx.Cancelled())
+		{
+			return Result<QChar>(CancelledFailure(ctx));
+		}
 		const auto read = ctx.Buf.read(1);
+		ctx.Examine();
 		if (read == 0)
 		{
 			return Result<QChar>(Failure{"", "<EOF>"});
@@ -0,0 +1,568 @@
+#pragma once
+
+#include <QByteArrayView>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QRegularExpression>
+#include <QSaveFile>
+#include <QtConcurrent>
+
+#include <cstring>
+#include <fcntl.h>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "parser.h"
+
+struct HunkLine
+{
+	char kind;
+	QByteArray text;
+	bool newline = true;
+};
+
+struct Hunk
+{
+	qint64 oldStart = 0;
+	qint64 oldCount = 1;
+	qint64 newStart = 0;
+	qint64 newCount = 1;
+	QList<HunkLine> lines;
+};
+
+struct FilePatch
+{
+	QByteArray oldPath;
+	QByteArray newPath;
+	QList<Hunk> hunks;
+};
+
+auto PrefixedLine(const QByteArray &prefix) -> Parser<QByteArray> *
+{
+	return ParserFrom<QByteArray>([prefix](Context &ctx) -> Result<QByteArray> {
+		Holder hold(ctx);
+		if (ctx.Cancelled())
+		{
+			return NewFailure<QByteArray>(CancelledFailure(ctx));
+		}
+		auto line = ctx.Buf.readLine();
+		ctx.Examine();
+		if (line.isEmpty())
+		{
+			return NewFailure<QByteArray>(Failure{QString(prefix), "<EOF>", ctx.Buf.pos()});
+		}
+		if (!line.startsWith(prefix))
+		{
+			return NewFailure<QByteArray>(Failure{QString(prefix), QString(line), ctx.Buf.pos()});
+		}
+		if (line.endsWith('\n'))
+		{
+			line.chop(1);
+		}
+		return hold.Wrap(NewSuccess(line.mid(prefix.size())));
+	});
+}
+
+auto AnyLine = PrefixedLine("");
+
+auto HunkLineOf(char kind) -> Parser<HunkLine> *
+{
+	return PrefixedLine(QByteArray(1, kind))->Map<HunkLine>([kind](QByteArray text) {
+		return HunkLine{kind, text};
+	});
+}
+
+// Some tools strip the trailing space from empty context lines.
+auto EmptyContextLine =
+	ParserFrom<HunkLine>([](Context &ctx) -> Result<HunkLine> {
+		Holder hold(ctx);
+		const auto line = ctx.Buf.readLine();
+		if (line != "\n")
+		{
+			return NewFailure<HunkLine>(Failure{"\\n", QString(line), ctx.Buf.pos()});
+		}
+		return hold.Wrap(NewSuccess(HunkLine{' ', QByteArray()}));
+	});
+
+auto AnyHunkLine =
+	HunkLineOf(' ')->Or(HunkLineOf('-'))->Or(HunkLineOf('+'))->Or(EmptyContextLine);
+
+auto NoNewlineMarker = PrefixedLine("\\");
+auto HunkHeaderLine = PrefixedLine("@@ ");
+auto OldFileLine = PrefixedLine("--- ");
+auto NewFileLine = PrefixedLine("+++ ");
+
+auto HunkHeader = ParserFrom<Hunk>([](Context &ctx) -> Result<Hunk> {
+	static const QRegularExpression header("^-(\\d+)(?:,(\\d+))? \\+(\\d+)(?:,(\\d+))? @@");
+	Holder hold(ctx);
+	const auto line = (*HunkHeaderLine)(ctx);
+	if (std::holds_alternative<Failure>(line))
+	{
+		return NewFailure<Hunk>(std::get<Failure>(line));
+	}
+	const auto match = header.match(QString::fromLatin1(std::get<QByteArray>(line)));
+	if (!match.hasMatch())
+	{
+		return NewFailure<Hunk>(Failure{"hunk header", QString(std::get<QByteArray>(line)), ctx.Buf.pos()});
+	}
+	Hunk hunk;
+	hunk.oldStart = match.captured(1).toLongLong();
+	hunk.oldCount = match.captured(2).isEmpty() ? 1 : match.captured(2).toLongLong();
+	hunk.newStart = match.captured(3).toLongLong();
+	hunk.newCount = match.captured(4).isEmpty() ? 1 : match.captured(4).toLongLong();
+	return hold.Wrap(NewSuccess(hunk));
+});
+
+// A hunk's body is bounded by the counts in its header rather than by what the
+// lines look like, since a removed line may itself start with "--".
+auto HunkParser = ParserFrom<Hunk>([](Context &ctx) -> Result<Hunk> {
+	Holder hold(ctx);
+	const auto header = (*HunkHeader)(ctx);
+	if (std::holds_alternative<Failure>(header))
+	{
+		return header;
+	}
+	auto hunk = std::get<Hunk>(header);
+	qint64 oldSeen = 0;
+	qint64 newSeen = 0;
+	while (oldSeen < hunk.oldCount || newSeen < hunk.newCount)
+	{
+		const auto line = (*AnyHunkLine)(ctx);
+		if (std::holds_alternative<Failure>(line))
+		{
+			return NewFailure<Hunk>(std::get<Failure>(line));
+		}
+		const auto hunkLine = std::get<HunkLine>(line);
+		oldSeen += hunkLine.kind != '+';
+		newSeen += hunkLine.kind != '-';
+		hunk.lines << hunkLine;
+		if (std::holds_alternative<QByteArray>((*NoNewlineMarker)(ctx)))
+		{
+			hunk.lines.last().newline = false;
+		}
+	}
+	if (oldSeen != hunk.oldCount || newSeen != hunk.newCount)
+	{
+		return NewFailure<Hunk>(Failure{"hunk matching its header", "overlong hunk", ctx.Buf.pos()});
+	}
+	return hold.Wrap(NewSuccess(hunk));
+});
+
+// Every "@@ " line must start a hunk that parses in full, so a truncated or
+// miscounted hunk fails the patch rather than being applied in part.
+auto HunkList = ParserFrom<QList<Hunk>>([](Context &ctx) -> Result<QList<Hunk>> {
+	Holder hold(ctx);
+	QList<Hunk> hunks;
+	while (ctx.Buf.peek(3) == "@@ ")
+	{
+		const auto at = ctx.Buf.pos();
+		const auto hunk = (*HunkParser)(ctx);
+		if (std::holds_alternative<Failure>(hunk))
+		{
+			const auto &failure = std::get<Failure>(hunk);
+			return NewFailure<QList<Hunk>>(Failure{"hunk matching its header", failure.got, at});
+		}
+		hunks << std::get<Hunk>(hunk);
+	}
+	if (hunks.isEmpty())
+	{
+		return NewFailure<QList<Hunk>>(Failure{"@@", "no hunks", ctx.Buf.pos()});
+	}
+	return hold.Wrap(NewSuccess(hunks));
+});
+
+auto FileHeader = ParserFrom<FilePatch>([](Context &ctx) -> Result<FilePatch> {
+	Holder hold(ctx);
+	const auto oldPath = (*OldFileLine)(ctx);
+	if (std::holds_alternative<Failure>(oldPath))
+	{
+		return NewFailure<FilePatch>(std::get<Failure>(oldPath));
+	}
+	const auto newPath = (*NewFileLine)(ctx);
+	if (std::holds_alternative<Failure>(newPath))
+	{
+		return NewFailure<FilePatch>(std::get<Failure>(newPath));
+	}
+	return hold.Wrap(NewSuccess(FilePatch{std::get<QByteArray>(oldPath), std::get<QByteArray>(newPath)}));
+});
+
+// The whole input is consumed: anything between file patches that is not a
+// "---"/"+++" pair (commit messages, "diff --git" lines, signatures) is
+// skipped, but a file header must be followed by hunks that parse.
+auto UnifiedDiff = ParserFrom<QList<FilePatch>>([](Context &ctx) -> Result<QList<FilePatch>> {
+	Holder hold(ctx);
+	QList<FilePatch> patches;
+	while (!ctx.Buf.atEnd())
+	{
+		if (ctx.Cancelled())
+		{
+			return NewFailure<QList<FilePatch>>(CancelledFailure(ctx));
+		}
+		const auto header = (*FileHeader)(ctx);
+		if (std::holds_alternative<Failure>(header))
+		{
+			(*AnyLine)(ctx);
+			continue;
+		}
+		const auto hunks = (*HunkList)(ctx);
+		if (std::holds_alternative<Failure>(hunks))
+		{
+			return NewFailure<QList<FilePatch>>(std::get<Failure>(hunks));
+		}
+		patches << std::get<FilePatch>(header);
+		patches.last().hunks = std::get<QList<Hunk>>(hunks);
+	}
+	return hold.Wrap(NewSuccess(patches));
+});
+
+struct PatchOptions
+{
+	int strip = 1;
+	bool reverse = false;
+	// rpm's %_default_patch_fuzz.
+	int fuzz = 0;
+};
+
+struct PatchFile
+{
+	QString path;
+	PatchOptions options;
+};
+
+auto StripPatchPath(QByteArray path, int strip) -> QString
+{
+	if (const auto tab = path.indexOf('\t'); tab >= 0)
+	{
+		path.truncate(tab);
+	}
+	path = path.trimmed();
+	if (path == "/dev/null")
+	{
+		return QString();
+	}
+	auto parts = QFile::decodeName(path).split('/');
+	parts.remove(0, qMin<qsizetype>(strip, parts.size() - 1));
+	return parts.join('/');
+}
+
+struct FileLine
+{
+	QByteArrayView text;
+	bool newline;
+};
+
+struct ScheduledPatch
+{
+	const FilePatch *patch;
+	PatchOptions options;
+	QString patchName;
+	bool creates;
+	bool deletes;
+};
+
+// Applies the hunks of one file patch to lines in a single pass: every hunk is
+// located first (with the same offset and fuzz search as patch(1)), then the
+// output is stitched together from the untouched ranges and the new lines.
+auto ApplyFilePatch(QList<FileLine> &lines, const ScheduledPatch &scheduled) -> Fallible<>
+{
+	const auto reverse = scheduled.options.reverse;
+	const char removed = reverse ? '+' : '-';
+	const char added = reverse ? '-' : '+';
+
+	struct Placement
+	{
+		qint64 at;
+		qint64 length;
+		QList<FileLine> replacement;
+	};
+	QList<Placement> placements;
+	qint64 offset = 0;
+	qint64 floor = 0;
+	int number = 0;
+
+	for (const auto &hunk : scheduled.patch->hunks)
+	{
+		++number;
+		QList<const HunkLine *> before;
+		QList<const HunkLine *> after;
+		for (const auto &line : hunk.lines)
+		{
+			if (line.kind != added)
+			{
+				before << &line;
+			}
+			if (line.kind != removed)
+			{
+				after << &line;
+			}
+		}
+		const auto start = reverse ? hunk.newStart : hunk.oldStart;
+		const auto count = reverse ? hunk.newCount : hunk.oldCount;
+		const qint64 base = (count == 0 ? start : start - 1) + offset;
+
+		auto leading = [&](int fuzz) {
+			qsizetype n = 0;
+			while (n < fuzz && n < before.size() && before[n]->kind == ' ')
+			{
+				++n;
+			}
+			return n;
+		};
+		auto trailing = [&](int fuzz) {
+			qsizetype n = 0;
+			while (n < fuzz && n < before.size() && before[before.size() - 1 - n]->kind == ' ')
+			{
+				++n;
+			}
+			return n;
+		};
+		auto matches = [&](qint64 at, qsizetype front, qsizetype back) {
+			const auto length = before.size() - front - back;
+			if (at < floor || at + length > lines.size())
+			{
+				return false;
+			}
+			for (qsizetype i = 0; i < length; ++i)
+			{
+				if (lines[at + i].text != QByteArrayView(before[front + i]->text))
+				{
+					return false;
+				}
+			}
+			return true;
+		};
+
+		std::optional<Placement> found;
+		for (int fuzz = 0; fuzz <= scheduled.options.fuzz && !found; ++fuzz)
+		{
+			const auto front = leading(fuzz);
+			const auto back = qMin(trailing(fuzz), before.size() - front);
+			const auto expected = base + front;
+			for (qint64 delta = 0; !found; ++delta)
+			{
+				const auto later = expected + delta;
+				const auto earlier = expected - delta;
+				if (later > lines.size() && earlier < floor)
+				{
+					break;
+				}
+				for (const auto at : {later, earlier})
+				{
+					if (!matches(at, front, back))
+					{
+						continue;
+					}
+					Placement placement{at, before.size() - front - back, {}};
+					for (qsizetype i = front; i < after.size() - back; ++i)
+					{
+						placement.replacement << FileLine{after[i]->text, after[i]->newline};
+					}
+					offset += at - expected;
+					found = placement;
+					break;
+				}
+			}
+		}
+		if (!found)
+		{
+			return Error{QString("%1: hunk #%2 FAILED at %3")
+							 .arg(scheduled.patchName)
+							 .arg(number)
+							 .arg(start)};
+		}
+		floor = found->at + found->length;
+		placements << *found;
+	}
+
+	QList<FileLine> output;
+	output.reserve(lines.size());
+	qint64 cursor = 0;
+	for (const auto &placement : std::as_const(placements))
+	{
+		output.append(lines.mid(cursor, placement.at - cursor));
+		output.append(placement.replacement);
+		cursor = placement.at + placement.length;
+	}
+	output.append(lines.mid(cursor));
+	lines = output;
+	return std::monostate{};
+}
+
+// Maps target, runs every scheduled patch for it in order on the in-memory
+// line list and writes the result once.
+auto PatchTarget(const QString &path, const QList<ScheduledPatch> &scheduled) -> Fallible<>
+{
+	QList<FileLine> lines;
+	void *map = MAP_FAILED;
+	size_t size = 0;
+	struct stat st{};
+
+	const auto fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+	const bool existed = fd >= 0;
+	if (existed)
+	{
+		::fstat(fd, &st);
+		size = st.st_size;
+		if (size > 0)
+		{
+			map = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		::close(fd);
+		if (size > 0 && map == MAP_FAILED)
+		{
+			return Error{QString("cannot map %1: %2").arg(path, qt_error_string(errno))};
+		}
+	}
+	else if (!scheduled.first().creates)
+	{
+		return Error{QString("%1: can't find file to patch").arg(path)};
+	}
+
+	if (map != MAP_FAILED)
+	{
+		::madvise(map, size, MADV_SEQUENTIAL);
+		const auto data = static_cast<const char *>(map);
+		size_t at = 0;
+		while (at < size)
+		{
+			const auto end = static_cast<const char *>(std::memchr(data + at, '\n', size - at));
+			if (end == nullptr)
+			{
+				lines << FileLine{QByteArrayView(data + at, qsizetype(size - at)), false};
+				break;
+			}
+			lines << FileLine{QByteArrayView(data + at, end - (data + at)), true};
+			at = end - data + 1;
+		}
+	}
+
+	Fallible<> result = std::monostate{};
+	bool deleted = false;
+	for (const auto &patch : scheduled)
+	{
+		result = ApplyFilePatch(lines, patch);
+		if (Failed(result))
+		{
+			break;
+		}
+		deleted = patch.deletes && lines.isEmpty();
+	}
+
+	if (!Failed(result))
+	{
+		if (deleted)
+		{
+			QFile::remove(path);
+		}
+		else
+		{
+			QByteArray output;
+			output.reserve(size + 4096);
+			for (const auto &line : std::as_const(lines))
+			{
+				output.append(line.text);
+				if (line.newline)
+				{
+					output.append('\n');
+				}
+			}
+			QDir().mkpath(QFileInfo(path).absolutePath());
+			QSaveFile file(path);
+			if (!file.open(QIODevice::WriteOnly) || file.write(output) != output.size() ||
+				!file.commit())
+			{
+				result = Error{QString("cannot write %1: %2").arg(path, file.errorString())};
+			}
+			else if (existed)
+			{
+				::chmod(QFile::encodeName(path).constData(), st.st_mode & 07777);
+			}
+		}
+	}
+
+	if (map != MAP_FAILED)
+	{
+		::munmap(map, size);
+	}
+	return result;
+}
+
+// Applies patches in order. Each patch is parsed with the combinators above;
+// hunks are then grouped by target file so that files touched by different
+// patches are rewritten once, and disjoint files are patched in parallel.
+auto ApplyPatches(const QString &srcdir, const QList<PatchFile> &patches) -> Fallible<>
+{
+	const auto parsed = QtConcurrent::blockingMapped<QList<Fallible<QList<FilePatch>>>>(
+		patches, [](const PatchFile &patch) -> Fallible<QList<FilePatch>> {
+			QFile file(patch.path);
+			if (!file.open(QIODevice::ReadOnly))
+			{
+				return Error{QString("cannot open %1: %2").arg(patch.path, file.errorString())};
+			}
+			const auto bytes = file.readAll();
+			const auto result = UnifiedDiff->ParseBytes(bytes);
+			if (std::holds_alternative<Failure>(result))
+			{
+				const auto &failure = std::get<Failure>(result);
+				return Error{QString("%1:%2: malformed patch: expected %3, got %4")
+								 .arg(patch.path)
+								 .arg(bytes.left(failure.position).count('\n') + 1)
+								 .arg(failure.expected, failure.got.trimmed())};
+			}
+			const auto files = std::get<QList<FilePatch>>(result);
+			if (files.isEmpty())
+			{
+				return Error{QString("%1: only garbage was found in the patch input").arg(patch.path)};
+			}
+			return files;
+		});
+
+	QMap<QString, QList<ScheduledPatch>> targets;
+	for (qsizetype i = 0; i < patches.size(); ++i)
+	{
+		if (Failed(parsed[i]))
+		{
+			return std::get<Error>(parsed[i]);
+		}
+		const auto &options = patches[i].options;
+		for (const auto &file : std::get<QList<FilePatch>>(parsed[i]))
+		{
+			auto from = StripPatchPath(file.oldPath, options.strip);
+			auto to = StripPatchPath(file.newPath, options.strip);
+			if (options.reverse)
+			{
+				std::swap(from, to);
+			}
+			auto target = to.isEmpty() ? from : to;
+			if (!from.isEmpty() && !to.isEmpty() && !QFileInfo::exists(srcdir + "/" + to) &&
+				QFileInfo::exists(srcdir + "/" + from))
+			{
+				target = from;
+			}
+			targets[srcdir + "/" + target] << ScheduledPatch{
+				&file, options, QFileInfo(patches[i].path).fileName(), from.isEmpty(), to.isEmpty()};
+		}
+	}
+
+	const auto keys = targets.keys();
+	const auto results = QtConcurrent::blockingMapped<QList<Fallible<>>>(
+		keys, [&targets](const QString &path) { return PatchTarget(path, targets.value(path)); });
+	QStringList errors;
+	for (const auto &result : results)
+	{
+		if (Failed(result))
+		{
+			errors << std::get<Error>(result).message;
+		}
+	}
+	if (!errors.isEmpty())
+	{
+		return Error{errors.join('\n')};
+	}
+	return std::monostate{};
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+struct PkgInfo
+{
+	QString pkgname;
+	QString pkgbase;
+	QString pkgver;
+	QString pkgdesc;
+	QString url;
+	QString packager;
+	QString arch;
+	qint64 builddate = 0;
+	qint64 size = 0;
+	QStringList license;
+	QStringList groups;
+	QStringList replaces;
+	QStringList depends;
+	QStringList optdepends;
+	QStringList makedepends;
+	QStringList checkdepends;
+	QStringList conflicts;
+	QStringList provides;
+	QStringList backup;
+
+	auto operator==(const PkgInfo &) const -> bool = default;
+};
+
+auto SerializePkgInfo(const PkgInfo &info) -> QByteArray
+{
+	QByteArray ret;
+	auto field = [&ret](const char *key, const QString &value) {
+		if (value.isEmpty())
+		{
+			return;
+		}
+		ret += key;
+		ret += " = ";
+		ret += value.toUtf8();
+		ret += '\n';
+	};
+	auto fields = [&field](const char *key, const QStringList &values) {
+		for (const auto &value : values)
+		{
+			field(key, value);
+		}
+	};
+
+	ret += "# Generated by alpmbuild++\n";
+	field("pkgname", info.pkgname);
+	field("pkgbase", info.pkgbase.isEmpty() ? info.pkgname : info.pkgbase);
+	field("pkgver", info.pkgver);
+	field("pkgdesc", info.pkgdesc);
+	field("url", info.url);
+	field("builddate", QString::number(info.builddate));
+	field("packager", info.packager);
+	field("size", QString::number(info.size));
+	field("arch", info.arch);
+	fields("license", info.license);
+	fields("group", info.groups);
+	fields("replaces", info.replaces);
+	fields("depend", info.depends);
+	fields("optdepend", info.optdepends);
+	fields("makedepend", info.makedepends);
+	fields("checkdepend", info.checkdepends);
+	fields("conflict", info.conflicts);
+	fields("provides", info.provides);
+	fields("backup", info.backup);
+	return ret;
+}
+
+// Reads "key = value" lines back, skipping comments and unknown keys.
+auto ParsePkgInfo(const QByteArray &data) -> PkgInfo
+{
+	PkgInfo info;
+	const QHash<QByteArray, QString *> fields{
+		{"pkgname", &info.pkgname},
+		{"pkgbase", &info.pkgbase},
+		{"pkgver", &info.pkgver},
+		{"pkgdesc", &info.pkgdesc},
+		{"url", &info.url},
+		{"packager", &info.packager},
+		{"arch", &info.arch},
+	};
+	const QHash<QByteArray, QStringList *> lists{
+		{"license", &info.license},
+		{"group", &info.groups},
+		{"replaces", &info.replaces},
+		{"depend", &info.depends},
+		{"optdepend", &info.optdepends},
+		{"makedepend", &info.makedepends},
+		{"checkdepend", &info.checkdepends},
+		{"conflict", &info.conflicts},
+		{"provides", &info.provides},
+		{"backup", &info.backup},
+	};
+	for (const auto &line : data.split('\n'))
+	{
+		const auto equals = line.indexOf(" = ");
+		if (line.startsWith('#') || equals < 0)
+		{
+			continue;
+		}
+		const auto key = line.left(equals);
+		const auto value = QString::fromUtf8(line.mid(equals + 3));
+		if (const auto field = fields.value(key))
+		{
+			*field = value;
+		}
+		else if (const auto list = lists.value(key))
+		{
+			*list << value;
+		}
+		else if (key == "builddate")
+		{
+			info.builddate = value.toLongLong();
+		}
+		else if (key == "size")
+		{
+			info.size = value.toLongLong();
+		}
+	}
+	return info;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QList>
+#include <QString>
+
+#include <optional>
+
+#include "error.h"
+#include "extract.h"
+#include "pkginfo.h"
+#include "tar.h"
+
+// Reads one member of a package straight out of the compressed stream and
+// stops there. .PKGINFO comes first in our packages, so reading it decodes
+// only the first zstd frame.
+auto ReadPackageMember(const QString &package, const QString &member) -> Fallible<QByteArray>
+{
+	const auto source = OpenDecompressor(package, true);
+	if (Failed(source))
+	{
+		return std::get<Error>(source);
+	}
+	TarReader reader(std::get<ChunkSource>(source));
+	while (true)
+	{
+		const auto next = reader.Next();
+		if (Failed(next))
+		{
+			return Error{QString("%1: %2").arg(package, std::get<Error>(next).message)};
+		}
+		const auto entry = std::get<std::optional<TarEntry>>(next);
+		if (!entry.has_value())
+		{
+			return Error{QString("%1: no %2").arg(package, member)};
+		}
+		if (entry->path == member)
+		{
+			return reader.ReadData(entry->size);
+		}
+		const auto skipped = reader.SkipData(entry->size);
+		if (Failed(skipped))
+		{
+			return std::get<Error>(skipped);
+		}
+	}
+}
+
+auto ReadPackageInfo(const QString &package) -> Fallible<PkgInfo>
+{
+	const auto data = ReadPackageMember(package, ".PKGINFO");
+	if (Failed(data))
+	{
+		return std::get<Error>(data);
+	}
+	return ParsePkgInfo(std::get<QByteArray>(data));
+}
+
+// Every member's header, without writing anything to disk.
+auto ListPackage(const QString &package) -> Fallible<QList<TarEntry>>
+{
+	const auto source = OpenDecompressor(package);
+	if (Failed(source))
+	{
+		return std::get<Error>(source);
+	}
+	TarReader reader(std::get<ChunkSource>(source));
+	QList<TarEntry> ret;
+	while (true)
+	{
+		const auto next = reader.Next();
+		if (Failed(next))
+		{
+			return Error{QString("%1: %2").arg(package, std::get<Error>(next).message)};
+		}
+		const auto entry = std::get<std::optional<TarEntry>>(next);
+		if (!entry.has_value())
+		{
+			return ret;
+		}
+		ret << *entry;
+		const auto skipped = reader.SkipData(entry->size);
+		if (Failed(skipped))
+		{
+			return std::get<Error>(skipped);
+		}
+	}
+}
@@ -0,0 +1,490 @@
+#pragma once
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+#include <QThread>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <optional>
+
+#include "checksums.h"
+#include "error.h"
+#include "extract.h"
+#include "pkginfo.h"
+#include "tar.h"
+#include "zstdwriter.h"
+
+struct RepoEntry
+{
+	PkgInfo info;
+	QByteArray desc;
+	QByteArray files;
+
+	// The member directory inside the database archives.
+	auto Directory() const -> QString { return info.pkgname + "-" + info.pkgver; }
+};
+
+// The desc record pacman reads from a sync database.
+auto RepoDesc(const PkgInfo &info, const QString &filename, qint64 csize, const QByteArray &sha256) -> QByteArray
+{
+	QByteArray ret;
+	auto field = [&ret](const char *key, const QStringList &values) {
+		if (values.isEmpty() || (values.size() == 1 && values.first().isEmpty()))
+		{
+			return;
+		}
+		ret += QByteArray("%") + key + "%\n";
+		for (const auto &value : values)
+		{
+			ret += value.toUtf8() + '\n';
+		}
+		ret += '\n';
+	};
+	field("FILENAME", {filename});
+	field("NAME", {info.pkgname});
+	field("BASE", {info.pkgbase.isEmpty() ? info.pkgname : info.pkgbase});
+	field("VERSION", {info.pkgver});
+	field("DESC", {info.pkgdesc});
+	field("GROUPS", info.groups);
+	field("CSIZE", {QString::number(csize)});
+	field("ISIZE", {QString::number(info.size)});
+	field("SHA256SUM", {QString::fromLatin1(sha256)});
+	field("URL", {info.url});
+	field("LICENSE", info.license);
+	field("ARCH", {info.arch});
+	field("BUILDDATE", {QString::number(info.builddate)});
+	field("PACKAGER", {info.packager});
+	field("REPLACES", info.replaces);
+	field("CONFLICTS", info.conflicts);
+	field("PROVIDES", info.provides);
+	field("DEPENDS", info.depends);
+	field("OPTDEPENDS", info.optdepends);
+	field("MAKEDEPENDS", info.makedepends);
+	field("CHECKDEPENDS", info.checkdepends);
+	return ret;
+}
+
+// Reads .PKGINFO and the file list out of a built package.
+auto ReadRepoEntry(const QString &package) -> Fallible<RepoEntry>
+{
+	const auto source = OpenDecompressor(package);
+	if (Failed(source))
+	{
+		return std::get<Error>(source);
+	}
+	TarReader reader(std::get<ChunkSource>(source));
+	RepoEntry entry;
+	QStringList files;
+	while (true)
+	{
+		const auto next = reader.Next();
+		if (Failed(next))
+		{
+			return Error{QString("%1: %2").arg(package, std::get<Error>(next).message)};
+		}
+		const auto member = std::get<std::optional<TarEntry>>(next);
+		if (!member.has_value())
+		{
+			break;
+		}
+		if (member->path == ".PKGINFO")
+		{
+			const auto data = reader.ReadData(member->size);
+			if (Failed(data))
+			{
+				return std::get<Error>(data);
+			}
+			entry.info = ParsePkgInfo(std::get<QByteArray>(data));
+			continue;
+		}
+		if (!member->path.startsWith('.'))
+		{
+			files << member->path;
+		}
+		const auto skipped = reader.SkipData(member->size);
+		if (Failed(skipped))
+		{
+			return std::get<Error>(skipped);
+		}
+	}
+	if (entry.info.pkgname.isEmpty() || entry.info.pkgver.isEmpty())
+	{
+		return Error{QString("%1: no .PKGINFO").arg(package)};
+	}
+
+	const auto sha256 = FileSha256(package);
+	if (Failed(sha256))
+	{
+		return std::get<Error>(sha256);
+	}
+	entry.desc = RepoDesc(entry.info, QFileInfo(package).fileName(), QFileInfo(package).size(),
+						  std::get<QByteArray>(sha256));
+	files.sort();
+	entry.files = "%FILES%\n" + files.join('\n').toUtf8() + "\n\n";
+	return entry;
+}
+
+// A repository database kept as an uncompressed working copy next to the
+// compressed name.db.tar.zst and name.files.tar.zst, laid out as inside the
+// archives: one pkgname-pkgver directory with desc and files per package.
+// A batch of additions and removals touches only the entries it changes;
+// the archives are then written once, compressed on every core. The working
+// copy records the identity of the archives it matches, and is imported
+// afresh when they were since written by anything else, e.g. repo-add.
+// Databases repo-add wrote as .tar.gz or .tar.xz are read but not rewritten:
+// only zstd archives are written, and switching formats would leave the old
+// archives behind for pacman.
+class RepoDatabase
+{
+	QString directory;
+	QString name;
+	// The archives' ".tar.zst" or the like, from the database given or else
+	// the one name.db links to.
+	QString extension;
+	QString work;
+	qint64 frameSize;
+	// Entry directory by pkgname.
+	QHash<QString, QString> entries;
+
+	// "foo-bar-1.0-1" is pkgname "foo-bar", as pkgver never contains '-'
+	// and pkgrel follows the last one.
+	static auto PackageName(const QString &entry) -> QString
+	{
+		return entry.section('-', 0, -3);
+	}
+
+	auto ArchivePath(const QString &kind) const -> QString
+	{
+		return QString("%1/%2.%3%4").arg(directory, name, kind, extension);
+	}
+
+	// The extension of the archive name.db points at, or nothing when it
+	// is not a symlink into this repository.
+	auto LinkedExtension() const -> QString
+	{
+		const auto target = QFileInfo(QFileInfo(QString("%1/%2.db").arg(directory, name)).symLinkTarget());
+		const auto prefix = name + ".db.";
+		if (target.path() != directory || !target.fileName().startsWith(prefix))
+		{
+			return QString();
+		}
+		return target.fileName().mid(prefix.size() - 1);
+	}
+
+	auto StampPath() const -> QString { return work + "/.archives"; }
+
+	auto ArchiveStamp() const -> QByteArray
+	{
+		QByteArray ret;
+		for (const auto &kind : {QString("db"), QString("files")})
+		{
+			const auto id = StatIdentity(ArchivePath(kind));
+			ret += id.has_value() ? QString("%1 %2 %3 %4 %5\n")
+										.arg(id->dev)
+										.arg(id->ino)
+										.arg(id->size)
+										.arg(id->mtime)
+										.arg(id->ctime)
+										.toLatin1()
+								  : QByteArray("-\n");
+		}
+		return ret;
+	}
+
+	auto WriteStamp() const -> Fallible<>
+	{
+		QSaveFile stamp(StampPath());
+		if (!stamp.open(QIODevice::WriteOnly) || stamp.write(ArchiveStamp()) < 0 || !stamp.commit())
+		{
+			return Error{QString("cannot write %1: %2").arg(StampPath(), stamp.errorString())};
+		}
+		return std::monostate{};
+	}
+
+	// Seeds the working copy from the archives repo-add left behind.
+	auto Import() -> Fallible<>
+	{
+		auto archive = ArchivePath("files");
+		if (!QFileInfo::exists(archive))
+		{
+			archive = ArchivePath("db");
+		}
+		if (!QFileInfo::exists(archive))
+		{
+			return std::monostate{};
+		}
+		const auto source = OpenDecompressor(archive);
+		if (Failed(source))
+		{
+			return std::get<Error>(source);
+		}
+		TarReader reader(std::get<ChunkSource>(source));
+		while (true)
+		{
+			const auto next = reader.Next();
+			if (Failed(next))
+			{
+				return Error{QString("%1: %2").arg(archive, std::get<Error>(next).message)};
+			}
+			const auto member = std::get<std::optional<TarEntry>>(next);
+			if (!member.has_value())
+			{
+				return std::monostate{};
+			}
+			if (member->type == '5' || !SafeMemberPath(member->path) || member->path.count('/') != 1)
+			{
+				const auto skipped = reader.SkipData(member->size);
+				if (Failed(skipped))
+				{
+					return std::get<Error>(skipped);
+				}
+				continue;
+			}
+			const auto data = reader.ReadData(member->size);
+			if (Failed(data))
+			{
+				return std::get<Error>(data);
+			}
+			const auto path = work + "/" + member->path;
+			QDir().mkpath(QFileInfo(path).path());
+			QFile file(path);
+			if (!file.open(QIODevice::WriteOnly) || file.write(std::get<QByteArray>(data)) < 0)
+			{
+				return Error{QString("cannot write %1: %2").arg(path, file.errorString())};
+			}
+		}
+	}
+
+	auto Store(const RepoEntry &entry) -> Fallible<>
+	{
+		const auto staging = work + "/.staging";
+		QDir(staging).removeRecursively();
+		QDir().mkpath(staging);
+		for (const auto &[file, data] : {qMakePair(QString("desc"), entry.desc),
+										 qMakePair(QString("files"), entry.files)})
+		{
+			QFile out(staging + "/" + file);
+			if (!out.open(QIODevice::WriteOnly) || out.write(data) != data.size())
+			{
+				return Error{QString("cannot write %1: %2").arg(out.fileName(), out.errorString())};
+			}
+		}
+		// The new entry goes into place before the old one goes, so there is
+		// always one; the same pkgname-pkgver is swapped atomically.
+		const auto target = work + "/" + entry.Directory();
+		const auto previous = entries.value(entry.info.pkgname);
+		if (QFileInfo::exists(target))
+		{
+			if (::renameat2(AT_FDCWD, QFile::encodeName(staging).constData(), AT_FDCWD,
+							QFile::encodeName(target).constData(), RENAME_EXCHANGE) != 0)
+			{
+				return Error{QString("cannot replace %1: %2").arg(target, qt_error_string(errno))};
+			}
+			QDir(staging).removeRecursively();
+		}
+		else if (!QDir().rename(staging, target))
+		{
+			return Error{QString("cannot rename %1 to %2").arg(staging, target)};
+		}
+		if (!previous.isEmpty() && previous != entry.Directory())
+		{
+			QDir(work + "/" + previous).removeRecursively();
+		}
+		entries[entry.info.pkgname] = entry.Directory();
+		return std::monostate{};
+	}
+
+	auto Drop(const QString &pkgname) -> bool
+	{
+		const auto existing = entries.take(pkgname);
+		return !existing.isEmpty() && QDir(work + "/" + existing).removeRecursively();
+	}
+
+	auto WriteArchive(const QString &kind, bool withFiles, int level) const -> Fallible<>
+	{
+		const auto path = ArchivePath(kind);
+		QSaveFile out(path);
+		if (!out.open(QIODevice::WriteOnly))
+		{
+			return Error{QString("cannot create %1: %2").arg(path, out.errorString())};
+		}
+		ZstdWriter compressor(out, level, QThread::idealThreadCount(), frameSize);
+		TarWriter tar([&compressor](const char *data, qint64 size) { return compressor.Write(data, size); });
+		const auto now = QDateTime::currentSecsSinceEpoch();
+
+		auto directories = entries.values();
+		std::sort(directories.begin(), directories.end());
+		for (const auto &entry : std::as_const(directories))
+		{
+			if (!tar.WriteEntry(TarEntry{.path = entry + "/", .type = '5', .mode = 0755, .mtime = now}))
+			{
+				return Error{QString("cannot write %1: %2").arg(path, compressor.ErrorString())};
+			}
+			for (const auto &file : withFiles ? QStringList{"desc", "files"} : QStringList{"desc"})
+			{
+				QFile in(work + "/" + entry + "/" + file);
+				// Entries imported from a database without its files archive
+				// have no file list, which pacman -F takes as unknown.
+				if (file == "files" && !in.exists())
+				{
+					continue;
+				}
+				if (!in.open(QIODevice::ReadOnly))
+				{
+					return Error{QString("cannot open %1: %2").arg(in.fileName(), in.errorString())};
+				}
+				if (!tar.WriteEntry(TarEntry{.path = entry + "/" + file, .mtime = now}, in.readAll()))
+				{
+					return Error{QString("cannot write %1: %2").arg(path, compressor.ErrorString())};
+				}
+			}
+		}
+		if (!tar.Finish() || !compressor.EndFrame() || !compressor.WriteSeekTable())
+		{
+			return Error{QString("cannot write %1: %2").arg(path, compressor.ErrorString())};
+		}
+		if (!out.commit())
+		{
+			return Error{QString("cannot write %1: %2").arg(path, out.errorString())};
+		}
+
+		// pacman downloads name.db, which repo-add makes a symlink.
+		const auto link = QString("%1/%2.%3").arg(directory, name, kind);
+		QFile::remove(link);
+		QFile archive(QFileInfo(path).fileName());
+		if (!archive.link(link))
+		{
+			return Error{QString("cannot link %1 to %2: %3").arg(link, archive.fileName(), archive.errorString())};
+		}
+		return std::monostate{};
+	}
+
+public:
+	// database is name.db.tar.zst or name.db, as given to repo-add; a bare
+	// name.db takes the format of the archive it links to. The archives are
+	// seekable, cut into frames of frameSize bytes.
+	explicit RepoDatabase(const QString &database, qint64 frameSize = 1 << 20)
+		: directory(QFileInfo(database).absolutePath()),
+		  name(QFileInfo(database).fileName().section(".db", 0, 0)),
+		  extension(QFileInfo(database).fileName().section(".db", 1)),
+		  work(QString("%1/.%2.db.d").arg(directory, name)), frameSize(frameSize)
+	{
+	}
+
+	auto Open() -> Fallible<>
+	{
+		const auto linked = LinkedExtension();
+		if (extension.isEmpty())
+		{
+			extension = linked.isEmpty() ? QString(".tar.zst") : linked;
+		}
+		else if (!linked.isEmpty() && linked != extension)
+		{
+			return Error{QString("%1/%2.db is a %3 database; refusing to switch it to %4")
+							 .arg(directory, name, linked, extension)};
+		}
+		QFile stamp(StampPath());
+		if (QFileInfo::exists(work) && (!stamp.open(QIODevice::ReadOnly) || stamp.readAll() != ArchiveStamp()))
+		{
+			QDir(work).removeRecursively();
+		}
+		if (!QFileInfo::exists(work))
+		{
+			QDir().mkpath(work);
+			auto imported = Import();
+			if (!Failed(imported))
+			{
+				imported = WriteStamp();
+			}
+			if (Failed(imported))
+			{
+				QDir(work).removeRecursively();
+				return imported;
+			}
+		}
+		QDir(work + "/.staging").removeRecursively();
+		// A Store cut short leaves a package's old entry next to its new one,
+		// which was written later.
+		for (const auto &entry : QDir(work).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Time))
+		{
+			const auto pkgname = PackageName(entry.fileName());
+			if (entries.contains(pkgname))
+			{
+				QDir(entry.absoluteFilePath()).removeRecursively();
+				continue;
+			}
+			entries[pkgname] = entry.fileName();
+		}
+		return std::monostate{};
+	}
+
+	// Adds or replaces packages from their files and removes packages by
+	// name, then rewrites both archives. Like repo-remove, names that are not
+	// in the database fail the run once the rest is written.
+	auto Apply(const QStringList &add, const QStringList &remove, int level = 19) -> Fallible<>
+	{
+		if (extension != ".tar.zst")
+		{
+			return Error{QString("cannot write %1: only .tar.zst databases are written").arg(ArchivePath("db"))};
+		}
+		const auto read = QtConcurrent::blockingMapped<QList<Fallible<RepoEntry>>>(add, ReadRepoEntry);
+		for (const auto &entry : read)
+		{
+			if (Failed(entry))
+			{
+				return std::get<Error>(entry);
+			}
+		}
+		// Until both archives are written the working copy matches neither.
+		QFile::remove(StampPath());
+		QStringList missing;
+		for (const auto &pkgname : remove)
+		{
+			if (!entries.contains(pkgname))
+			{
+				missing << QString("Package matching '%1' not found.").arg(pkgname);
+			}
+			else if (!Drop(pkgname))
+			{
+				return Error{QString("cannot remove %1 from %2").arg(pkgname, work)};
+			}
+		}
+		for (const auto &entry : read)
+		{
+			const auto stored = Store(std::get<RepoEntry>(entry));
+			if (Failed(stored))
+			{
+				return stored;
+			}
+		}
+		const auto db = WriteArchive("db", false, level);
+		if (Failed(db))
+		{
+			return db;
+		}
+		const auto files = WriteArchive("files", true, level);
+		if (Failed(files))
+		{
+			return files;
+		}
+		const auto stamped = WriteStamp();
+		if (Failed(stamped))
+		{
+			return stamped;
+		}
+		if (!missing.isEmpty())
+		{
+			return Error{missing.join('\n')};
+		}
+		return std::monostate{};
+	}
+
+	auto Packages() const -> QStringList { return entries.keys(); }
+};
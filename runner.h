@@ -0,0 +1,349 @@
+#pragma once
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QString>
+#include <QStringList>
+
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <functional>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "accounting.h"
+#include "error.h"
+
+extern char **environ;
+
+struct RunOptions
+{
+	QString program;
+	QStringList arguments;
+	QString workingDirectory;
+	// KEY=VALUE pairs; empty inherits ours.
+	QStringList environment;
+	// Output is appended to this file.
+	QString logPath;
+	// When set, output is handed here (e.g. BuildLog::Sink) instead of logPath.
+	std::function<bool(const char *, qint64)> sink;
+	// Also copy the output to our stdout.
+	bool echo = false;
+	qint64 tailBytes = 64 << 10;
+	// A delegated cgroup v2 directory; when set, the run gets a child cgroup
+	// and its usage covers every process it started.
+	QString cgroup;
+};
+
+struct RunResult
+{
+	int exitCode = -1;
+	int signal = 0;
+	// The last tailBytes of this run's output, for error reports.
+	QByteArray tail;
+	ResourceUsage usage;
+
+	auto Succeeded() const -> bool { return signal == 0 && exitCode == 0; }
+};
+
+// Moves exactly `size` bytes, or everything until EOF when size is negative,
+// from the pipe `from` to `to`. splice keeps the data in the kernel; targets
+// that do not support it get a plain read/write loop.
+auto SpliceAll(int from, int to, qint64 size) -> Fallible<qint64>
+{
+	qint64 moved = 0;
+	bool canSplice = true;
+	QByteArray buffer;
+	while (size < 0 || moved < size)
+	{
+		const auto want = size < 0 ? qint64(1) << 20 : size - moved;
+		ssize_t got;
+		if (canSplice)
+		{
+			got = ::splice(from, nullptr, to, nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (got < 0 && errno == EINVAL)
+			{
+				canSplice = false;
+				buffer.resize(1 << 16);
+				continue;
+			}
+		}
+		else
+		{
+			got = ::read(from, buffer.data(), qMin<qint64>(want, buffer.size()));
+			for (ssize_t written = 0; got > 0 && written < got;)
+			{
+				const auto step = ::write(to, buffer.constData() + written, got - written);
+				if (step < 0 && errno != EINTR)
+				{
+					return Error{qt_error_string(errno)};
+				}
+				written += qMax<ssize_t>(step, 0);
+			}
+		}
+		if (got < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return Error{qt_error_string(errno)};
+		}
+		if (got == 0)
+		{
+			break;
+		}
+		moved += got;
+	}
+	return moved;
+}
+
+// Reads the pipe until EOF into options.sink, keeping the last tailBytes.
+auto DrainInto(int from, const RunOptions &options, QByteArray &tail) -> Fallible<qint64>
+{
+	QByteArray buffer(1 << 20, Qt::Uninitialized);
+	qint64 moved = 0;
+	while (true)
+	{
+		const auto got = ::read(from, buffer.data(), buffer.size());
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got < 0)
+		{
+			return Error{qt_error_string(errno)};
+		}
+		if (got == 0)
+		{
+			return moved;
+		}
+		if (!options.sink(buffer.constData(), got))
+		{
+			return Error{"the log rejected the output"};
+		}
+		for (ssize_t written = 0; options.echo && written < got;)
+		{
+			const auto step = ::write(STDOUT_FILENO, buffer.constData() + written, got - written);
+			if (step < 0 && errno != EINTR)
+			{
+				break;
+			}
+			written += qMax<ssize_t>(step, 0);
+		}
+		const auto kept = qMin<qint64>(got, options.tailBytes);
+		tail.append(buffer.constData() + got - kept, kept);
+		tail.remove(0, qMax<qint64>(tail.size() - options.tailBytes, 0));
+		moved += got;
+	}
+}
+
+// Runs a program with posix_spawn (glibc uses CLONE_VM | CLONE_VFORK, so
+// nothing is copied) with stdout and stderr on one pipe. Without a sink the
+// parent never reads the output: it is spliced into the log, and only the tail
+// is read back.
+auto Spawn(const RunOptions &options) -> Fallible<RunResult>
+{
+	const auto log = options.sink ? -1
+								  : ::open(QFile::encodeName(options.logPath).constData(),
+										   O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (!options.sink && log < 0)
+	{
+		return Error{QString("cannot open %1: %2").arg(options.logPath, qt_error_string(errno))};
+	}
+	// splice rejects O_APPEND files, so seek to the end instead.
+	const auto start = log < 0 ? 0 : ::lseek(log, 0, SEEK_END);
+
+	const auto teeing = options.echo && !options.sink;
+	int output[2];
+	int echo[2] = {-1, -1};
+	if (::pipe2(output, O_CLOEXEC) != 0 || (teeing && ::pipe2(echo, O_CLOEXEC) != 0))
+	{
+		if (log >= 0)
+		{
+			::close(log);
+		}
+		return Error{QString("cannot create pipe: %1").arg(qt_error_string(errno))};
+	}
+	::fcntl(output[0], F_SETPIPE_SZ, 1 << 20);
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, output[1], STDERR_FILENO);
+	const auto directory = QFile::encodeName(options.workingDirectory);
+	if (!directory.isEmpty())
+	{
+		posix_spawn_file_actions_addchdir_np(&actions, directory.constData());
+	}
+
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	sigset_t signals;
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attributes, &signals);
+	sigaddset(&signals, SIGPIPE);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	posix_spawnattr_setsigdefault(&attributes, &signals);
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+
+	PhaseCgroup cgroup;
+	const auto inCgroup = !options.cgroup.isEmpty() && !Failed(cgroup.Create(options.cgroup));
+#ifdef POSIX_SPAWN_SETCGROUP
+	if (inCgroup)
+	{
+		posix_spawnattr_setcgroup_np(&attributes, cgroup.Fd());
+		flags |= POSIX_SPAWN_SETCGROUP;
+	}
+#endif
+	posix_spawnattr_setflags(&attributes, flags);
+
+	QList<QByteArray> strings{QFile::encodeName(options.program)};
+	for (const auto &argument : options.arguments)
+	{
+		strings << argument.toLocal8Bit();
+	}
+	const auto argc = strings.size();
+	for (const auto &variable : options.environment)
+	{
+		strings << variable.toLocal8Bit();
+	}
+	std::vector<char *> argv;
+	std::vector<char *> envp;
+	for (qsizetype i = 0; i < strings.size(); ++i)
+	{
+		(i < argc ? argv : envp).push_back(strings[i].data());
+	}
+	argv.push_back(nullptr);
+	envp.push_back(nullptr);
+
+	QElapsedTimer wall;
+	wall.start();
+	pid_t pid;
+	const auto spawned = ::posix_spawnp(&pid, strings[0].constData(), &actions, &attributes, argv.data(),
+										options.environment.isEmpty() ? environ : envp.data());
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+	::close(output[1]);
+	if (spawned != 0)
+	{
+		::close(output[0]);
+		if (teeing)
+		{
+			::close(echo[0]);
+			::close(echo[1]);
+		}
+		if (log >= 0)
+		{
+			::close(log);
+		}
+		return Error{QString("cannot run %1: %2").arg(options.program, qt_error_string(spawned))};
+	}
+#ifndef POSIX_SPAWN_SETCGROUP
+	// Without CLONE_INTO_CGROUP support in libc the child is moved after the
+	// fact; anything it forks before that is only seen through rusage.
+	if (inCgroup)
+	{
+		cgroup.Attach(pid);
+	}
+#endif
+
+	RunResult result;
+	Fallible<qint64> copied = qint64(0);
+	auto echoing = teeing;
+	while (echoing)
+	{
+		// tee duplicates what is in the pipe without consuming it; the
+		// original goes to the log and the duplicate to stdout.
+		const auto got = ::tee(output[0], echo[1], 1 << 20, 0);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got <= 0)
+		{
+			copied = got < 0 ? Fallible<qint64>(Error{qt_error_string(errno)}) : copied;
+			break;
+		}
+		copied = SpliceAll(output[0], log, got);
+		if (Failed(copied))
+		{
+			break;
+		}
+		echoing = !Failed(SpliceAll(echo[0], STDOUT_FILENO, got));
+		if (!echoing)
+		{
+			copied = SpliceAll(output[0], log, -1);
+		}
+	}
+	if (options.sink)
+	{
+		copied = DrainInto(output[0], options, result.tail);
+	}
+	else if (teeing)
+	{
+		::close(echo[0]);
+		::close(echo[1]);
+	}
+	else
+	{
+		copied = SpliceAll(output[0], log, -1);
+	}
+	::close(output[0]);
+
+	int status = 0;
+	struct rusage usage{};
+	while (::wait4(pid, &status, 0, &usage) < 0 && errno == EINTR)
+	{
+	}
+	result.usage = UsageFromRusage(usage);
+	result.usage.wallUs = wall.nsecsElapsed() / 1000;
+	if (inCgroup)
+	{
+		cgroup.Collect(result.usage);
+	}
+
+	if (WIFEXITED(status))
+	{
+		result.exitCode = WEXITSTATUS(status);
+	}
+	else if (WIFSIGNALED(status))
+	{
+		result.signal = WTERMSIG(status);
+	}
+	if (log >= 0)
+	{
+		const auto end = ::lseek(log, 0, SEEK_END);
+		const auto from = qMax<qint64>(start, end - options.tailBytes);
+		result.tail.resize(end - from);
+		const auto got = ::pread(log, result.tail.data(), result.tail.size(), from);
+		const auto err = errno;
+		::close(log);
+		if (got < 0)
+		{
+			return Error{QString("cannot read %1: %2").arg(options.logPath, qt_error_string(err))};
+		}
+		result.tail.resize(got);
+	}
+
+	if (Failed(copied))
+	{
+		return Error{QString("cannot write %1: %2").arg(options.logPath, std::get<Error>(copied).message)};
+	}
+	return result;
+}
+
+// Runs a spec scriptlet the way rpm does, with `sh -e`.
+auto RunScript(const QString &script, RunOptions options) -> Fallible<RunResult>
+{
+	options.program = "/bin/sh";
+	options.arguments = QStringList{"-e", "-c", script};
+	return Spawn(options);
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QTemporaryDir>
+#include <QtConcurrent>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "store.h"
+
+struct PrepInputs
+{
+	QList<QByteArray> sources;
+	QList<QByteArray> patches;
+	// The %prep body after macro expansion.
+	QString script;
+};
+
+auto PrepKey(const PrepInputs &inputs) -> QByteArray
+{
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	auto field = [&hash](const QByteArray &data) {
+		hash.addData(QByteArray::number(data.size()) + ":");
+		hash.addData(data);
+	};
+	field("alpmbuild++ prep v1");
+	for (const auto &source : inputs.sources)
+	{
+		field("source");
+		field(source.toLower());
+	}
+	for (const auto &patch : inputs.patches)
+	{
+		field("patch");
+		field(patch.toLower());
+	}
+	field("prep");
+	field(inputs.script.toUtf8());
+	return hash.result().toHex();
+}
+
+// Recreates the tree at from under to. Regular files are reflinked where the
+// filesystem allows it (so a multi-GB tree costs only metadata), hard links and
+// symlinks are preserved, and mtimes are kept so make does not rebuild.
+auto CloneTree(const QString &from, const QString &to) -> Fallible<>
+{
+	struct Item
+	{
+		QString relativePath;
+		struct stat st;
+	};
+	QList<Item> files;
+	QList<Item> directories;
+	QHash<QPair<dev_t, ino_t>, QString> inodes;
+	QList<QPair<QString, QString>> hardlinks;
+	const QDir root(from);
+
+	if (!QDir().mkpath(to))
+	{
+		return Error{QString("cannot create %1").arg(to)};
+	}
+	QDirIterator it(from, QDir::AllEntries | QDir::Hidden | QDir::System | QDir::NoDotAndDotDot,
+					QDirIterator::Subdirectories);
+	while (it.hasNext())
+	{
+		const auto path = it.next();
+		Item item{root.relativeFilePath(path), {}};
+		if (::lstat(QFile::encodeName(path).constData(), &item.st) != 0)
+		{
+			return Error{QString("cannot stat %1: %2").arg(path, qt_error_string(errno))};
+		}
+		const auto target = QFile::encodeName(to + "/" + item.relativePath);
+
+		if (S_ISDIR(item.st.st_mode))
+		{
+			if (::mkdir(target.constData(), 0700) != 0 && errno != EEXIST)
+			{
+				return Error{QString("cannot create %1: %2").arg(to + "/" + item.relativePath,
+																  qt_error_string(errno))};
+			}
+			directories << item;
+		}
+		else if (S_ISLNK(item.st.st_mode))
+		{
+			QByteArray link(item.st.st_size + 1, Qt::Uninitialized);
+			const auto len = ::readlink(QFile::encodeName(path).constData(), link.data(), link.size());
+			if (len < 0 || ::symlink(link.left(len).constData(), target.constData()) != 0)
+			{
+				return Error{QString("cannot copy symlink %1").arg(path)};
+			}
+		}
+		else if (S_ISREG(item.st.st_mode))
+		{
+			const auto key = qMakePair(item.st.st_dev, item.st.st_ino);
+			if (item.st.st_nlink > 1 && inodes.contains(key))
+			{
+				hardlinks << qMakePair(inodes[key], item.relativePath);
+				continue;
+			}
+			inodes[key] = item.relativePath;
+			files << item;
+		}
+	}
+
+	QMutex mutex;
+	QStringList errors;
+	QtConcurrent::blockingMap(files, [&](const Item &item) {
+		const auto target = to + "/" + item.relativePath;
+		const auto cloned = CloneFile(from + "/" + item.relativePath, target);
+		if (Failed(cloned))
+		{
+			QMutexLocker lock(&mutex);
+			errors << std::get<Error>(cloned).message;
+			return;
+		}
+		const struct timespec times[2] = {item.st.st_atim, item.st.st_mtim};
+		::utimensat(AT_FDCWD, QFile::encodeName(target).constData(), times, 0);
+	});
+	if (!errors.isEmpty())
+	{
+		return Error{errors.join('\n')};
+	}
+
+	for (const auto &link : std::as_const(hardlinks))
+	{
+		if (::link(QFile::encodeName(to + "/" + link.first).constData(),
+				   QFile::encodeName(to + "/" + link.second).constData()) != 0)
+		{
+			return Error{QString("cannot link %1: %2").arg(link.second, qt_error_string(errno))};
+		}
+	}
+	for (auto dir = directories.crbegin(); dir != directories.crend(); ++dir)
+	{
+		const auto target = QFile::encodeName(to + "/" + dir->relativePath);
+		const struct timespec times[2] = {dir->st.st_atim, dir->st.st_mtim};
+		::chmod(target.constData(), dir->st.st_mode & 07777);
+		::utimensat(AT_FDCWD, target.constData(), times, AT_SYMLINK_NOFOLLOW);
+	}
+	return std::monostate{};
+}
+
+// Prepared source trees keyed by PrepKey, so iterating on %build can skip
+// re-extracting and re-patching unchanged sources.
+class PrepSnapshots
+{
+	QString root;
+
+public:
+	static auto DefaultPath() -> QString
+	{
+		auto base = QString::fromLocal8Bit(qgetenv("XDG_CACHE_HOME"));
+		if (base.isEmpty())
+		{
+			base = QDir::homePath() + "/.cache";
+		}
+		return base + "/alpmbuild++/prep";
+	}
+
+	explicit PrepSnapshots(const QString &root = DefaultPath()) : root(root) { QDir().mkpath(root); }
+
+	auto Path(const QByteArray &key) const -> QString { return root + "/" + QString::fromLatin1(key); }
+
+	auto Contains(const QByteArray &key) const -> bool { return QFileInfo(Path(key)).isDir(); }
+
+	// Snapshots are built beside their final name and renamed into place, so a
+	// snapshot that exists is always complete.
+	auto Save(const QByteArray &key, const QString &srcdir) -> Fallible<>
+	{
+		if (Contains(key))
+		{
+			return std::monostate{};
+		}
+		QTemporaryDir staging(root + "/.staging-XXXXXX");
+		const auto tree = staging.path() + "/tree";
+		const auto cloned = CloneTree(srcdir, tree);
+		if (Failed(cloned))
+		{
+			return cloned;
+		}
+		if (::rename(QFile::encodeName(tree).constData(), QFile::encodeName(Path(key)).constData()) != 0 &&
+			!Contains(key))
+		{
+			return Error{QString("cannot save snapshot %1: %2").arg(Path(key), qt_error_string(errno))};
+		}
+		return std::monostate{};
+	}
+
+	auto Restore(const QByteArray &key, const QString &srcdir) const -> Fallible<>
+	{
+		if (!Contains(key))
+		{
+			return Error{QString("no prepared tree for %1").arg(QString::fromLatin1(key))};
+		}
+		QDir(srcdir).removeRecursively();
+		::utimensat(AT_FDCWD, QFile::encodeName(Path(key)).constData(), nullptr, 0);
+		return CloneTree(Path(key), srcdir);
+	}
+
+	// Keeps the `keep` most recently used snapshots.
+	auto Prune(int keep) -> void
+	{
+		const auto entries = QDir(root).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Time);
+		for (qsizetype i = keep; i < entries.size(); ++i)
+		{
+			QDir(entries[i].absoluteFilePath()).removeRecursively();
+		}
+	}
+};
@@ -0,0 +1,634 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QRegularExpression>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+#include "ast.h"
+#include "astcache.h"
+#include "checksums.h"
+#include "error.h"
+#include "parser.h"
+
+const QStringList SpecSectionNames{
+	"package", "description", "prep", "build", "install", "check", "clean", "files",
+	"changelog", "pre", "post", "preun", "postun", "pretrans", "posttrans",
+	"verifyscript", "triggerin", "triggerun", "triggerpostun", "generate_buildrequires",
+};
+
+// Sections whose content never reaches the built packages.
+const QStringList CosmeticSpecSections{"description", "changelog"};
+
+// Sections whose free lines are data rather than shell: the preamble (no
+// name), subpackage preambles and file lists. rpm itself drops '#' lines in
+// them; anywhere else '#' may be inside a heredoc or a quoted string.
+const QStringList DeclarativeSpecSections{"", "package", "files"};
+
+// Tags that rpm also defines as macros of the same, lowercased name.
+const QStringList MacroSpecTags{"name", "version", "release", "epoch"};
+
+// Expands %name, %{name}, %{?name}, %{?name:text}, %{!?name:text} and %%.
+// Undefined macros and anything fancier (%(shell), %{lua:...}) are kept as
+// written, which is still stable enough for hashing.
+auto ExpandMacros(const QString &text, const QHash<QString, QString> &macros, int depth = 0) -> QString
+{
+	if (depth > 32 || !text.contains('%'))
+	{
+		return text;
+	}
+	QString ret;
+	ret.reserve(text.size());
+	qsizetype i = 0;
+	while (i < text.size())
+	{
+		const auto ch = text[i];
+		if (ch != '%' || i + 1 >= text.size())
+		{
+			ret += ch;
+			++i;
+			continue;
+		}
+		const auto next = text[i + 1];
+		if (next == '%')
+		{
+			ret += '%';
+			i += 2;
+		}
+		else if (next == '{')
+		{
+			auto end = i + 2;
+			auto nesting = 1;
+			while (end < text.size() && nesting > 0)
+			{
+				nesting += text[end] == '{' ? 1 : text[end] == '}' ? -1 : 0;
+				++end;
+			}
+			if (nesting > 0)
+			{
+				ret += text.mid(i);
+				break;
+			}
+			auto inner = text.mid(i + 2, end - i - 3);
+			const auto negate = inner.startsWith("!?");
+			const auto conditional = negate || inner.startsWith('?');
+			if (conditional)
+			{
+				inner = inner.mid(negate ? 2 : 1);
+			}
+			const auto colon = inner.indexOf(':');
+			const auto name = colon < 0 ? inner : inner.left(colon);
+			const auto defined = macros.contains(name);
+			if (!conditional)
+			{
+				ret += defined ? ExpandMacros(macros.value(name), macros, depth + 1) : text.mid(i, end - i);
+			}
+			else if (colon >= 0)
+			{
+				ret += defined != negate ? ExpandMacros(inner.mid(colon + 1), macros, depth + 1) : QString();
+			}
+			else if (defined && !negate)
+			{
+				ret += ExpandMacros(macros.value(name), macros, depth + 1);
+			}
+			i = end;
+		}
+		else if (next.isLetter() || next == '_')
+		{
+			auto end = i + 1;
+			while (end < text.size() && (text[end].isLetterOrNumber() || text[end] == '_'))
+			{
+				++end;
+			}
+			const auto name = text.mid(i + 1, end - i - 1);
+			ret += macros.contains(name) ? ExpandMacros(macros.value(name), macros, depth + 1) : text.mid(i, end - i);
+			i = end;
+		}
+		else
+		{
+			ret += ch;
+			++i;
+		}
+	}
+	return ret;
+}
+
+auto SpecLine = ParserFrom<QString>([](Context &ctx) -> Result<QString> {
+	Holder hold(ctx);
+	if (ctx.Cancelled())
+	{
+		return NewFailure<QString>(CancelledFailure(ctx));
+	}
+	auto line = ctx.Buf.readLine();
+	ctx.Examine();
+	if (line.isEmpty())
+	{
+		return NewFailure<QString>(Failure{"line", "<EOF>", ctx.Buf.pos()});
+	}
+	if (line.endsWith('\n'))
+	{
+		line.chop(1);
+	}
+	return hold.Wrap(NewSuccess(QString::fromUtf8(line)));
+});
+
+auto MatchingLine(const QRegularExpression &pattern) -> Parser<QRegularExpressionMatch> *
+{
+	return ParserFrom<QRegularExpressionMatch>([pattern](Context &ctx) -> Result<QRegularExpressionMatch> {
+		Holder hold(ctx);
+		const auto line = (*SpecLine)(ctx);
+		if (std::holds_alternative<Failure>(line))
+		{
+			return NewFailure<QRegularExpressionMatch>(std::get<Failure>(line));
+		}
+		const auto match = pattern.match(std::get<QString>(line));
+		if (!match.hasMatch())
+		{
+			return NewFailure<QRegularExpressionMatch>(
+				Failure{pattern.pattern(), std::get<QString>(line), ctx.Buf.pos()});
+		}
+		return hold.Wrap(NewSuccess(match));
+	});
+}
+
+struct MacroDefinition
+{
+	QString name;
+	QString body;
+	bool global;
+};
+
+auto MacroDefinitionLine =
+	MatchingLine(QRegularExpression(R"(^\s*%(define|global)\s+([A-Za-z_][A-Za-z0-9_]*)(?:\([^)]*\))?\s+(.*?)\s*$)"))
+		->Map<MacroDefinition>([](QRegularExpressionMatch match) {
+			return MacroDefinition{match.captured(2), match.captured(3), match.captured(1) == "global"};
+		});
+
+auto SectionHeaderLine =
+	MatchingLine(QRegularExpression("^%(" + SpecSectionNames.join('|') + R"()(?:\s+(.*?))?\s*$)"))
+		->Map<SpecSection>([](QRegularExpressionMatch match) {
+			return SpecSection{match.captured(1), match.captured(2), {}, {}};
+		});
+
+auto TagLine =
+	MatchingLine(QRegularExpression(R"(^([A-Za-z][A-Za-z0-9]*(?:\([^)]*\))?)\s*:\s*(.*?)\s*$)"))
+		->Map<SpecTag>([](QRegularExpressionMatch match) {
+			return SpecTag{match.captured(1), match.captured(2)};
+		});
+
+using RawSpecLine = std::variant<QString, MacroDefinition, SpecTag, SpecSection>;
+
+auto ClassifiedLine(bool tags) -> Parser<RawSpecLine> *
+{
+	return ParserFrom<RawSpecLine>([tags](Context &ctx) -> Result<RawSpecLine> {
+		const auto definition = (*MacroDefinitionLine)(ctx);
+		if (std::holds_alternative<MacroDefinition>(definition))
+		{
+			return NewSuccess<RawSpecLine>(std::get<MacroDefinition>(definition));
+		}
+		const auto header = (*SectionHeaderLine)(ctx);
+		if (std::holds_alternative<SpecSection>(header))
+		{
+			return NewSuccess<RawSpecLine>(std::get<SpecSection>(header));
+		}
+		if (tags)
+		{
+			const auto tag = (*TagLine)(ctx);
+			if (std::holds_alternative<SpecTag>(tag))
+			{
+				return NewSuccess<RawSpecLine>(std::get<SpecTag>(tag));
+			}
+		}
+		const auto line = (*SpecLine)(ctx);
+		if (std::holds_alternative<Failure>(line))
+		{
+			return NewFailure<RawSpecLine>(std::get<Failure>(line));
+		}
+		return NewSuccess<RawSpecLine>(std::get<QString>(line));
+	})->Memoized();
+}
+
+auto TaggedLine = ClassifiedLine(true);
+auto ScriptLine = ClassifiedLine(false);
+
+// A section as written: its header (empty for the preamble) and its lines
+// before macro expansion.
+struct RawSpecSection
+{
+	SpecSection header;
+	QList<RawSpecLine> lines;
+};
+
+auto RawSectionOf(bool preamble) -> Parser<RawSpecSection> *
+{
+	return ParserFrom<RawSpecSection>([preamble](Context &ctx) -> Result<RawSpecSection> {
+		Holder hold(ctx);
+		RawSpecSection section;
+		if (!preamble)
+		{
+			const auto header = (*SectionHeaderLine)(ctx);
+			if (std::holds_alternative<Failure>(header))
+			{
+				return NewFailure<RawSpecSection>(std::get<Failure>(header));
+			}
+			section.header = std::get<SpecSection>(header);
+		}
+		const auto lines =
+			section.header.name.isEmpty() || section.header.name == "package" ? TaggedLine : ScriptLine;
+		while (!ctx.Buf.atEnd())
+		{
+			const auto start = ctx.Buf.pos();
+			const auto line = (*lines)(ctx);
+			if (std::holds_alternative<Failure>(line))
+			{
+				return NewFailure<RawSpecSection>(std::get<Failure>(line));
+			}
+			if (std::holds_alternative<SpecSection>(std::get<RawSpecLine>(line)))
+			{
+				ctx.Buf.seek(start);
+				break;
+			}
+			section.lines << std::get<RawSpecLine>(line);
+		}
+		return hold.Wrap(NewSuccess(section));
+	})->Memoized();
+}
+
+auto RawPreamble = RawSectionOf(true);
+auto RawSectionParser = RawSectionOf(false);
+
+auto RawSpecParser = ParserFrom<QList<RawSpecSection>>([](Context &ctx) -> Result<QList<RawSpecSection>> {
+	QList<RawSpecSection> sections;
+	auto parser = RawPreamble;
+	do
+	{
+		const auto section = (*parser)(ctx);
+		if (std::holds_alternative<Failure>(section))
+		{
+			return NewFailure<QList<RawSpecSection>>(std::get<Failure>(section));
+		}
+		sections << std::get<RawSpecSection>(section);
+		parser = RawSectionParser;
+	} while (!ctx.Buf.atEnd());
+	return NewSuccess(sections);
+});
+
+// A section after macro expansion, the digest of its build-relevant content
+// and the macros defined once it ends.
+struct ResolvedSpecSection
+{
+	SpecSection section;
+	QByteArray digest;
+	QHash<QString, QString> macros;
+};
+
+// Expands macros in the order rpm would and digests tags by lowercased name and
+// simplified value. Other lines of declarative sections are digested trimmed,
+// without blank lines or comments; script lines are digested verbatim.
+// %description and %changelog contribute nothing.
+auto ResolveSection(const RawSpecSection &raw, QHash<QString, QString> macros) -> ResolvedSpecSection
+{
+	ResolvedSpecSection ret{raw.header, {}, {}};
+	auto &section = ret.section;
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	auto feed = [&hash](const QString &data) {
+		const auto bytes = data.toUtf8();
+		hash.addData(QByteArray::number(bytes.size()) + ":");
+		hash.addData(bytes);
+	};
+	section.arguments = ExpandMacros(section.arguments, macros).simplified();
+	feed("%" + section.name);
+	feed(section.arguments);
+
+	for (const auto &line : raw.lines)
+	{
+		if (std::holds_alternative<MacroDefinition>(line))
+		{
+			const auto &macro = std::get<MacroDefinition>(line);
+			macros[macro.name] = macro.global ? ExpandMacros(macro.body, macros) : macro.body;
+		}
+		else if (std::holds_alternative<SpecTag>(line))
+		{
+			auto tag = std::get<SpecTag>(line);
+			tag.value = ExpandMacros(tag.value, macros);
+			if (section.name.isEmpty() && MacroSpecTags.contains(tag.name.toLower()))
+			{
+				macros[tag.name.toLower()] = tag.value;
+			}
+			feed(tag.name.toLower());
+			feed(tag.value.simplified());
+			section.tags << tag;
+		}
+		else if (std::holds_alternative<QString>(line))
+		{
+			const auto expanded = ExpandMacros(std::get<QString>(line), macros);
+			const auto trimmed = expanded.trimmed();
+			if (!DeclarativeSpecSections.contains(section.name))
+			{
+				feed(expanded);
+			}
+			else if (!trimmed.isEmpty() && !trimmed.startsWith('#'))
+			{
+				feed(trimmed);
+			}
+			section.lines << expanded;
+		}
+	}
+
+	if (!CosmeticSpecSections.contains(section.name))
+	{
+		ret.digest = hash.result();
+	}
+	ret.macros = macros;
+	return ret;
+}
+
+auto AssembleSpec(const QList<ResolvedSpecSection> &resolved) -> Spec
+{
+	Spec spec;
+	QCryptographicHash hash(QCryptographicHash::Sha256);
+	hash.addData("alpmbuild++ spec v3");
+	for (const auto &section : resolved)
+	{
+		spec.sections << section.section;
+		hash.addData(section.digest);
+	}
+	if (!resolved.isEmpty())
+	{
+		spec.macros = resolved.last().macros;
+	}
+	spec.semanticHash = hash.result().toHex();
+	return spec;
+}
+
+// Splits the spec into raw sections, then resolves them in order.
+auto SpecParser = ParserFrom<Spec>([](Context &ctx) -> Result<Spec> {
+	const auto raw = (*RawSpecParser)(ctx);
+	if (std::holds_alternative<Failure>(raw))
+	{
+		return NewFailure<Spec>(std::get<Failure>(raw));
+	}
+	QList<ResolvedSpecSection> resolved;
+	QHash<QString, QString> macros;
+	for (const auto &section : std::get<QList<RawSpecSection>>(raw))
+	{
+		if (ctx.Cancelled())
+		{
+			return NewFailure<Spec>(CancelledFailure(ctx));
+		}
+		resolved << ResolveSection(section, macros);
+		macros = resolved.last().macros;
+	}
+	return NewSuccess(AssembleSpec(resolved));
+});
+
+auto SpecFailure(const Failure &failure) -> Error
+{
+	if (failure.got == "<cancelled>")
+	{
+		return Error{"cancelled"};
+	}
+	return Error{QString("expected %1, got %2 at %3").arg(failure.expected, failure.got).arg(failure.position)};
+}
+
+auto ParseSpec(const QByteArray &contents, const std::atomic_bool *cancel = nullptr) -> Fallible<Spec>
+{
+	const auto result = SpecParser->ParseBytes(contents, cancel);
+	if (std::holds_alternative<Failure>(result))
+	{
+		return SpecFailure(std::get<Failure>(result));
+	}
+	return std::get<Spec>(result);
+}
+
+// A spec kept open in an editor. After an edit, lines and sections the edit
+// did not touch come from the memo table, and sections whose text and
+// incoming macros are unchanged keep their resolved form, so typing only
+// reparses and re-expands the section under the cursor.
+class IncrementalSpec
+{
+	Context ctx{};
+	QList<RawSpecSection> raw;
+	QList<QHash<QString, QString>> incoming;
+	QList<ResolvedSpecSection> resolved;
+
+public:
+	explicit IncrementalSpec(const QByteArray &contents)
+	{
+		ctx.Buf.setData(contents);
+		ctx.Buf.open(QIODevice::ReadOnly);
+	}
+
+	auto Parse(const std::atomic_bool *cancel = nullptr) -> Fallible<Spec>
+	{
+		ctx.Cancel = cancel;
+		ctx.Buf.seek(0);
+		const auto parsed = (*RawSpecParser)(ctx);
+		if (std::holds_alternative<Failure>(parsed))
+		{
+			return SpecFailure(std::get<Failure>(parsed));
+		}
+		const auto sections = std::get<QList<RawSpecSection>>(parsed);
+
+		// Sections served from the memo share their line storage with the
+		// previous parse.
+		QHash<const RawSpecLine *, qsizetype> previous;
+		for (qsizetype i = 0; i < raw.size(); ++i)
+		{
+			previous.insert(raw[i].lines.constData(), i);
+		}
+		QList<QHash<QString, QString>> nextIncoming;
+		QList<ResolvedSpecSection> nextResolved;
+		QHash<QString, QString> macros;
+		for (const auto &section : sections)
+		{
+			const auto old = previous.value(section.lines.constData(), -1);
+			const auto reusable = old >= 0 && raw[old].header.name == section.header.name &&
+								  raw[old].header.arguments == section.header.arguments &&
+								  raw[old].lines.size() == section.lines.size() && incoming[old] == macros;
+			nextIncoming << macros;
+			nextResolved << (reusable ? resolved[old] : ResolveSection(section, macros));
+			macros = nextResolved.last().macros;
+		}
+		raw = sections;
+		incoming = nextIncoming;
+		resolved = nextResolved;
+		return AssembleSpec(resolved);
+	}
+
+	auto Edit(qint64 offset, qint64 removed, const QByteArray &inserted,
+			  const std::atomic_bool *cancel = nullptr) -> Fallible<Spec>
+	{
+		if (offset < 0 || removed < 0 || offset + removed > ctx.Buf.size())
+		{
+			return Error{QString("edit at %1 is outside the spec").arg(offset)};
+		}
+		ctx.ApplyEdit(offset, removed, inserted);
+		return Parse(cancel);
+	}
+
+	auto Contents() const -> QByteArray { return ctx.Buf.data(); }
+};
+
+// Inlines %include files the way rpm does, resolving them relative to the
+// including file, and collects the absolute paths of everything inlined.
+auto InlineIncludes(const QString &path, QStringList &included, int depth = 0) -> Fallible<QByteArray>
+{
+	static const QRegularExpression include(R"(^\s*%include\s+(\S+)\s*$)");
+	if (depth > 16)
+	{
+		return Error{QString("%1: %include nested too deeply").arg(path)};
+	}
+	QFile file(path);
+	if (!file.open(QIODevice::ReadOnly))
+	{
+		return Error{QString("cannot open %1: %2").arg(path, file.errorString())};
+	}
+	const auto contents = file.readAll();
+	if (!contents.contains("%include"))
+	{
+		return contents;
+	}
+
+	QByteArray ret;
+	for (const auto &line : contents.split('\n'))
+	{
+		const auto match = include.match(QString::fromUtf8(line));
+		if (!match.hasMatch())
+		{
+			ret += line + '\n';
+			continue;
+		}
+		const auto target = QFileInfo(QFileInfo(path).dir(), match.captured(1)).absoluteFilePath();
+		included << target;
+		const auto inlined = InlineIncludes(target, included, depth + 1);
+		if (Failed(inlined))
+		{
+			return inlined;
+		}
+		ret += std::get<QByteArray>(inlined);
+		if (!ret.endsWith('\n'))
+		{
+			ret += '\n';
+		}
+	}
+	ret.chop(contents.endsWith('\n') ? 1 : 0);
+	return ret;
+}
+
+auto ReadSpec(const QString &path, const std::atomic_bool *cancel = nullptr) -> Fallible<Spec>
+{
+	QStringList included;
+	const auto contents = InlineIncludes(path, included);
+	if (Failed(contents))
+	{
+		return std::get<Error>(contents);
+	}
+	const auto shared = SharedSpecs();
+	const auto key = shared != nullptr ? SharedSpecCache::Key(std::get<QByteArray>(contents)) : QByteArray();
+	if (shared != nullptr)
+	{
+		if (auto hit = shared->Get(key))
+		{
+			hit->includes = included;
+			return *hit;
+		}
+	}
+	auto spec = ParseSpec(std::get<QByteArray>(contents), cancel);
+	if (Failed(spec))
+	{
+		return Error{QString("%1: %2").arg(path, std::get<Error>(spec).message)};
+	}
+	if (shared != nullptr)
+	{
+		// Another process failing to share a parse is no reason to fail this one.
+		shared->Put(key, std::get<Spec>(spec));
+	}
+	std::get<Spec>(spec).includes = included;
+	return spec;
+}
+
+// Parsed specs by path, reparsed only when the identity of the file or of
+// anything it %includes changes.
+class SpecIndex
+{
+	struct Entry
+	{
+		FileIdentity id;
+		QList<QPair<QString, std::optional<FileIdentity>>> includes;
+		std::shared_ptr<const Spec> spec;
+	};
+
+	QMutex mutex;
+	QHash<QString, Entry> specs;
+
+public:
+	auto Get(const QString &path, const std::atomic_bool *cancel = nullptr) -> Fallible<std::shared_ptr<const Spec>>
+	{
+		const auto absolute = QFileInfo(path).absoluteFilePath();
+		const auto id = StatIdentity(absolute);
+		if (!id.has_value())
+		{
+			return Error{QString("cannot stat %1").arg(absolute)};
+		}
+		std::optional<Entry> cached;
+		{
+			QMutexLocker lock(&mutex);
+			const auto it = specs.constFind(absolute);
+			if (it != specs.constEnd() && it->id == *id)
+			{
+				cached = *it;
+			}
+		}
+		if (cached.has_value() &&
+			std::all_of(cached->includes.cbegin(), cached->includes.cend(),
+						[](const auto &include) { return StatIdentity(include.first) == include.second; }))
+		{
+			return cached->spec;
+		}
+
+		const auto parsed = ReadSpec(absolute, cancel);
+		if (Failed(parsed))
+		{
+			return std::get<Error>(parsed);
+		}
+		Entry entry{*id, {}, std::make_shared<const Spec>(std::get<Spec>(parsed))};
+		for (const auto &include : entry.spec->includes)
+		{
+			entry.includes << qMakePair(include, StatIdentity(include));
+		}
+		QMutexLocker lock(&mutex);
+		specs.insert(absolute, entry);
+		return entry.spec;
+	}
+
+	auto Invalidate(const QString &path) -> void
+	{
+		QMutexLocker lock(&mutex);
+		specs.remove(QFileInfo(path).absoluteFilePath());
+	}
+
+	// Drops every spec under the directory.
+	auto InvalidateTree(const QString &directory) -> void
+	{
+		const auto prefix = QFileInfo(directory).absoluteFilePath() + "/";
+		QMutexLocker lock(&mutex);
+		for (auto it = specs.begin(); it != specs.end();)
+		{
+			if (it.key().startsWith(prefix))
+			{
+				it = specs.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+};
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryFile>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checksums.h"
+#include "error.h"
+
+// Copies from into a new file at to, sharing extents with FICLONE when the
+// filesystem supports it and falling back to copy_file_range, then to plain
+// reads and writes where that cannot cross filesystems or is not supported.
+auto CloneFile(const QString &from, const QString &to) -> Fallible<>
+{
+	const auto in = ::open(QFile::encodeName(from).constData(), O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+	{
+		return Error{QString("cannot open %1: %2").arg(from, qt_error_string(errno))};
+	}
+	struct stat st;
+	::fstat(in, &st);
+	const auto out = ::open(QFile::encodeName(to).constData(),
+							O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+	if (out < 0)
+	{
+		const auto err = errno;
+		::close(in);
+		return Error{QString("cannot create %1: %2").arg(to, qt_error_string(err))};
+	}
+
+	bool ok = ::ioctl(out, FICLONE, in) == 0;
+	auto err = 0;
+	if (!ok)
+	{
+		off_t remaining = st.st_size;
+		bool plain = false;
+		while (remaining > 0 && !plain)
+		{
+			const auto copied = ::copy_file_range(in, nullptr, out, nullptr, remaining, 0);
+			if (copied < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+			{
+				plain = true;
+			}
+			else if (copied <= 0)
+			{
+				err = errno;
+				break;
+			}
+			else
+			{
+				remaining -= copied;
+			}
+		}
+		// Both offsets are wherever copy_file_range left them.
+		QByteArray buffer(plain ? 1 << 20 : 0, Qt::Uninitialized);
+		while (plain && remaining > 0)
+		{
+			const auto got = ::read(in, buffer.data(), qMin<off_t>(buffer.size(), remaining));
+			if (got < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (got <= 0)
+			{
+				err = errno;
+				break;
+			}
+			qint64 written = 0;
+			while (written < got)
+			{
+				const auto put = ::write(out, buffer.constData() + written, got - written);
+				if (put < 0 && errno != EINTR)
+				{
+					break;
+				}
+				written += qMax<qint64>(put, 0);
+			}
+			if (written < got)
+			{
+				err = errno;
+				break;
+			}
+			remaining -= got;
+		}
+		ok = remaining == 0;
+	}
+	::close(in);
+	::close(out);
+	if (!ok)
+	{
+		::unlink(QFile::encodeName(to).constData());
+		return Error{QString("cannot copy %1 to %2: %3").arg(from, to, qt_error_string(err))};
+	}
+	return std::monostate{};
+}
+
+// Sources stored once by sha256 under root/sha256/ab/cdef...; build directories
+// get reflinks of the read-only objects, or copies where the filesystem cannot
+// share extents. Never hard links, which a build writing to its sources in
+// place would corrupt the object through.
+class SourceStore
+{
+	QString root;
+
+	auto Commit(const QString &staged, const QByteArray &digest) -> Fallible<QByteArray>
+	{
+		const auto object = ObjectPath(digest);
+		QDir().mkpath(QFileInfo(object).absolutePath());
+		::chmod(QFile::encodeName(staged).constData(), 0444);
+		if (::rename(QFile::encodeName(staged).constData(), QFile::encodeName(object).constData()) != 0)
+		{
+			const auto err = errno;
+			QFile::remove(staged);
+			return Error{QString("cannot store %1: %2").arg(object, qt_error_string(err))};
+		}
+		return digest;
+	}
+
+public:
+	static auto DefaultPath() -> QString
+	{
+		auto base = QString::fromLocal8Bit(qgetenv("XDG_CACHE_HOME"));
+		if (base.isEmpty())
+		{
+			base = QDir::homePath() + "/.cache";
+		}
+		return base + "/alpmbuild++/store";
+	}
+
+	explicit SourceStore(const QString &root = DefaultPath()) : root(root)
+	{
+		QDir().mkpath(root + "/tmp");
+	}
+
+	auto ObjectPath(const QByteArray &digest) const -> QString
+	{
+		const auto hex = QString::fromLatin1(digest).toLower();
+		return QString("%1/sha256/%2/%3").arg(root, hex.left(2), hex.mid(2));
+	}
+
+	auto Contains(const QByteArray &digest) const -> bool
+	{
+		return QFileInfo::exists(ObjectPath(digest));
+	}
+
+	// Path of a fresh file inside the store, on the same filesystem as the
+	// objects, for writers that want to Adopt() it afterwards.
+	auto StagingPath() const -> QString
+	{
+		QTemporaryFile file(root + "/tmp/stage.XXXXXX");
+		file.setAutoRemove(false);
+		file.open();
+		return file.fileName();
+	}
+
+	// Takes ownership of a file already inside the store's filesystem whose
+	// digest is known, e.g. a finished download.
+	auto Adopt(const QString &staged, const QByteArray &digest) -> Fallible<QByteArray>
+	{
+		if (Contains(digest))
+		{
+			QFile::remove(staged);
+			return digest;
+		}
+		return Commit(staged, digest);
+	}
+
+	auto Add(const QString &file, ChecksumCache &cache) -> Fallible<QByteArray>
+	{
+		const auto digest = cache.Digest(file);
+		if (Failed(digest))
+		{
+			return digest;
+		}
+		const auto hash = std::get<QByteArray>(digest);
+		if (Contains(hash))
+		{
+			return hash;
+		}
+
+		// The file may have changed since the cache saw it, so the object is
+		// named by what was actually copied.
+		const auto staged = StagingPath();
+		QFile::remove(staged);
+		const auto cloned = CloneFile(file, staged);
+		if (Failed(cloned))
+		{
+			return std::get<Error>(cloned);
+		}
+		const auto stagedDigest = FileSha256(staged);
+		if (Failed(stagedDigest))
+		{
+			QFile::remove(staged);
+			return stagedDigest;
+		}
+		if (std::get<QByteArray>(stagedDigest) != hash)
+		{
+			QFile::remove(staged);
+			return Error{QString("%1 changed while being stored").arg(file)};
+		}
+		return Commit(staged, std::get<QByteArray>(stagedDigest));
+	}
+
+	auto Checkout(const QByteArray &digest, const QString &destination) const -> Fallible<>
+	{
+		const auto object = ObjectPath(digest);
+		if (!QFileInfo::exists(object))
+		{
+			return Error{QString("%1 is not in the source store").arg(QString::fromLatin1(digest))};
+		}
+		QFile::remove(destination);
+		const auto cloned = CloneFile(object, destination);
+		if (Failed(cloned))
+		{
+			return cloned;
+		}
+		::chmod(QFile::encodeName(destination).constData(), 0644);
+		return std::monostate{};
+	}
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QProcess>
+
+#include "elfscan.h"
+#include "error.h"
+
+struct StripOptions
+{
+	QString strip = "strip";
+	QString objcopy = "objcopy";
+	// When set, debug info is split into debugRoot/usr/lib/debug.
+	QString debugRoot;
+};
+
+auto IsStripCandidate(const ElfInfo &elf) -> bool
+{
+	const bool strippable = elf.type == ET_EXEC || elf.type == ET_DYN || elf.type == ET_REL;
+	return strippable && (elf.hasSymbols || elf.hasDebugInfo);
+}
+
+auto StripFlags(const ElfInfo &elf) -> QStringList
+{
+	if (elf.type == ET_REL)
+	{
+		return {"--strip-debug"};
+	}
+	if (elf.type == ET_DYN && !elf.soname.isEmpty())
+	{
+		return {"--strip-unneeded"};
+	}
+	return {"--strip-all"};
+}
+
+auto RunTool(const QString &program, const QStringList &args) -> Fallible<>
+{
+	QProcess process;
+	process.setProcessChannelMode(QProcess::MergedChannels);
+	process.start(program, args);
+	if (!process.waitForFinished(-1))
+	{
+		return Error{QString("%1: %2").arg(program, process.errorString())};
+	}
+	if (process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0)
+	{
+		return Error{QString("%1 %2 failed: %3")
+						 .arg(program, args.join(' '),
+							  QString::fromLocal8Bit(process.readAll()).trimmed())};
+	}
+	return std::monostate{};
+}
+
+auto StripFile(const QString &root, const QString &relativePath, const ElfInfo &elf,
+			   const StripOptions &options) -> Fallible<>
+{
+	const auto path = root + "/" + relativePath;
+
+	if (!options.debugRoot.isEmpty() && elf.hasDebugInfo)
+	{
+		const auto debugPath = options.debugRoot + "/usr/lib/debug/" + relativePath + ".debug";
+		QDir().mkpath(QFileInfo(debugPath).absolutePath());
+
+		auto result = RunTool(options.objcopy, {"--only-keep-debug", path, debugPath});
+		if (Failed(result))
+		{
+			return result;
+		}
+		result = RunTool(options.objcopy, {"--add-gnu-debuglink=" + debugPath, path});
+		if (Failed(result))
+		{
+			return result;
+		}
+
+		if (elf.buildId.size() > 2)
+		{
+			const auto linkDir = options.debugRoot + "/usr/lib/debug/.build-id/" + elf.buildId.left(2);
+			QDir().mkpath(linkDir);
+			QFile::link("../../" + relativePath + ".debug",
+						linkDir + "/" + elf.buildId.mid(2) + ".debug");
+		}
+	}
+
+	return RunTool(options.strip, StripFlags(elf) << path);
+}
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <QByteArray>
+#include <QHash>
+#include <QIODevice>
+#include <QString>
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <optional>
+
+#include "error.h"
+
+struct TarEntry
+{
+	QString path;
+	char type = '0';
+	quint32 mode = 0644;
+	qint64 size = 0;
+	qint64 mtime = 0;
+	QString linkTarget;
+};
+
+class TarWriter
+{
+	std::function<bool(const char *, qint64)> out;
+
+	static auto Octal(char *field, int width, quint64 value) -> void
+	{
+		std::snprintf(field, width, "%0*llo", width - 1, static_cast<unsigned long long>(value));
+	}
+
+	static auto PaxRecord(const QByteArray &key, const QByteArray &value) -> QByteArray
+	{
+		const auto body = " " + key + "=" + value + "\n";
+		auto digits = QByteArray::number(body.size()).size();
+		while (QByteArray::number(body.size() + digits).size() != digits)
+		{
+			++digits;
+		}
+		return QByteArray::number(body.size() + digits) + body;
+	}
+
+	static auto Header(const QByteArray &name, char type, quint32 mode, qint64 size,
+					   qint64 mtime, const QByteArray &link) -> QByteArray
+	{
+		QByteArray block(512, '\0');
+		auto data = block.data();
+		std::memcpy(data, name.constData(), qMin<qsizetype>(name.size(), 100));
+		Octal(data + 100, 8, mode & 07777);
+		Octal(data + 108, 8, 0);
+		Octal(data + 116, 8, 0);
+		Octal(data + 124, 12, size);
+		Octal(data + 136, 12, mtime);
+		std::memset(data + 148, ' ', 8);
+		data[156] = type;
+		std::memcpy(data + 157, link.constData(), qMin<qsizetype>(link.size(), 100));
+		std::memcpy(data + 257, "ustar", 6);
+		std::memcpy(data + 263, "00", 2);
+		std::memcpy(data + 265, "root", 4);
+		std::memcpy(data + 297, "root", 4);
+
+		quint32 checksum = 0;
+		for (auto ch : block)
+		{
+			checksum += uchar(ch);
+		}
+		std::snprintf(data + 148, 8, "%06o", checksum);
+		data[155] = ' ';
+		return block;
+	}
+
+	auto Pad(qint64 size) -> bool
+	{
+		static const char zeros[512] = {};
+		const auto padding = (512 - size % 512) % 512;
+		return padding == 0 || out(zeros, padding);
+	}
+
+	auto WriteHeader(const TarEntry &entry) -> bool
+	{
+		const auto path = entry.path.toUtf8();
+		const auto link = entry.linkTarget.toUtf8();
+		constexpr qint64 maxOctalSize = 077777777777LL;
+
+		QByteArray pax;
+		if (path.size() > 100)
+		{
+			pax += PaxRecord("path", path);
+		}
+		if (link.size() > 100)
+		{
+			pax += PaxRecord("linkpath", link);
+		}
+		if (entry.size > maxOctalSize)
+		{
+			pax += PaxRecord("size", QByteArray::number(entry.size));
+		}
+		if (!pax.isEmpty())
+		{
+			const auto header = Header("PaxHeaders/" + path.right(89), 'x', 0644,
+									   pax.size(), entry.mtime, QByteArray());
+			if (!out(header.constData(), header.size()) ||
+				!out(pax.constData(), pax.size()) || !Pad(pax.size()))
+			{
+				return false;
+			}
+		}
+
+		const auto header = Header(path, entry.type, entry.mode,
+								   qMin(entry.size, maxOctalSize), entry.mtime, link);
+		return out(header.constData(), header.size());
+	}
+
+public:
+	explicit TarWriter(std::function<bool(const char *, qint64)> out) : out(out) {}
+
+	auto WriteEntry(const TarEntry &entry, const QByteArray &content = QByteArray()) -> bool
+	{
+		auto sized = entry;
+		sized.size = content.size();
+		return WriteHeader(sized) && out(content.constData(), content.size()) &&
+			   Pad(content.size());
+	}
+
+	auto WriteEntry(const TarEntry &entry, QIODevice &content) -> bool
+	{
+		if (!WriteHeader(entry))
+		{
+			return false;
+		}
+		QByteArray buffer(1 << 20, Qt::Uninitialized);
+		qint64 written = 0;
+		while (written < entry.size)
+		{
+			const auto got = content.read(buffer.data(), qMin<qint64>(buffer.size(), entry.size - written));
+			if (got <= 0 || !out(buffer.constData(), got))
+			{
+				return false;
+			}
+			written += got;
+		}
+		return Pad(entry.size);
+	}
+
+	auto Finish() -> bool
+	{
+		static const char zeros[1024] = {};
+		return out(zeros, sizeof zeros);
+	}
+};
+
+// Pulls a tar stream from `in`, which returns the next chunk of decompressed
+// bytes or an empty array at the end of the input.
+class TarReader
+{
+	std::function<Fallible<QByteArray>()> in;
+	QByteArray buffer;
+	qsizetype at = 0;
+	bool eof = false;
+
+	auto Fill(qint64 size) -> Fallible<>
+	{
+		while (!eof && buffer.size() - at < size)
+		{
+			const auto chunk = in();
+			if (Failed(chunk))
+			{
+				return std::get<Error>(chunk);
+			}
+			if (std::get<QByteArray>(chunk).isEmpty())
+			{
+				eof = true;
+				break;
+			}
+			buffer.remove(0, at);
+			at = 0;
+			buffer += std::get<QByteArray>(chunk);
+		}
+		if (buffer.size() - at < size)
+		{
+			return Error{"unexpected end of tar archive"};
+		}
+		return std::monostate{};
+	}
+
+	auto Take(qint64 size) -> Fallible<QByteArray>
+	{
+		const auto filled = Fill(size);
+		if (Failed(filled))
+		{
+			return std::get<Error>(filled);
+		}
+		const auto ret = buffer.mid(at, size);
+		at += size;
+		return ret;
+	}
+
+	static auto Number(const char *field, int width) -> qint64
+	{
+		if (uchar(field[0]) & 0x80)
+		{
+			qint64 value = 0;
+			for (int i = 1; i < width; ++i)
+			{
+				value = (value << 8) | uchar(field[i]);
+			}
+			return value;
+		}
+		return QByteArray(field, qstrnlen(field, width)).trimmed().toLongLong(nullptr, 8);
+	}
+
+	static auto Field(const char *field, int width) -> QByteArray
+	{
+		return QByteArray(field, qstrnlen(field, width));
+	}
+
+	static auto PaxRecords(const QByteArray &data) -> QHash<QByteArray, QByteArray>
+	{
+		QHash<QByteArray, QByteArray> ret;
+		qsizetype at = 0;
+		while (at < data.size())
+		{
+			const auto space = data.indexOf(' ', at);
+			const auto length = data.mid(at, space - at).toLongLong();
+			if (space < 0 || length <= 0)
+			{
+				break;
+			}
+			const auto record = data.mid(space + 1, at + length - space - 2);
+			const auto equals = record.indexOf('=');
+			if (equals > 0)
+			{
+				ret[record.left(equals)] = record.mid(equals + 1);
+			}
+			at += length;
+		}
+		return ret;
+	}
+
+public:
+	explicit TarReader(std::function<Fallible<QByteArray>()> in) : in(in) {}
+
+	// Returns the next member, or nothing at the end of the archive. The
+	// caller must consume the member's data with ReadData or SkipData.
+	auto Next() -> Fallible<std::optional<TarEntry>>
+	{
+		QByteArray longName;
+		QByteArray longLink;
+		QHash<QByteArray, QByteArray> pax;
+
+		while (true)
+		{
+			const auto block = Take(512);
+			if (Failed(block))
+			{
+				return std::get<Error>(block);
+			}
+			const auto header = std::get<QByteArray>(block);
+			const auto data = header.constData();
+			if (header.count('\0') == 512)
+			{
+				return std::nullopt;
+			}
+
+			TarEntry entry;
+			entry.type = data[156] == '\0' ? '0' : data[156];
+			entry.mode = Number(data + 100, 8);
+			entry.size = Number(data + 124, 12);
+			entry.mtime = Number(data + 136, 12);
+			auto name = Field(data, 100);
+			const auto prefix = Field(data + 345, 155);
+			if (std::memcmp(data + 257, "ustar", 5) == 0 && !prefix.isEmpty())
+			{
+				name = prefix + "/" + name;
+			}
+			auto link = Field(data + 157, 100);
+
+			if (entry.type == 'x' || entry.type == 'g' || entry.type == 'L' || entry.type == 'K')
+			{
+				const auto content = ReadData(entry.size);
+				if (Failed(content))
+				{
+					return std::get<Error>(content);
+				}
+				const auto bytes = std::get<QByteArray>(content);
+				if (entry.type == 'x')
+				{
+					pax = PaxRecords(bytes);
+				}
+				else if (entry.type == 'L')
+				{
+					longName = Field(bytes.constData(), bytes.size());
+				}
+				else if (entry.type == 'K')
+				{
+					longLink = Field(bytes.constData(), bytes.size());
+				}
+				continue;
+			}
+
+			if (!longName.isEmpty())
+			{
+				name = longName;
+			}
+			if (!longLink.isEmpty())
+			{
+				link = longLink;
+			}
+			if (pax.contains("path"))
+			{
+				name = pax["path"];
+			}
+			if (pax.contains("linkpath"))
+			{
+				link = pax["linkpath"];
+			}
+			if (pax.contains("size"))
+			{
+				entry.size = pax["size"].toLongLong();
+			}
+			if (pax.contains("mtime"))
+			{
+				entry.mtime = pax["mtime"].split('.').first().toLongLong();
+			}
+			entry.path = QString::fromUtf8(name);
+			entry.linkTarget = QString::fromUtf8(link);
+			return std::optional<TarEntry>(entry);
+		}
+	}
+
+	auto ReadData(qint64 size) -> Fallible<QByteArray>
+	{
+		const auto data = Take(size);
+		if (Failed(data))
+		{
+			return data;
+		}
+		const auto padding = Take((512 - size % 512) % 512);
+		if (Failed(padding))
+		{
+			return std::get<Error>(padding);
+		}
+		return data;
+	}
+
+	// For members too large to hold at once: the data is read a part at a
+	// time, then SkipPadding(size) moves on to the next header.
+	auto ReadPart(qint64 size) -> Fallible<QByteArray>
+	{
+		return Take(size);
+	}
+
+	auto SkipPadding(qint64 size) -> Fallible<>
+	{
+		const auto padding = Take((512 - size % 512) % 512);
+		if (Failed(padding))
+		{
+			return std::get<Error>(padding);
+		}
+		return std::monostate{};
+	}
+
+	auto SkipData(qint64 size) -> Fallible<>
+	{
+		auto remaining = size + (512 - size % 512) % 512;
+		while (remaining > 0)
+		{
+			const auto step = qMin<qint64>(remaining, 1 << 20);
+			const auto skipped = Take(step);
+			if (Failed(skipped))
+			{
+				return std::get<Error>(skipped);
+			}
+			remaining -= step;
+		}
+		return std::monostate{};
+	}
+};
@@ -0,0 +1,2111 @@
+#include <QCoreApplication>
+#include <QLocalSocket>
+#include <QNetworkProxy>
+#include <QStandardPaths>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTemporaryDir>
+#include <QtConcurrent>
+#include <QtTest>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "astcache.h"
+#include "buildcache.h"
+#include "buildlog.h"
+#include "buildroot.h"
+#include "checksums.h"
+#include "daemon.h"
+#include "delta.h"
+#include "elfscan.h"
+#include "extract.h"
+#include "fetch.h"
+#include "jobserver.h"
+#include "patch.h"
+#include "query.h"
+#include "repodb.h"
+#include "runner.h"
+#include "snapshot.h"
+#include "spec.h"
+#include "store.h"
+#include "watch.h"
+
+// Fails the test with the Error's message.
+#define VERIFY_OK(result)                                                                                    \
+	QVERIFY2(!Failed(result), qPrintable(Failed(result) ? std::get<Error>(result).message : QString()))
+
+// Serves one file over HTTP/1.1 to HEAD and GET, honouring single byte ranges.
+class RangeServer
+{
+	QTcpServer server;
+	QByteArray content;
+
+	auto Respond(QTcpSocket &socket, const QByteArray &request) -> void
+	{
+		static const QRegularExpression range("^range: *bytes=(\\d+)-(\\d+)",
+											  QRegularExpression::CaseInsensitiveOption);
+		const auto lines = request.split('\n');
+		qint64 from = 0;
+		qint64 to = content.size() - 1;
+		bool ranged = false;
+		for (const auto &line : lines)
+		{
+			const auto match = range.match(QString::fromLatin1(line.trimmed()));
+			if (match.hasMatch())
+			{
+				ranged = true;
+				from = match.captured(1).toLongLong();
+				to = qMin(match.captured(2).toLongLong(), content.size() - 1);
+			}
+		}
+		rangeRequests += ranged;
+		const auto body = content.mid(from, to - from + 1);
+		QByteArray response = ranged ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n";
+		response += "Accept-Ranges: bytes\r\nContent-Length: " + QByteArray::number(body.size()) + "\r\n";
+		if (ranged)
+		{
+			response += QString("Content-Range: bytes %1-%2/%3\r\n").arg(from).arg(to).arg(content.size()).toLatin1();
+		}
+		response += "\r\n";
+		if (!lines.value(0).startsWith("HEAD "))
+		{
+			response += body;
+		}
+		socket.write(response);
+	}
+
+public:
+	int rangeRequests = 0;
+
+	explicit RangeServer(const QByteArray &content) : content(content)
+	{
+		server.listen(QHostAddress::LocalHost);
+		QObject::connect(&server, &QTcpServer::newConnection, &server, [this] {
+			while (const auto socket = server.nextPendingConnection())
+			{
+				auto buffer = std::make_shared<QByteArray>();
+				QObject::connect(socket, &QTcpSocket::readyRead, socket, [this, socket, buffer] {
+					*buffer += socket->readAll();
+					qsizetype end;
+					while ((end = buffer->indexOf("\r\n\r\n")) >= 0)
+					{
+						const auto request = buffer->left(end);
+						buffer->remove(0, end + 4);
+						Respond(*socket, request);
+					}
+				});
+				QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+			}
+		});
+	}
+
+	auto Url(const QString &name) const -> QUrl
+	{
+		return QUrl(QString("http://127.0.0.1:%1/%2").arg(server.serverPort()).arg(name));
+	}
+};
+
+// An in-memory object store over HTTP/1.1: GET and PUT by path, 404 for a miss.
+class ObjectServer
+{
+	QTcpServer server;
+
+public:
+	QHash<QByteArray, QByteArray> objects;
+
+	ObjectServer()
+	{
+		server.listen(QHostAddress::LocalHost);
+		QObject::connect(&server, &QTcpServer::newConnection, &server, [this] {
+			while (const auto socket = server.nextPendingConnection())
+			{
+				auto buffer = std::make_shared<QByteArray>();
+				QObject::connect(socket, &QTcpSocket::readyRead, socket, [this, socket, buffer] {
+					static const QRegularExpression length("\\r\\ncontent-length: *(\\d+)",
+														   QRegularExpression::CaseInsensitiveOption);
+					*buffer += socket->readAll();
+					qsizetype end;
+					while ((end = buffer->indexOf("\r\n\r\n")) >= 0)
+					{
+						const auto head = buffer->left(end);
+						const auto match = length.match(QString::fromLatin1(head));
+						const auto size = match.hasMatch() ? match.captured(1).toLongLong() : 0;
+						if (buffer->size() < end + 4 + size)
+						{
+							return;
+						}
+						const auto body = buffer->mid(end + 4, size);
+						buffer->remove(0, end + 4 + size);
+						const auto request = head.left(head.indexOf("\r\n")).split(' ');
+						if (request.value(0) == "PUT")
+						{
+							objects[request.value(1)] = body;
+							socket->write("HTTP/1.1 201 Created\r\nContent-Length: 0\r\n\r\n");
+						}
+						else if (objects.contains(request.value(1)))
+						{
+							const auto &object = objects[request.value(1)];
+							socket->write("HTTP/1.1 200 OK\r\nContent-Length: " + QByteArray::number(object.size()) +
+										  "\r\n\r\n" + object);
+						}
+						else
+						{
+							socket->write("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+						}
+					}
+				});
+				QObject::connect(socket, &QTcpSocket::disconnected, socket, &QObject::deleteLater);
+			}
+		});
+	}
+
+	auto Url() const -> QUrl { return QUrl(QString("http://127.0.0.1:%1/cache/").arg(server.serverPort())); }
+};
+
+class Tests : public QObject
+{
+	Q_OBJECT
+
+	static auto WriteFile(const QString &path, const QByteArray &content) -> bool
+	{
+		QDir().mkpath(QFileInfo(path).path());
+		QFile file(path);
+		return file.open(QIODevice::WriteOnly) && file.write(content) == content.size();
+	}
+
+	static auto ReadFile(const QString &path) -> QByteArray
+	{
+		QFile file(path);
+		return file.open(QIODevice::ReadOnly) ? file.readAll() : QByteArray();
+	}
+
+	static auto Gunzip(const QByteArray &data) -> QByteArray
+	{
+		z_stream stream{};
+		inflateInit2(&stream, MAX_WBITS + 16);
+		QByteArray ret;
+		QByteArray buffer(1 << 16, Qt::Uninitialized);
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.constData()));
+		stream.avail_in = uInt(data.size());
+		auto status = Z_OK;
+		while (status == Z_OK)
+		{
+			stream.next_out = reinterpret_cast<Bytef *>(buffer.data());
+			stream.avail_out = uInt(buffer.size());
+			status = inflate(&stream, Z_NO_FLUSH);
+			ret.append(buffer.constData(), buffer.size() - stream.avail_out);
+		}
+		inflateEnd(&stream);
+		return status == Z_STREAM_END ? ret : QByteArray();
+	}
+
+	static auto WriteTar(const QString &path, const QList<QPair<TarEntry, QByteArray>> &members) -> bool
+	{
+		QDir().mkpath(QFileInfo(path).path());
+		QFile file(path);
+		if (!file.open(QIODevice::WriteOnly))
+		{
+			return false;
+		}
+		TarWriter writer([&file](const char *data, qint64 size) { return file.write(data, size) == size; });
+		for (const auto &[entry, content] : members)
+		{
+			if (!writer.WriteEntry(entry, content))
+			{
+				return false;
+			}
+		}
+		return writer.Finish();
+	}
+
+	static auto Bytes(const QByteArray &data) -> const uchar *
+	{
+		return reinterpret_cast<const uchar *>(data.constData());
+	}
+
+	// data as ZstdWriter writes it in frames of frameSize, with a seek table.
+	static auto WriteZstd(const QString &path, const QByteArray &data, qint64 frameSize) -> bool
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::WriteOnly))
+		{
+			return false;
+		}
+		ZstdWriter writer(file, 3, 0, frameSize);
+		return writer.Write(data.constData(), data.size()) && writer.EndFrame() && writer.WriteSeekTable();
+	}
+
+	static auto Sha256(const QByteArray &data) -> QByteArray
+	{
+		return QCryptographicHash::hash(data, QCryptographicHash::Sha256).toHex();
+	}
+
+	// Reads replies until count have arrived, keyed by their id.
+	static auto Replies(QLocalSocket &socket, int count) -> QHash<int, QJsonObject>
+	{
+		QHash<int, QJsonObject> ret;
+		QDeadlineTimer deadline(10000);
+		while (ret.size() < count && !deadline.hasExpired())
+		{
+			if (!socket.canReadLine())
+			{
+				QTest::qWait(5);
+				continue;
+			}
+			const auto reply = QJsonDocument::fromJson(socket.readLine()).object();
+			ret.insert(reply["id"].toInt(-1), reply);
+		}
+		return ret;
+	}
+
+	static auto Send(QLocalSocket &socket, const QJsonObject &request) -> void
+	{
+		socket.write(QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n");
+	}
+
+	// Distinct lines, so a misplaced byte range cannot compare equal.
+	static auto LogLines(const QByteArray &prefix, qint64 size) -> QByteArray
+	{
+		QByteArray ret;
+		for (int i = 0; ret.size() < size; ++i)
+		{
+			ret += prefix + " " + QByteArray::number(i) + "\n";
+		}
+		return ret.left(size);
+	}
+
+	static auto MemberPaths(const QString &package) -> QStringList
+	{
+		QStringList ret;
+		const auto members = ListPackage(package);
+		for (const auto &member : Failed(members) ? QList<TarEntry>() : std::get<QList<TarEntry>>(members))
+		{
+			ret << member.path;
+		}
+		return ret;
+	}
+
+	// A jobserver as make -jN hands it down, with tokens in a non-blocking pipe.
+	struct JobserverPipe
+	{
+		int fds[2] = {-1, -1};
+
+		explicit JobserverPipe(const QByteArray &tokens)
+		{
+			if (::pipe2(fds, O_NONBLOCK) == 0 && ::write(fds[1], tokens.constData(), tokens.size()) == tokens.size())
+			{
+				qputenv("MAKEFLAGS", QString(" -j%1 --jobserver-auth=%2,%3")
+										 .arg(tokens.size() + 1)
+										 .arg(fds[0])
+										 .arg(fds[1])
+										 .toLocal8Bit());
+			}
+		}
+		~JobserverPipe()
+		{
+			qunsetenv("MAKEFLAGS");
+			::close(fds[0]);
+			::close(fds[1]);
+		}
+	};
+
+private slots:
+	void sonameDependency()
+	{
+		QCOMPARE(SonameDependency("libfoo.so.1.2", 64), QString("libfoo.so=1.2-64"));
+		QCOMPARE(SonameDependency("libfoo.so.1", 32), QString("libfoo.so=1-32"));
+		QCOMPARE(SonameDependency("libfoo.so.so.3", 64), QString("libfoo.so.so=3-64"));
+		QVERIFY(SonameDependency("libfoo.so", 64).isEmpty());
+		QVERIFY(SonameDependency("libfoo.so.", 64).isEmpty());
+		QVERIFY(SonameDependency(".so.1", 64).isEmpty());
+	}
+
+	// The test binary itself is an ELF file linked against libzstd.so.1.
+	void elfScansOwnExecutable()
+	{
+		const auto elf = ReadElf(QCoreApplication::applicationFilePath());
+		QVERIFY(elf);
+		QCOMPARE(elf->bits, int(sizeof(void *) * 8));
+		QVERIFY(elf->type == ET_DYN || elf->type == ET_EXEC);
+		QVERIFY(!elf->machine.isEmpty());
+		QVERIFY(elf->needed.contains("libzstd.so.1"));
+
+		PkgInfo pkg;
+		pkg.arch = "x86_64";
+		AddElfMetadata(pkg, {*elf});
+		QVERIFY(pkg.depends.contains(QString("libzstd.so=1-%1").arg(elf->bits)));
+		QVERIFY(pkg.provides.isEmpty());
+	}
+
+	void elfToleratesOtherFiles()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QFile text(dir.filePath("script"));
+		QVERIFY(text.open(QIODevice::WriteOnly));
+		text.write("#!/bin/sh\n");
+		text.close();
+		QVERIFY(!ReadElf(text.fileName()));
+
+		// Section headers past the end of the file are ignored, not read.
+		QFile self(QCoreApplication::applicationFilePath());
+		QVERIFY(self.open(QIODevice::ReadOnly));
+		QFile truncated(dir.filePath("truncated"));
+		QVERIFY(truncated.open(QIODevice::WriteOnly));
+		truncated.write(self.read(256));
+		truncated.close();
+		const auto elf = ReadElf(truncated.fileName());
+		QVERIFY(elf);
+		QVERIFY(elf->needed.isEmpty());
+		QVERIFY(elf->soname.isEmpty());
+
+		QCOMPARE(ScanElfTree(dir.path()).size(), 1);
+	}
+
+	void jobserverWaitsForTokens()
+	{
+		JobserverPipe pipe("+");
+		Jobserver jobserver;
+		QCOMPARE(jobserver.Acquire(), Jobserver::Implicit);
+		const auto token = jobserver.Acquire();
+		QCOMPARE(token, int('+'));
+
+		// The pipe is empty and non-blocking; the third job must wait rather
+		// than run on a local slot.
+		auto third = QtConcurrent::run([&jobserver] { return jobserver.Acquire(); });
+		QTest::qWait(100);
+		QVERIFY(!third.isFinished());
+		jobserver.Release(token);
+		QCOMPARE(third.result(), int('+'));
+		jobserver.Release(third.result());
+		jobserver.Release(Jobserver::Implicit);
+	}
+
+	void jobserverFallsBackToImplicitToken()
+	{
+		JobserverPipe pipe("");
+		Jobserver jobserver;
+		::close(pipe.fds[1]);
+		pipe.fds[1] = -1;
+		QCOMPARE(jobserver.Acquire(), Jobserver::Implicit);
+
+		QTest::ignoreMessage(QtWarningMsg, QRegularExpression("jobserver unusable"));
+		auto second = QtConcurrent::run([&jobserver] { return jobserver.Acquire(); });
+		QTest::qWait(100);
+		QVERIFY(!second.isFinished());
+		jobserver.Release(Jobserver::Implicit);
+		QCOMPARE(second.result(), Jobserver::Implicit);
+		jobserver.Release(Jobserver::Implicit);
+	}
+
+	void packageStripsHardLinkedBinaries()
+	{
+		if (QStandardPaths::findExecutable("strip").isEmpty())
+		{
+			QSKIP("needs strip from binutils");
+		}
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto pkgdir = dir.filePath("pkg");
+		const auto tool = pkgdir + "/usr/bin/tool";
+		QVERIFY(WriteFile(pkgdir + "/usr/share/doc/tool/README", "read me\n"));
+		QDir().mkpath(pkgdir + "/usr/bin");
+		QVERIFY(QFile::copy(QCoreApplication::applicationFilePath(), tool));
+		QCOMPARE(::link(QFile::encodeName(tool).constData(), QFile::encodeName(tool + "2").constData()), 0);
+		const auto before = ReadElf(tool);
+		QVERIFY(before);
+
+		QDir().mkpath(dir.filePath("out"));
+		const PkgInfo pkg{.pkgname = "tool", .pkgver = "1-1", .arch = "x86_64"};
+		const auto packaged = PackageBuildroot(pkg, pkgdir, dir.filePath("out"), BuildrootOptions{.level = 3});
+		VERIFY_OK(packaged);
+		const auto outputs = std::get<QStringList>(packaged);
+		QCOMPARE(outputs.size(), 1);
+		QCOMPARE(QFileInfo(outputs[0]).fileName(), QString("tool-1-1-x86_64.pkg.tar.zst"));
+
+		const auto after = ReadElf(tool);
+		QVERIFY(after);
+		QVERIFY(!after->hasSymbols);
+		QCOMPARE(QFileInfo(tool + "2").size(), QFileInfo(tool).size());
+		if (before->hasSymbols)
+		{
+			QVERIFY(QFileInfo(tool).size() < QFileInfo(QCoreApplication::applicationFilePath()).size());
+		}
+
+		const auto members = MemberPaths(outputs[0]);
+		for (const auto &path : {".PKGINFO", "usr/bin/tool", "usr/bin/tool2", "usr/share/doc/tool/README"})
+		{
+			QVERIFY2(members.contains(path), path);
+		}
+		const auto info = ReadPackageInfo(outputs[0]);
+		VERIFY_OK(info);
+		QVERIFY(std::get<PkgInfo>(info).depends.contains(QString("libzstd.so=1-%1").arg(after->bits)));
+	}
+
+	void docPages()
+	{
+		QVERIFY(IsDocPage("usr/share/man/man1/tool.1"));
+		QVERIFY(IsDocPage("usr/share/info/tool.info"));
+		QVERIFY(!IsDocPage("usr/share/man/man1/tool.1.gz"));
+		QVERIFY(!IsDocPage("usr/share/info/dir"));
+		QVERIFY(!IsDocPage("usr/share/doc/tool/tool.1"));
+	}
+
+	void gzipIsReproducible()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto content = QByteArray(".TH TOOL 1\n").repeated(5000);
+		QVERIFY(WriteFile(dir.filePath("a.1"), content));
+		QVERIFY(WriteFile(dir.filePath("b.1"), content));
+		QFile::setPermissions(dir.filePath("a.1"), QFileDevice::ReadOwner | QFileDevice::WriteOwner);
+		VERIFY_OK(GzipFile(dir.filePath("a.1"), dir.filePath("a.1.gz")));
+		QTest::qSleep(1100);
+		VERIFY_OK(GzipFile(dir.filePath("b.1"), dir.filePath("b.1.gz")));
+
+		const auto gzipped = ReadFile(dir.filePath("a.1.gz"));
+		QCOMPARE(ReadFile(dir.filePath("b.1.gz")), gzipped);
+		QVERIFY(gzipped.size() < content.size());
+		QCOMPARE(Gunzip(gzipped), content);
+		QCOMPARE(QFileInfo(dir.filePath("a.1.gz")).permissions(), QFileInfo(dir.filePath("a.1")).permissions());
+		QCOMPARE(QFileInfo(dir.filePath("a.1.gz")).lastModified(), QFileInfo(dir.filePath("a.1")).lastModified());
+	}
+
+	void packageCompressesDocPages()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto pkgdir = dir.filePath("pkg");
+		const auto man = pkgdir + "/usr/share/man/man1/";
+		QVERIFY(WriteFile(man + "tool.1", ".TH TOOL 1\n"));
+		QVERIFY(QFile::link("tool.1", man + "alias.1"));
+		QCOMPARE(::link(QFile::encodeName(man + "tool.1").constData(),
+						QFile::encodeName(man + "other.1").constData()),
+				 0);
+		QDir().mkpath(dir.filePath("out"));
+
+		const PkgInfo pkg{.pkgname = "tool", .pkgver = "1-1", .arch = "any"};
+		const auto packaged =
+			PackageBuildroot(pkg, pkgdir, dir.filePath("out"), BuildrootOptions{.strip = false, .level = 3});
+		VERIFY_OK(packaged);
+		const auto members = MemberPaths(std::get<QStringList>(packaged).first());
+		for (const auto &page : {"tool.1.gz", "other.1.gz", "alias.1.gz"})
+		{
+			QVERIFY2(members.contains(QString("usr/share/man/man1/") + page), page);
+		}
+		QVERIFY(!members.contains("usr/share/man/man1/tool.1"));
+		QVERIFY(QFileInfo(man + "alias.1.gz").isSymLink());
+		QCOMPARE(QFileInfo(man + "alias.1.gz").canonicalFilePath(), QFileInfo(man + "tool.1.gz").canonicalFilePath());
+		QCOMPARE(Gunzip(ReadFile(man + "other.1.gz")), QByteArray(".TH TOOL 1\n"));
+	}
+
+	void checksumCacheInvalidates()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto file = dir.filePath("source.tar");
+		QVERIFY(WriteFile(file, "first"));
+		ChecksumCache cache(dir.filePath("cache"));
+		QVERIFY(!cache.Lookup(file));
+		const auto digest = cache.Digest(file);
+		VERIFY_OK(digest);
+		QCOMPARE(std::get<QByteArray>(digest), Sha256("first"));
+		QCOMPARE(cache.Lookup(file), std::optional<QByteArray>(Sha256("first")));
+
+		// Same size, and the mtime put back: ctime still tells them apart.
+		const auto mtime = QFileInfo(file).lastModified();
+		QTest::qSleep(10);
+		QVERIFY(WriteFile(file, "other"));
+		QFile touched(file);
+		QVERIFY(touched.open(QIODevice::ReadWrite));
+		QVERIFY(touched.setFileTime(mtime, QFileDevice::FileModificationTime));
+		touched.close();
+		QVERIFY(!cache.Lookup(file));
+		QCOMPARE(std::get<QByteArray>(cache.Digest(file)), Sha256("other"));
+	}
+
+	void checksumCachePrunesOnSave()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto cachePath = dir.filePath("cache");
+		auto entries = [&cachePath] {
+			QFile file(cachePath);
+			file.open(QIODevice::ReadOnly);
+			QDataStream stream(&file);
+			quint32 magic, version;
+			QHash<FileIdentity, CachedDigest> digests;
+			stream >> magic >> version >> digests;
+			return digests;
+		};
+		QVERIFY(WriteFile(dir.filePath("kept"), "kept"));
+		QVERIFY(WriteFile(dir.filePath("removed"), "removed"));
+		{
+			ChecksumCache cache(cachePath);
+			VERIFY_OK(cache.Digest(dir.filePath("kept")));
+			VERIFY_OK(cache.Digest(dir.filePath("removed")));
+			VERIFY_OK(cache.Save());
+		}
+		QCOMPARE(entries().size(), 2);
+		QVERIFY(QFile::remove(dir.filePath("removed")));
+		QVERIFY(WriteFile(dir.filePath("added"), "added"));
+		{
+			ChecksumCache cache(cachePath);
+			QCOMPARE(cache.Lookup(dir.filePath("kept")), std::optional<QByteArray>(Sha256("kept")));
+			VERIFY_OK(cache.Digest(dir.filePath("added")));
+			VERIFY_OK(cache.Save());
+		}
+		const auto saved = entries();
+		QCOMPARE(saved.size(), 2);
+		for (const auto &entry : saved)
+		{
+			QVERIFY(entry.path == dir.filePath("kept") || entry.path == dir.filePath("added"));
+		}
+	}
+
+	void verifySha256Sums()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QVERIFY(WriteFile(dir.filePath("a"), "a"));
+		QVERIFY(WriteFile(dir.filePath("b"), "b"));
+		ChecksumCache cache(dir.filePath("cache"));
+		VERIFY_OK(VerifySha256Sums(cache, {{dir.filePath("a"), QString::fromLatin1(Sha256("a").toUpper())},
+										   {dir.filePath("b"), "SKIP"}}));
+		// A hit that does not match fails as a computed digest does.
+		const auto checked = VerifySha256Sums(cache, {{dir.filePath("a"), QString::fromLatin1(Sha256("b"))},
+													  {dir.filePath("b"), QString::fromLatin1(Sha256("a"))}});
+		QVERIFY(Failed(checked));
+		QVERIFY(std::get<Error>(checked).message.contains(dir.filePath("a")));
+		QVERIFY(std::get<Error>(checked).message.contains(dir.filePath("b")));
+	}
+
+	void storeChecksOutCopies()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		SourceStore store(dir.filePath("store"));
+		ChecksumCache cache(dir.filePath("cache"));
+		QVERIFY(WriteFile(dir.filePath("source.tar"), "source"));
+		const auto added = store.Add(dir.filePath("source.tar"), cache);
+		VERIFY_OK(added);
+		const auto digest = std::get<QByteArray>(added);
+		QCOMPARE(digest, Sha256("source"));
+		QVERIFY(store.Contains(digest));
+		QVERIFY(!(QFileInfo(store.ObjectPath(digest)).permissions() & QFileDevice::WriteOwner));
+		// Adding it again finds the object instead of copying.
+		QCOMPARE(std::get<QByteArray>(store.Add(dir.filePath("source.tar"), cache)), digest);
+
+		const auto checkout = dir.filePath("build/source.tar");
+		QDir().mkpath(dir.filePath("build"));
+		QVERIFY(WriteFile(checkout, "stale"));
+		VERIFY_OK(store.Checkout(digest, checkout));
+		QCOMPARE(ReadFile(checkout), QByteArray("source"));
+		struct stat object, copy;
+		QCOMPARE(::stat(QFile::encodeName(store.ObjectPath(digest)).constData(), &object), 0);
+		QCOMPARE(::stat(QFile::encodeName(checkout).constData(), &copy), 0);
+		QVERIFY(object.st_ino != copy.st_ino);
+		QCOMPARE(copy.st_mode & 0777, 0644u);
+
+		// A build writing to its checkout leaves the object alone.
+		QVERIFY(WriteFile(checkout, "patched"));
+		QCOMPARE(ReadFile(store.ObjectPath(digest)), QByteArray("source"));
+		QVERIFY(Failed(store.Checkout(Sha256("missing"), checkout)));
+	}
+
+	void cloneFileAcrossFilesystems()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QTemporaryDir shm("/dev/shm/alpmbuild-test-XXXXXX");
+		struct stat here, there;
+		if (!shm.isValid() || ::stat(QFile::encodeName(dir.path()).constData(), &here) != 0 ||
+			::stat(QFile::encodeName(shm.path()).constData(), &there) != 0 || here.st_dev == there.st_dev)
+		{
+			QSKIP("needs /dev/shm on another filesystem");
+		}
+		QByteArray content;
+		for (int i = 0; i < 300000; ++i)
+		{
+			content += QByteArray::number(i);
+		}
+		QVERIFY(WriteFile(shm.filePath("source"), content));
+		VERIFY_OK(CloneFile(shm.filePath("source"), dir.filePath("copy")));
+		QCOMPARE(ReadFile(dir.filePath("copy")), content);
+		QVERIFY(Failed(CloneFile(shm.filePath("source"), dir.filePath("copy"))));
+	}
+
+	void fetchSourceVerifiesBeforeCommitting()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QNetworkAccessManager network;
+		SourceStore store(dir.filePath("store"));
+		const auto srcdir = dir.filePath("src");
+		QVERIFY(WriteFile(dir.filePath("mirror/fix.patch"), "patch"));
+		const auto url = QUrl::fromLocalFile(dir.filePath("mirror/fix.patch"));
+
+		const auto wrong = FetchSource(network, store, url, Sha256("other"), srcdir);
+		QVERIFY(Failed(wrong));
+		QVERIFY(std::get<Error>(wrong).message.contains("sha256 mismatch"));
+		QVERIFY(!QFileInfo::exists(srcdir + "/fix.patch"));
+		QVERIFY(!store.Contains(Sha256("patch")));
+
+		VERIFY_OK(FetchSource(network, store, url, Sha256("patch").toUpper(), srcdir));
+		QCOMPARE(ReadFile(srcdir + "/fix.patch"), QByteArray("patch"));
+		QVERIFY(store.Contains(Sha256("patch")));
+
+		// Known sums come from the store without touching the URL.
+		QVERIFY(QFile::remove(dir.filePath("mirror/fix.patch")));
+		QVERIFY(QFile::remove(srcdir + "/fix.patch"));
+		VERIFY_OK(FetchSource(network, store, url, Sha256("patch"), srcdir));
+		QCOMPARE(ReadFile(srcdir + "/fix.patch"), QByteArray("patch"));
+	}
+
+	void fetchSourceExtractsArchives()
+	{
+		if (QStandardPaths::findExecutable("bsdtar").isEmpty())
+		{
+			QSKIP("needs bsdtar");
+		}
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto archive = dir.filePath("mirror/tool-1.0.tar");
+		QVERIFY(WriteTar(archive, {{TarEntry{.path = "tool-1.0/", .type = '5', .mode = 0755}, QByteArray()},
+								   {TarEntry{.path = "tool-1.0/README"}, QByteArray(100000, 'r')}}));
+		const auto digest = FileSha256(archive);
+		VERIFY_OK(digest);
+
+		QNetworkAccessManager network;
+		SourceStore store(dir.filePath("store"));
+		const auto srcdir = dir.filePath("src");
+		VERIFY_OK(FetchSource(network, store, QUrl::fromLocalFile(archive), std::get<QByteArray>(digest), srcdir));
+		QCOMPARE(ReadFile(srcdir + "/tool-1.0/README"), QByteArray(100000, 'r'));
+		QCOMPARE(ReadFile(srcdir + "/tool-1.0.tar"), ReadFile(archive));
+		QCOMPARE(QDir(srcdir).entryList(QDir::AllEntries | QDir::Hidden | QDir::NoDotAndDotDot),
+				 QStringList({"tool-1.0", "tool-1.0.tar"}));
+
+		// Garbage named like an archive fails without leaving anything behind.
+		QVERIFY(WriteFile(dir.filePath("mirror/bad.tar"), QByteArray(4096, 'x')));
+		QVERIFY(Failed(FetchSource(network, store, QUrl::fromLocalFile(dir.filePath("mirror/bad.tar")), "SKIP",
+								   dir.filePath("bad"))));
+		QVERIFY(!QFileInfo::exists(dir.filePath("bad/bad.tar")));
+	}
+
+	void fetcherSplitsLargeDownloadsIntoRanges()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QByteArray content;
+		for (int i = 0; content.size() < (1 << 20); ++i)
+		{
+			content += QByteArray::number(i) + '\n';
+		}
+		RangeServer server(content);
+		QNetworkAccessManager network;
+		network.setProxy(QNetworkProxy::NoProxy);
+		SourceStore store(dir.filePath("store"));
+		QVERIFY(WriteFile(dir.filePath("local.patch"), "local"));
+
+		Fetcher fetcher(network, store);
+		fetcher.rangeThreshold = 64 << 10;
+		fetcher.rangeParts = 4;
+		const auto results = fetcher.FetchAll({
+			{server.Url("tool-1.0.tar"), Sha256(content)},
+			{server.Url("mirror/tool-1.0.tar"), Sha256(content)},
+			{QUrl::fromLocalFile(dir.filePath("local.patch")), Sha256("other")},
+			{server.Url("tool-1.0.tar"), "SKIP"},
+		});
+		QCOMPARE(results.size(), 4);
+		VERIFY_OK(results[0]);
+		QCOMPARE(std::get<QByteArray>(results[0]), Sha256(content));
+		QCOMPARE(std::get<QByteArray>(results[1]), Sha256(content));
+		QVERIFY(Failed(results[2]));
+		QVERIFY(std::get<Error>(results[2]).message.contains("sha256 mismatch"));
+		QCOMPARE(std::get<QByteArray>(results[3]), Sha256(content));
+		QVERIFY(server.rangeRequests >= 4);
+		QCOMPARE(ReadFile(store.ObjectPath(Sha256(content))), content);
+
+		// Sums already in the store are not downloaded again.
+		const auto requests = server.rangeRequests;
+		const auto again = fetcher.FetchAll({{server.Url("tool-1.0.tar"), Sha256(content)}});
+		QCOMPARE(std::get<QByteArray>(again[0]), Sha256(content));
+		QCOMPARE(server.rangeRequests, requests);
+	}
+
+	void diffParses()
+	{
+		const QByteArray diff = "From: someone\n"
+								"--- a/src/main.c\n"
+								"+++ b/src/main.c\n"
+								"@@ -1,3 +1,3 @@\n"
+								" int main()\n"
+								"-{ return 1; }\n"
+								"+{ return 0; }\n"
+								" \n"
+								"--- a/README\n"
+								"+++ b/README\n"
+								"@@ -0,0 +1 @@\n"
+								"+hello\n"
+								"\\ No newline at end of file\n";
+		const auto result = UnifiedDiff->ParseBytes(diff);
+		QVERIFY(std::holds_alternative<QList<FilePatch>>(result));
+		const auto &patches = std::get<QList<FilePatch>>(result);
+		QCOMPARE(patches.size(), 2);
+		QCOMPARE(patches[0].oldPath, QByteArray("a/src/main.c"));
+		QCOMPARE(patches[0].newPath, QByteArray("b/src/main.c"));
+		QCOMPARE(patches[0].hunks.size(), 1);
+		QCOMPARE(patches[0].hunks[0].lines.size(), 4);
+		QCOMPARE(patches[0].hunks[0].lines[1].kind, '-');
+		QCOMPARE(patches[1].hunks[0].lines.size(), 1);
+		QVERIFY(!patches[1].hunks[0].lines[0].newline);
+	}
+
+	void diffRejectsTruncatedHunk()
+	{
+		const QByteArray diff = "--- a/file\n"
+								"+++ b/file\n"
+								"@@ -1,3 +1,3 @@\n"
+								" one\n"
+								"-two\n";
+		QVERIFY(std::holds_alternative<Failure>(UnifiedDiff->ParseBytes(diff)));
+		QVERIFY(std::holds_alternative<Failure>(UnifiedDiff->ParseBytes("--- a/file\n+++ b/file\n")));
+	}
+
+	// The first hunk lands three lines late; that offset has to carry over
+	// to the third hunk, whose context also appears three lines early.
+	void patchCarriesOffsetAcrossHunks()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const QByteArrayList original{"a", "b", "c", "f4", "f5", "f6", "f7", "f8", "f9", "f10", "d", "e",
+									  "f", "g14", "g15", "g16", "r", "s", "t", "r", "s", "t", "end"};
+		QVERIFY(WriteFile(dir.filePath("src/file"), "n1\nn2\nn3\n" + original.join('\n') + '\n'));
+		QVERIFY(WriteFile(dir.filePath("fix.patch"), "--- a/file\n"
+													 "+++ b/file\n"
+													 "@@ -1,3 +1,3 @@\n"
+													 " a\n"
+													 "-b\n"
+													 "+B\n"
+													 " c\n"
+													 "@@ -11,3 +11,3 @@\n"
+													 " d\n"
+													 "-e\n"
+													 "+E\n"
+													 " f\n"
+													 "@@ -20,3 +20,3 @@\n"
+													 " r\n"
+													 "-s\n"
+													 "+S\n"
+													 " t\n"));
+		VERIFY_OK(ApplyPatches(dir.filePath("src"), {PatchFile{dir.filePath("fix.patch"), PatchOptions{}}}));
+
+		auto expected = original;
+		expected[1] = "B";
+		expected[11] = "E";
+		expected[20] = "S";
+		QCOMPARE(ReadFile(dir.filePath("src/file")), "n1\nn2\nn3\n" + expected.join('\n') + '\n');
+
+		// And back again.
+		VERIFY_OK(ApplyPatches(dir.filePath("src"),
+							   {PatchFile{dir.filePath("fix.patch"), PatchOptions{.reverse = true}}}));
+		QCOMPARE(ReadFile(dir.filePath("src/file")), "n1\nn2\nn3\n" + original.join('\n') + '\n');
+	}
+
+	void patchReportsMalformedAndFailedHunks()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QVERIFY(WriteFile(dir.filePath("src/file"), "one\ntwo\n"));
+		QVERIFY(WriteFile(dir.filePath("truncated.patch"), "--- a/file\n+++ b/file\n@@ -1,2 +1,2 @@\n one\n"));
+		const auto truncated =
+			ApplyPatches(dir.filePath("src"), {PatchFile{dir.filePath("truncated.patch"), PatchOptions{}}});
+		QVERIFY(Failed(truncated));
+		QVERIFY(std::get<Error>(truncated).message.contains("malformed patch"));
+
+		QVERIFY(WriteFile(dir.filePath("stale.patch"),
+						  "--- a/file\n+++ b/file\n@@ -1,2 +1,2 @@\n one\n-three\n+four\n"));
+		const auto stale =
+			ApplyPatches(dir.filePath("src"), {PatchFile{dir.filePath("stale.patch"), PatchOptions{}}});
+		QVERIFY(Failed(stale));
+		QVERIFY(std::get<Error>(stale).message.contains("FAILED"));
+		QCOMPARE(ReadFile(dir.filePath("src/file")), QByteArray("one\ntwo\n"));
+	}
+
+	void extractRoundTripsLargeAndSmallMembers()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QByteArray large;
+		for (int i = 0; large.size() < (9 << 20); ++i)
+		{
+			large += QByteArray::number(i) + '\n';
+		}
+		QVERIFY(WriteTar(dir.filePath("src.tar"),
+						 {{TarEntry{.path = "tool-1.0/", .type = '5', .mode = 0750, .mtime = 1000}, QByteArray()},
+						  {TarEntry{.path = "tool-1.0/configure", .mode = 0755, .mtime = 2000}, "#!/bin/sh\n"},
+						  {TarEntry{.path = "tool-1.0/data.bin", .mtime = 3000}, large},
+						  {TarEntry{.path = "tool-1.0/copy", .type = '1', .linkTarget = "tool-1.0/configure"},
+						   QByteArray()}}));
+		const auto tar = ReadFile(dir.filePath("src.tar"));
+		QVERIFY(WriteZstd(dir.filePath("src.tar.zst"), tar, 1 << 20));
+
+		for (const auto &archive : {"src.tar", "src.tar.zst"})
+		{
+			const auto out = dir.filePath(QString("out-") + archive);
+			QDir().mkpath(out);
+			VERIFY_OK(ExtractArchive(dir.filePath(archive), out));
+			QCOMPARE(ReadFile(out + "/tool-1.0/data.bin"), large);
+			QCOMPARE(ReadFile(out + "/tool-1.0/copy"), QByteArray("#!/bin/sh\n"));
+			const QFileInfo configure(out + "/tool-1.0/configure");
+			QVERIFY(configure.isExecutable());
+			QCOMPARE(configure.lastModified().toSecsSinceEpoch(), 2000);
+			QCOMPARE(QFileInfo(out + "/tool-1.0/data.bin").lastModified().toSecsSinceEpoch(), 3000);
+			QCOMPARE(QFileInfo(out + "/tool-1.0").lastModified().toSecsSinceEpoch(), 1000);
+		}
+	}
+
+	void extractRefusesToLeaveDestination()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto outside = dir.filePath("outside");
+		QDir().mkpath(outside);
+		const auto out = dir.filePath("out");
+		QDir().mkpath(out);
+
+		for (const auto &path : {"../escaped", "/tmp/absolute", "a/../../escaped"})
+		{
+			QVERIFY(WriteTar(dir.filePath("bad.tar"), {{TarEntry{.path = path}, "x"}}));
+			const auto extracted = ExtractArchive(dir.filePath("bad.tar"), out);
+			QVERIFY2(Failed(extracted), path);
+		}
+		QVERIFY(!QFileInfo::exists(dir.filePath("escaped")));
+
+		// A member under a symlink the archive planted earlier must not be
+		// written through it.
+		QVERIFY(WriteTar(dir.filePath("planted.tar"),
+						 {{TarEntry{.path = "src/etc", .type = '2', .linkTarget = outside}, QByteArray()},
+						  {TarEntry{.path = "src/etc/passwd"}, "owned"}}));
+		QVERIFY(Failed(ExtractArchive(dir.filePath("planted.tar"), out)));
+		QVERIFY(!QFileInfo::exists(outside + "/passwd"));
+
+		// Nor under a symlink already in the destination.
+		QVERIFY(QFile::link(outside, out + "/existing"));
+		QVERIFY(WriteTar(dir.filePath("existing.tar"), {{TarEntry{.path = "existing/link", .type = '2',
+																	.linkTarget = "anything"},
+														  QByteArray()}}));
+		QVERIFY(Failed(ExtractArchive(dir.filePath("existing.tar"), out)));
+		QVERIFY(!QFileInfo(outside + "/link").isSymLink());
+	}
+
+	void extractCreatesSymlinksLast()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QVERIFY(WriteTar(dir.filePath("links.tar"),
+						 {{TarEntry{.path = "lib/libtool.so", .type = '2', .linkTarget = "libtool.so.1"}, QByteArray()},
+						  {TarEntry{.path = "lib/libtool.so.1"}, "elf"}}));
+		const auto out = dir.filePath("out");
+		QDir().mkpath(out);
+		VERIFY_OK(ExtractArchive(dir.filePath("links.tar"), out));
+		QVERIFY(QFileInfo(out + "/lib/libtool.so").isSymLink());
+		QCOMPARE(ReadFile(out + "/lib/libtool.so"), QByteArray("elf"));
+	}
+
+	// A frame header claiming a terabyte must fail, not allocate it.
+	void zstdFrameSizesAreBounded()
+	{
+		QByteArray frame;
+		frame += QByteArray::fromHex("28b52ffd");
+		frame += char(0xe0);
+		QByteArray size(8, Qt::Uninitialized);
+		qToLittleEndian<quint64>(quint64(1) << 40, size.data());
+		frame += size;
+		frame += QByteArray::fromHex("010000");
+		const auto data = reinterpret_cast<const uchar *>(frame.constData());
+		QVERIFY(Failed(DecodeZstdFrame(data, frame.size())));
+		QVERIFY(Failed(DecodeZstdFrame(data, frame.size(), 100)));
+
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto out = dir.filePath("out");
+		QDir().mkpath(out);
+		QVERIFY(WriteFile(dir.filePath("bomb.tar.zst"), frame));
+		QVERIFY(Failed(ExtractArchive(dir.filePath("bomb.tar.zst"), out)));
+		QVERIFY(WriteFile(dir.filePath("indexed.tar.zst"), frame + ZstdSeekTable({{quint32(frame.size()), 100}})));
+		QVERIFY(Failed(ExtractArchive(dir.filePath("indexed.tar.zst"), out)));
+
+		const auto small = QByteArray(1000, 's');
+		QVERIFY(WriteZstd(dir.filePath("small.zst"), small, 0));
+		const auto written = ReadFile(dir.filePath("small.zst"));
+		const auto decoded = DecodeZstdFrame(reinterpret_cast<const uchar *>(written.constData()), written.size(),
+											 0, 999);
+		QVERIFY(Failed(decoded));
+	}
+
+	void prepKeyCoversEveryInput()
+	{
+		const PrepInputs base{{"aa", "bb"}, {"cc"}, "cd tool-1.0"};
+		const auto key = PrepKey(base);
+		QCOMPARE(PrepKey(PrepInputs{{"AA", "BB"}, {"CC"}, "cd tool-1.0"}), key);
+		QVERIFY(PrepKey(PrepInputs{{"aa", "bd"}, {"cc"}, "cd tool-1.0"}) != key);
+		QVERIFY(PrepKey(PrepInputs{{"bb", "aa"}, {"cc"}, "cd tool-1.0"}) != key);
+		QVERIFY(PrepKey(PrepInputs{{"aa", "bb"}, {"cc", "dd"}, "cd tool-1.0"}) != key);
+		QVERIFY(PrepKey(PrepInputs{{"aa", "bb"}, {"cc"}, "cd tool-1.1"}) != key);
+		// A source moved to the patches is a different prep.
+		QVERIFY(PrepKey(PrepInputs{{"aa"}, {"bb", "cc"}, "cd tool-1.0"}) != key);
+	}
+
+	void prepSnapshotsRestoreTheTree()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto srcdir = dir.filePath("src");
+		QVERIFY(WriteFile(srcdir + "/tool-1.0/configure", "#!/bin/sh\n"));
+		QVERIFY(WriteFile(srcdir + "/tool-1.0/lib/data", "data"));
+		QVERIFY(::link(QFile::encodeName(srcdir + "/tool-1.0/lib/data").constData(),
+					   QFile::encodeName(srcdir + "/tool-1.0/lib/alias").constData()) == 0);
+		QVERIFY(QFile::link("lib/data", srcdir + "/tool-1.0/data"));
+		QFile configure(srcdir + "/tool-1.0/configure");
+		QVERIFY(configure.open(QIODevice::ReadWrite));
+		QVERIFY(configure.setFileTime(QDateTime::fromSecsSinceEpoch(1000), QFileDevice::FileModificationTime));
+		configure.close();
+
+		PrepSnapshots snapshots(dir.filePath("snapshots"));
+		const auto key = PrepKey(PrepInputs{{"aa"}, {}, "true"});
+		QVERIFY(!snapshots.Contains(key));
+		QVERIFY(Failed(snapshots.Restore(key, srcdir)));
+		VERIFY_OK(snapshots.Save(key, srcdir));
+		QVERIFY(snapshots.Contains(key));
+
+		QVERIFY(WriteFile(srcdir + "/tool-1.0/lib/data", "built"));
+		QVERIFY(WriteFile(srcdir + "/tool-1.0/config.status", "stale"));
+		VERIFY_OK(snapshots.Restore(key, srcdir));
+		QCOMPARE(ReadFile(srcdir + "/tool-1.0/lib/data"), QByteArray("data"));
+		QVERIFY(!QFileInfo::exists(srcdir + "/tool-1.0/config.status"));
+		QCOMPARE(QFileInfo(srcdir + "/tool-1.0/data").symLinkTarget(), srcdir + "/tool-1.0/lib/data");
+		QCOMPARE(QFileInfo(srcdir + "/tool-1.0/configure").lastModified().toSecsSinceEpoch(), 1000);
+		struct stat data, alias;
+		QVERIFY(::stat(QFile::encodeName(srcdir + "/tool-1.0/lib/data").constData(), &data) == 0);
+		QVERIFY(::stat(QFile::encodeName(srcdir + "/tool-1.0/lib/alias").constData(), &alias) == 0);
+		QCOMPARE(data.st_ino, alias.st_ino);
+
+		// The restored tree is a copy: building in it leaves the snapshot alone.
+		QVERIFY(WriteFile(srcdir + "/tool-1.0/lib/data", "built again"));
+		QCOMPARE(ReadFile(snapshots.Path(key) + "/tool-1.0/lib/data"), QByteArray("data"));
+	}
+
+	void prepSnapshotsPruneLeastRecentlyUsed()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QVERIFY(WriteFile(dir.filePath("src/file"), "file"));
+		PrepSnapshots snapshots(dir.filePath("snapshots"));
+		QList<QByteArray> keys;
+		for (int i = 0; i < 3; ++i)
+		{
+			keys << PrepKey(PrepInputs{{}, {}, QString::number(i)});
+			VERIFY_OK(snapshots.Save(keys.last(), dir.filePath("src")));
+			const struct timespec times[2] = {{1000 + i, 0}, {1000 + i, 0}};
+			QVERIFY(::utimensat(AT_FDCWD, QFile::encodeName(snapshots.Path(keys.last())).constData(), times, 0) ==
+					0);
+		}
+		// Restoring marks the oldest snapshot as used.
+		VERIFY_OK(snapshots.Restore(keys[0], dir.filePath("src")));
+		snapshots.Prune(2);
+		QVERIFY(snapshots.Contains(keys[0]));
+		QVERIFY(!snapshots.Contains(keys[1]));
+		QVERIFY(snapshots.Contains(keys[2]));
+	}
+
+	void buildKeyCoversEveryInput()
+	{
+		const BuildInputs base{"spec", {"aa"}, {{"glibc", "2.40-1"}}, "cc 14"};
+		const auto key = BuildKey(base);
+		QCOMPARE(BuildKey(BuildInputs{"spec", {"AA"}, {{"glibc", "2.40-1"}}, "cc 14"}), key);
+		QVERIFY(BuildKey(BuildInputs{"spec2", {"aa"}, {{"glibc", "2.40-1"}}, "cc 14"}) != key);
+		QVERIFY(BuildKey(BuildInputs{"spec", {"ab"}, {{"glibc", "2.40-1"}}, "cc 14"}) != key);
+		QVERIFY(BuildKey(BuildInputs{"spec", {"aa"}, {{"glibc", "2.40-2"}}, "cc 14"}) != key);
+		QVERIFY(BuildKey(BuildInputs{"spec", {"aa"}, {{"glibc", "2.40-1"}}, "cc 15"}) != key);
+	}
+
+	void buildCacheRoundTrips_data()
+	{
+		QTest::addColumn<bool>("http");
+		QTest::newRow("local") << false;
+		QTest::newRow("http") << true;
+	}
+
+	void buildCacheRoundTrips()
+	{
+		QFETCH(bool, http);
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		ObjectServer server;
+		QNetworkAccessManager network;
+		network.setProxy(QNetworkProxy::NoProxy);
+		auto backend = [&]() -> std::unique_ptr<BuildCacheBackend> {
+			if (http)
+			{
+				return std::make_unique<HttpCacheBackend>(network, server.Url());
+			}
+			return std::make_unique<LocalCacheBackend>(dir.filePath("cache"));
+		};
+		QVERIFY(WriteFile(dir.filePath("build/tool-1.0-1-x86_64.pkg.tar.zst"), "package"));
+		QVERIFY(WriteFile(dir.filePath("build/tool-debug-1.0-1-x86_64.pkg.tar.zst"), "debug"));
+
+		BuildCache cache(backend());
+		const auto missed = cache.Restore("k1", dir.filePath("out"));
+		VERIFY_OK(missed);
+		QVERIFY(!std::get<std::optional<QStringList>>(missed).has_value());
+		VERIFY_OK(cache.Save("k1", {dir.filePath("build/tool-1.0-1-x86_64.pkg.tar.zst"),
+									dir.filePath("build/tool-debug-1.0-1-x86_64.pkg.tar.zst")}));
+
+		const auto restored = BuildCache(backend()).Restore("k1", dir.filePath("out"));
+		VERIFY_OK(restored);
+		const auto packages = std::get<std::optional<QStringList>>(restored);
+		QVERIFY(packages.has_value());
+		QCOMPARE(*packages, QStringList({dir.filePath("out/tool-1.0-1-x86_64.pkg.tar.zst"),
+										 dir.filePath("out/tool-debug-1.0-1-x86_64.pkg.tar.zst")}));
+		QCOMPARE(ReadFile(packages->value(0)), QByteArray("package"));
+		QCOMPARE(ReadFile(packages->value(1)), QByteArray("debug"));
+		QCOMPARE(QDir(dir.filePath("out")).entryList(QDir::Files | QDir::Hidden).size(), 2);
+
+		// An object that no longer matches its manifest is not handed out.
+		if (http)
+		{
+			server.objects["/cache/k1/tool-1.0-1-x86_64.pkg.tar.zst"] = "tampered";
+		}
+		else
+		{
+			QVERIFY(WriteFile(dir.filePath("cache/k1/tool-1.0-1-x86_64.pkg.tar.zst"), "tampered"));
+		}
+		const auto tampered = BuildCache(backend()).Restore("k1", dir.filePath("out2"));
+		QVERIFY(Failed(tampered));
+		QVERIFY(std::get<Error>(tampered).message.contains("does not match"));
+	}
+
+	void buildCacheEntryWithoutManifestIsAMiss()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QVERIFY(WriteFile(dir.filePath("cache/k1/tool-1.0-1-x86_64.pkg.tar.zst"), "partial"));
+		BuildCache cache(std::make_unique<LocalCacheBackend>(dir.filePath("cache")));
+		const auto restored = cache.Restore("k1", dir.filePath("out"));
+		VERIFY_OK(restored);
+		QVERIFY(!std::get<std::optional<QStringList>>(restored).has_value());
+		QVERIFY(!QFileInfo::exists(dir.filePath("out/tool-1.0-1-x86_64.pkg.tar.zst")));
+	}
+
+	void specHashIgnoresCosmeticChanges()
+	{
+		const QByteArray spec = "%global ver 1.0\n"
+								"Name: tool\n"
+								"Version: %{ver}\n"
+								"Source0: https://example.org/%{name}-%{version}.tar.gz\n"
+								"\n"
+								"%description\n"
+								"A tool.\n"
+								"\n"
+								"%build\n"
+								"cd %{name}-%{version}\n"
+								"make\n"
+								"\n"
+								"%files\n"
+								"/usr/bin/tool\n"
+								"\n"
+								"%changelog\n"
+								"* Mon Jan 01 2024 Someone - 1.0-1\n"
+								"- Initial package\n";
+		auto hash = [](const QByteArray &contents) {
+			const auto parsed = ParseSpec(contents);
+			return Failed(parsed) ? std::get<Error>(parsed).message.toUtf8() : std::get<Spec>(parsed).semanticHash;
+		};
+		const auto base = hash(spec);
+		QCOMPARE(base.size(), 64);
+
+		const auto parsed = ParseSpec(spec);
+		VERIFY_OK(parsed);
+		const auto &sections = std::get<Spec>(parsed).sections;
+		QCOMPARE(sections.value(0).tags.value(2).value, QString("https://example.org/tool-1.0.tar.gz"));
+		QCOMPARE(sections.value(2).lines.value(0), QString("cd tool-1.0"));
+
+		auto edited = spec;
+		QCOMPARE(hash(edited.replace("- Initial package\n", "- Initial package\n- Rebuilt\n")), base);
+		edited = spec;
+		QCOMPARE(hash(edited.replace("A tool.\n", "A tool that does\nseveral things.\n")), base);
+		edited = spec;
+		QCOMPARE(hash(edited.replace("Name: tool\n", "# The upstream name.\nname:   tool\n\n")), base);
+		edited = spec;
+		QCOMPARE(hash(edited.replace("/usr/bin/tool\n", "  /usr/bin/tool\n# binaries\n")), base);
+		edited = spec;
+		QCOMPARE(hash(edited.replace("Version: %{ver}\n", "Version: 1.0\n")), base);
+
+		edited = spec;
+		QVERIFY(hash(edited.replace("make\n", "make V=1\n")) != base);
+		edited = spec;
+		QVERIFY(hash(edited.replace("make\n", "make\n# done\n")) != base);
+		edited = spec;
+		QVERIFY(hash(edited.replace("%global ver 1.0", "%global ver 1.1")) != base);
+		edited = spec;
+		QVERIFY(hash(edited.replace(".tar.gz", ".tar.xz")) != base);
+		edited = spec;
+		QVERIFY(hash(edited.replace("/usr/bin/tool\n", "/usr/bin/tool\n/usr/lib/tool\n")) != base);
+	}
+
+	void runScriptLogsAndKeepsTheTail()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		RunOptions options;
+		options.workingDirectory = dir.path();
+		options.logPath = dir.filePath("build.log");
+		options.tailBytes = 16;
+		QVERIFY(WriteFile(options.logPath, "earlier run\n"));
+		QVERIFY(WriteFile(dir.filePath("marker"), "in srcdir\n"));
+
+		const auto ran = RunScript("cat marker; seq 1 1000; echo oops >&2", options);
+		VERIFY_OK(ran);
+		const auto &result = std::get<RunResult>(ran);
+		QVERIFY(result.Succeeded());
+		QCOMPARE(result.tail, QByteArray("\n998\n999\n1000\noops\n").right(16));
+		const auto log = ReadFile(options.logPath);
+		QVERIFY(log.startsWith("earlier run\nin srcdir\n1\n2\n"));
+		QVERIFY(log.endsWith("1000\noops\n"));
+
+		// The tail never reaches back into an earlier run's output.
+		options.tailBytes = 1 << 10;
+		const auto failed = RunScript("echo before; false; echo after", options);
+		VERIFY_OK(failed);
+		QCOMPARE(std::get<RunResult>(failed).exitCode, 1);
+		QVERIFY(!std::get<RunResult>(failed).Succeeded());
+		QCOMPARE(std::get<RunResult>(failed).tail, QByteArray("before\n"));
+	}
+
+	void runScriptReportsSignalsAndEnvironment()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		RunOptions options;
+		options.logPath = dir.filePath("build.log");
+		const auto killed = RunScript("kill -TERM $$", options);
+		VERIFY_OK(killed);
+		QCOMPARE(std::get<RunResult>(killed).signal, SIGTERM);
+		QVERIFY(!std::get<RunResult>(killed).Succeeded());
+
+		options.environment = QStringList{"PATH=/usr/bin:/bin", "PHASE=build"};
+		QByteArray captured;
+		options.sink = [&captured](const char *data, qint64 size) {
+			captured.append(data, size);
+			return true;
+		};
+		const auto ran = RunScript("echo $PHASE; exit 3", options);
+		VERIFY_OK(ran);
+		QCOMPARE(std::get<RunResult>(ran).exitCode, 3);
+		QCOMPARE(captured, QByteArray("build\n"));
+		QCOMPARE(std::get<RunResult>(ran).tail, QByteArray("build\n"));
+
+		options.sink = nullptr;
+		options.logPath = dir.filePath("missing/build.log");
+		QVERIFY(Failed(RunScript("true", options)));
+	}
+
+	void buildLogKeepsTheTailInItsRing()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		BuildLog log(dir.path(), 1 << 20, 64 << 20, 16);
+		QVERIFY(log.BeginPhase("build"));
+		QVERIFY(log.Write("0123456789", 10));
+		QCOMPARE(log.Tail(4), QByteArray("6789"));
+		QVERIFY(log.Write("abcdefghij", 10));
+		QCOMPARE(log.Tail(100), QByteArray("456789abcdefghij"));
+		QVERIFY(log.Write("0123456789abcdefghijKLMNOP", 26));
+		QCOMPARE(log.Tail(16), QByteArray("abcdefghijKLMNOP"));
+		QCOMPARE(log.Tail(3), QByteArray("NOP"));
+
+		// Older bytes than the ring holds come back from disk.
+		const auto all = log.Read(0, 100);
+		VERIFY_OK(all);
+		QCOMPARE(std::get<QByteArray>(all), QByteArray("0123456789abcdefghij0123456789abcdefghijKLMNOP"));
+		QVERIFY(log.Finish());
+	}
+
+	void buildLogReadsPhasesAcrossSegments()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		BuildLog log(dir.path(), 2 << 20, 64 << 20, 1 << 10);
+		const auto prep = LogLines("prep", 5 << 19);
+		const auto build = LogLines("build", 5 << 19);
+		QVERIFY(log.BeginPhase("prep"));
+		QVERIFY(log.Write(prep.constData(), prep.size()));
+		QVERIFY(log.BeginPhase("build"));
+		QVERIFY(log.Write(build.constData(), build.size()));
+		QCOMPARE(log.Phases().size(), 2);
+		QCOMPARE(log.Phases()[1].offset, prep.size());
+
+		auto segmentFiles = [&dir] { return QDir(dir.path()).entryList({"*.log.zst"}, QDir::Files).size(); };
+		QCOMPARE(segmentFiles(), 3);
+		auto read = log.ReadPhase("prep");
+		VERIFY_OK(read);
+		QCOMPARE(std::get<QByteArray>(read), prep);
+		// Reading the segment being written does not end it.
+		read = log.ReadPhase("build");
+		VERIFY_OK(read);
+		QCOMPARE(std::get<QByteArray>(read), build);
+		QCOMPARE(segmentFiles(), 3);
+
+		const auto more = LogLines("more", 1 << 19);
+		QVERIFY(log.Write(more.constData(), more.size()));
+		QCOMPARE(segmentFiles(), 3);
+		read = log.ReadPhase("build");
+		VERIFY_OK(read);
+		QCOMPARE(std::get<QByteArray>(read), build + more);
+		QVERIFY(log.Finish());
+		read = log.Read(0, prep.size() + build.size() + more.size());
+		VERIFY_OK(read);
+		QCOMPARE(std::get<QByteArray>(read), prep + build + more);
+		QVERIFY(Failed(log.ReadPhase("check")));
+
+		const auto index = ReadFile(dir.filePath("index"));
+		QVERIFY(index.startsWith("phase 0 prep\nphase " + QByteArray::number(prep.size()) + " build\n"));
+		QCOMPARE(index.count("segment "), 3);
+	}
+
+	void buildLogBoundsItsStorage()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto data = LogLines("line", 1 << 20);
+		{
+			BuildLog log(dir.path(), 64 << 10, 1, 1 << 10);
+			QVERIFY(log.BeginPhase("build"));
+			QVERIFY(log.Write(data.constData(), data.size()));
+			QVERIFY(log.Finish());
+			QCOMPARE(QDir(dir.path()).entryList({"*.log.zst"}, QDir::Files).size(), 1);
+			const auto dropped = log.Read(0, 10);
+			QVERIFY(Failed(dropped));
+			QVERIFY(std::get<Error>(dropped).message.contains("discarded"));
+			const auto kept = log.Read(data.size() - (64 << 10), 64 << 10);
+			VERIFY_OK(kept);
+			QCOMPARE(std::get<QByteArray>(kept), data.right(64 << 10));
+		}
+
+		BuildLog unusable(dir.filePath("unusable"), 1 << 20, 64 << 20, 0);
+		QVERIFY(!unusable.BeginPhase("build"));
+		QVERIFY(!unusable.Write("x", 1));
+		QVERIFY(!unusable.ErrorString().isEmpty());
+		QCOMPARE(unusable.Tail(10), QByteArray());
+		QVERIFY(!QFileInfo::exists(dir.filePath("unusable")));
+	}
+
+	void runScriptAccountsItsUsage()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		RunOptions options;
+		options.logPath = dir.filePath("build.log");
+		// Not a cgroup directory, so only rusage is available.
+		options.cgroup = dir.filePath("no-cgroup");
+		const auto ran = RunScript("i=0; while [ $i -lt 20000 ]; do i=$((i + 1)); done; sleep 0.1", options);
+		VERIFY_OK(ran);
+		const auto &usage = std::get<RunResult>(ran).usage;
+		QVERIFY(usage.wallUs >= 100000);
+		QVERIFY(usage.userUs + usage.systemUs > 0);
+		QVERIFY(usage.maxRssBytes > 0);
+		QVERIFY(!usage.cgroup);
+	}
+
+	void resourceReportsRoundTrip()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		ResourceReport report{"tool", 1700000000, {}};
+		report.phases << PhaseUsage{"build", ResourceUsage{100, 60, 10, 4096, 512, 1024, true}};
+		report.phases << PhaseUsage{"package", ResourceUsage{50, 20, 5, 8192, 0, 2048, false}};
+		const auto total = report.Total();
+		QCOMPARE(total.wallUs, 150);
+		QCOMPARE(total.userUs, 80);
+		QCOMPARE(total.maxRssBytes, 8192);
+		QCOMPARE(total.writeBytes, 3072);
+
+		VERIFY_OK(report.Save(dir.filePath("usage.json")));
+		const auto saved = QJsonDocument::fromJson(ReadFile(dir.filePath("usage.json"))).object();
+		QCOMPARE(saved["total"].toObject()["wall_us"].toInteger(), 150);
+		const auto loaded = ResourceReport::FromJson(saved);
+		QCOMPARE(loaded.pkgbase, QString("tool"));
+		QCOMPARE(loaded.finished, 1700000000);
+		QCOMPARE(loaded.phases.size(), 2);
+		QCOMPARE(loaded.phases[0].phase, QString("build"));
+		QCOMPARE(loaded.phases[0].usage.readBytes, 512);
+		QVERIFY(loaded.phases[0].usage.cgroup);
+		QVERIFY(!loaded.phases[1].usage.cgroup);
+
+		BuildHistory history(dir.filePath("history/history.jsonl"));
+		QVERIFY(!history.Estimate("tool").has_value());
+		VERIFY_OK(history.Record(report));
+		report.phases[0].usage.wallUs = 300;
+		VERIFY_OK(history.Record(report));
+		VERIFY_OK(history.Record(ResourceReport{"other", 0, {}}));
+		QCOMPARE(history.Reports("tool").size(), 2);
+		const auto estimate = history.Estimate("tool");
+		QVERIFY(estimate.has_value());
+		QCOMPARE(estimate->wallUs, 250);
+		QCOMPARE(estimate->maxRssBytes, 8192);
+		QCOMPARE(history.Estimate("tool", 1)->wallUs, 350);
+	}
+
+	void daemonServesRequests()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		// The daemon's checksum cache goes under the test directory.
+		const auto cacheHome = qgetenv("XDG_CACHE_HOME");
+		qputenv("XDG_CACHE_HOME", QFile::encodeName(dir.filePath("cache")));
+		Daemon daemon;
+		qputenv("XDG_CACHE_HOME", cacheHome);
+		if (cacheHome.isEmpty())
+		{
+			qunsetenv("XDG_CACHE_HOME");
+		}
+		VERIFY_OK(daemon.Listen(dir.filePath("daemon.sock")));
+
+		const QByteArray spec = "%global ver 1.0\nName: tool\nVersion: %{ver}\n\n%build\nmake %{name}\n";
+		QVERIFY(WriteFile(dir.filePath("tool.spec"), spec));
+		QVERIFY(WriteFile(dir.filePath("tool-1.0.tar.gz"), "source"));
+		QLocalSocket socket;
+		socket.connectToServer(dir.filePath("daemon.sock"));
+		QVERIFY(socket.waitForConnected(5000));
+
+		Send(socket, {{"id", 1}, {"method", "parse"}, {"params", QJsonObject{{"contents", QString::fromUtf8(spec)}}}});
+		Send(socket, {{"id", 2},
+					  {"method", "query"},
+					  {"params", QJsonObject{{"path", dir.filePath("tool.spec")}, {"tag", "version"}}}});
+		Send(socket, {{"id", 3},
+					  {"method", "query"},
+					  {"params", QJsonObject{{"path", dir.filePath("tool.spec")}, {"section", "build"}}}});
+		Send(socket, {{"id", 4}, {"method", "frobnicate"}});
+		Send(socket, {{"id", 5}, {"method", "cancel"}, {"params", QJsonObject{{"id", 99}}}});
+		socket.write("not json\n");
+		auto replies = Replies(socket, 6);
+		QCOMPARE(replies.size(), 6);
+
+		const auto parsed = replies[1]["result"].toObject();
+		QCOMPARE(parsed["hash"].toString().size(), 64);
+		QCOMPARE(parsed["macros"].toObject()["ver"].toString(), QString("1.0"));
+		QCOMPARE(parsed["sections"].toArray().first().toObject().value("name").toString(), QString("build"));
+		QCOMPARE(replies[2]["result"].toObject().value("values"), QJsonValue(QJsonArray{"1.0"}));
+		QCOMPARE(replies[3]["result"].toObject().value("values"), QJsonValue(QJsonArray{QJsonArray{"make tool"}}));
+		QVERIFY(replies[4]["error"].toString().contains("unknown method"));
+		QCOMPARE(replies[5]["result"].toObject().value("cancelled").toBool(true), false);
+		QVERIFY(replies.contains(-1));
+
+		// A build is a cache miss until its packages are stored under its key.
+		const QJsonObject build{
+			{"method", "build"},
+			{"params", QJsonObject{{"path", dir.filePath("tool.spec")},
+								   {"sources", QJsonArray{dir.filePath("tool-1.0.tar.gz")}},
+								   {"dependencies", QJsonObject{{"glibc", "2.40-1"}}},
+								   {"cache", dir.filePath("builds")},
+								   {"outdir", dir.filePath("out")}}},
+		};
+		auto request = build;
+		request["id"] = 6;
+		Send(socket, request);
+		replies = Replies(socket, 1);
+		const auto missed = replies[6]["result"].toObject();
+		QVERIFY2(!missed.isEmpty(), qPrintable(replies[6]["error"].toString()));
+		QCOMPARE(missed["cached"].toBool(), false);
+		QVERIFY(WriteFile(dir.filePath("pkg/tool-1.0-1-x86_64.pkg.tar.zst"), "package"));
+		VERIFY_OK(BuildCache(std::make_unique<LocalCacheBackend>(dir.filePath("builds")))
+					  .Save(missed["key"].toString().toLatin1(), {dir.filePath("pkg/tool-1.0-1-x86_64.pkg.tar.zst")}));
+
+		request["id"] = 7;
+		Send(socket, request);
+		replies = Replies(socket, 1);
+		const auto hit = replies[7]["result"].toObject();
+		QCOMPARE(hit["key"], missed["key"]);
+		QCOMPARE(hit["cached"].toBool(), true);
+		QCOMPARE(hit["packages"], QJsonValue(QJsonArray{dir.filePath("out/tool-1.0-1-x86_64.pkg.tar.zst")}));
+		QCOMPARE(ReadFile(dir.filePath("out/tool-1.0-1-x86_64.pkg.tar.zst")), QByteArray("package"));
+	}
+
+	void schedulerRunsInteractiveRequestsFirst()
+	{
+		QMutex mutex;
+		QStringList order;
+		QSemaphore gate;
+		QSemaphore done;
+		RequestScheduler scheduler(1);
+		auto job = [&](const QString &name, bool blocks) {
+			return [&, name, blocks] {
+				if (blocks)
+				{
+					gate.acquire();
+				}
+				QMutexLocker lock(&mutex);
+				order << name;
+				done.release();
+			};
+		};
+		// One client may run one request at a time, so the rest queue up
+		// behind the first and start in priority order.
+		scheduler.Submit(1, RequestPriority::Batch, job("reindex", true));
+		scheduler.Submit(1, RequestPriority::Batch, job("batch", false));
+		scheduler.Submit(1, RequestPriority::Interactive, job("lint", false));
+		const auto early = done.tryAcquire(1, 50);
+		gate.release();
+		QVERIFY(!early);
+		QVERIFY(done.tryAcquire(3, 10000));
+		QCOMPARE(order, QStringList({"reindex", "lint", "batch"}));
+	}
+
+	void schedulerKeepsAThreadForInteractiveRequests()
+	{
+		QSemaphore gate;
+		QSemaphore done;
+		QSemaphore interactive;
+		RequestScheduler scheduler(1);
+		const auto threads = qMax(2, QThread::idealThreadCount());
+		// More batch requests than threads, each from its own client.
+		for (int i = 0; i < threads + 1; ++i)
+		{
+			scheduler.Submit(100 + i, RequestPriority::Batch, [&] {
+				gate.acquire();
+				done.release();
+			});
+		}
+		scheduler.Submit(1, RequestPriority::Interactive, [&] { interactive.release(); });
+		const auto ran = interactive.tryAcquire(1, 10000);
+		gate.release(threads + 1);
+		QVERIFY(ran);
+		QVERIFY(done.tryAcquire(threads + 1, 10000));
+	}
+
+	void parsesStopWhenCancelled()
+	{
+		std::atomic_bool cancel{true};
+		const auto parsed = ParseSpec("Name: tool\n\n%build\nmake\n", &cancel);
+		QVERIFY(Failed(parsed));
+		QCOMPARE(std::get<Error>(parsed).message, QString("cancelled"));
+		cancel = false;
+		VERIFY_OK(ParseSpec("Name: tool\n\n%build\nmake\n", &cancel));
+	}
+
+	void specWatcherFollowsChanges()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto root = QFileInfo(dir.filePath("specs")).absoluteFilePath();
+		QVERIFY(WriteFile(root + "/tool/tool.spec", "Name: tool\n"));
+		QVERIFY(WriteFile(root + "/app/app.spec", "Name: app\nBuildRequires: tool >= 1.0\n"));
+		QVERIFY(WriteFile(root + "/lib/lib.spec", "Name: lib\n"));
+
+		SpecIndex specs;
+		QList<QJsonObject> events;
+		SpecWatcher watcher(specs, [&events](const QJsonObject &event) { events << event; }, 10);
+		VERIFY_OK(watcher.Watch(root));
+		QVERIFY(watcher.Graph().Contains(root + "/app/app.spec"));
+		auto seen = [&events](const QString &event, const QString &path) {
+			return std::any_of(events.cbegin(), events.cend(), [&](const QJsonObject &json) {
+				return json["event"].toString() == event && json["path"].toString() == path;
+			});
+		};
+
+		QVERIFY(WriteFile(root + "/tool/tool.spec", "Name: tool\nVersion: 2\n"));
+		QTRY_VERIFY(seen("changed", root + "/tool/tool.spec"));
+		const auto changed = *std::find_if(events.cbegin(), events.cend(), [](const QJsonObject &json) {
+			return json["event"].toString() == "changed";
+		});
+		QCOMPARE(changed["dependents"], QJsonValue(QJsonArray{root + "/app/app.spec"}));
+
+		// A directory deleted or moved out of the tree takes its specs along.
+		QVERIFY(QDir(root + "/app").removeRecursively());
+		QTRY_VERIFY(seen("removed", root + "/app/app.spec"));
+		QVERIFY(!watcher.Graph().Contains(root + "/app/app.spec"));
+		QVERIFY(QDir().rename(root + "/lib", dir.filePath("lib")));
+		QTRY_VERIFY(seen("removed", root + "/lib/lib.spec"));
+		QVERIFY(!watcher.Graph().Contains(root + "/lib/lib.spec"));
+
+		// Moved back in, it is watched again.
+		QVERIFY(QDir().rename(dir.filePath("lib"), root + "/lib"));
+		QTRY_VERIFY(seen("changed", root + "/lib/lib.spec"));
+		events.clear();
+		QVERIFY(WriteFile(root + "/lib/lib.spec", "Name: lib\nVersion: 2\n"));
+		QTRY_VERIFY(seen("changed", root + "/lib/lib.spec"));
+	}
+
+	void specWatcherRescansAfterOverflow()
+	{
+		QFile limit("/proc/sys/fs/inotify/max_queued_events");
+		const auto queued = limit.open(QIODevice::ReadOnly) ? limit.readAll().trimmed().toInt() : 0;
+		if (queued <= 0 || queued > (1 << 17))
+		{
+			QSKIP("the inotify queue size is unknown or too large to overflow here");
+		}
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto root = QFileInfo(dir.path()).absoluteFilePath();
+		QVERIFY(WriteFile(root + "/tool/tool.spec", "Name: tool\n"));
+		QVERIFY(WriteFile(root + "/noise/.keep", ""));
+
+		SpecIndex specs;
+		QList<QJsonObject> events;
+		SpecWatcher watcher(specs, [&events](const QJsonObject &event) { events << event; }, 10);
+		VERIFY_OK(watcher.Watch(root));
+		auto seen = [&events](const QString &event, const QString &path) {
+			return std::any_of(events.cbegin(), events.cend(), [&](const QJsonObject &json) {
+				return json["event"].toString() == event && json["path"].toString() == path;
+			});
+		};
+
+		// Nothing reads the queue until the test waits, so it overflows and
+		// what follows is only found by the rescan.
+		for (int i = 0; i < queued / 2 + 16; ++i)
+		{
+			QVERIFY(WriteFile(root + "/noise/" + QString::number(i), ""));
+		}
+		QVERIFY(QFile::remove(root + "/tool/tool.spec"));
+		QVERIFY(WriteFile(root + "/app/app.spec", "Name: app\n"));
+		QTRY_VERIFY_WITH_TIMEOUT(seen("removed", root + "/tool/tool.spec"), 20000);
+		QTRY_VERIFY(seen("changed", root + "/app/app.spec"));
+		QVERIFY(!watcher.Graph().Contains(root + "/tool/tool.spec"));
+
+		events.clear();
+		QVERIFY(WriteFile(root + "/app/app.spec", "Name: app\nVersion: 2\n"));
+		QTRY_VERIFY(seen("changed", root + "/app/app.spec"));
+	}
+
+	void editsKeepMemoOutsideTheEdit()
+	{
+		const QByteArray spec = "Name: tool\n\n%build\nmake\n\n%install\nmake install\n";
+		Context ctx{};
+		ctx.Buf.setData(spec);
+		ctx.Buf.open(QIODevice::ReadOnly);
+		QVERIFY(std::holds_alternative<QList<RawSpecSection>>((*RawSpecParser)(ctx)));
+		const auto build = spec.indexOf("%build");
+		const auto install = spec.indexOf("%install");
+		// Whether a section parsed at the offset is in the memo table.
+		auto memoized = [&ctx](qint64 at) {
+			for (auto it = ctx.Memo.cbegin(); it != ctx.Memo.cend(); ++it)
+			{
+				if (it.key().second == at && it->Value.type() == typeid(Result<RawSpecSection>))
+				{
+					return true;
+				}
+			}
+			return false;
+		};
+		QVERIFY(memoized(0));
+		QVERIFY(memoized(build));
+		QVERIFY(memoized(install));
+
+		const QByteArray inserted = "make check\n";
+		ctx.ApplyEdit(spec.indexOf("make\n") + 5, 0, inserted);
+		QVERIFY(memoized(0));
+		QVERIFY(!memoized(build));
+		QVERIFY(!memoized(install));
+		QVERIFY(memoized(install + inserted.size()));
+
+		const auto parsed = (*RawSpecParser)(ctx);
+		QVERIFY(std::holds_alternative<QList<RawSpecSection>>(parsed));
+		const auto &sections = std::get<QList<RawSpecSection>>(parsed);
+		QCOMPARE(sections.size(), 3);
+		QCOMPARE(sections[1].lines.size(), 3);
+		QCOMPARE(std::get<QString>(sections[1].lines[1]), QString("make check"));
+	}
+
+	void incrementalSpecMatchesFullParse()
+	{
+		QByteArray contents = "%global prefix /usr\n"
+							  "Name: tool\n"
+							  "\n"
+							  "%build\n"
+							  "make\n"
+							  "\n"
+							  "%install\n"
+							  "make install PREFIX=%{prefix}\n";
+		IncrementalSpec incremental(contents);
+		VERIFY_OK(incremental.Parse());
+		auto edit = [&](const QByteArray &before, const QByteArray &after) {
+			const auto offset = contents.indexOf(before);
+			contents.replace(offset, before.size(), after);
+			const auto edited = incremental.Edit(offset, before.size(), after);
+			const auto full = ParseSpec(contents);
+			if (Failed(edited) || Failed(full))
+			{
+				return Failed(edited) == Failed(full);
+			}
+			const auto &a = std::get<Spec>(edited);
+			const auto &b = std::get<Spec>(full);
+			auto same = a.semanticHash == b.semanticHash && a.macros == b.macros &&
+						a.sections.size() == b.sections.size();
+			for (qsizetype i = 0; same && i < a.sections.size(); ++i)
+			{
+				same = a.sections[i].name == b.sections[i].name && a.sections[i].lines == b.sections[i].lines;
+			}
+			return same && incremental.Contents() == contents;
+		};
+
+		QVERIFY(edit("make\n", "make -j1\n"));
+		// A macro edited above a section that is otherwise unchanged.
+		QVERIFY(edit("/usr\n", "/opt\n"));
+		QVERIFY(edit("\n%install\n", "\n%check\nmake test\n\n%install\n"));
+		QVERIFY(edit("%check\n", ""));
+		QVERIFY(edit("PREFIX=%{prefix}\n", "PREFIX=%{prefix}\n\n%files\n/opt/bin/tool\n"));
+		QVERIFY(Failed(incremental.Edit(contents.size(), 1, "x")));
+		QCOMPARE(incremental.Contents(), contents);
+	}
+
+	void sharedSpecCacheRoundTrips()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const QByteArray contents = "%global ver 1.0\nName: tool\nVersion: %{ver}\n\n%build\nmake\n";
+		const auto parsed = ParseSpec(contents);
+		VERIFY_OK(parsed);
+		const auto &spec = std::get<Spec>(parsed);
+		const auto key = SharedSpecCache::Key(contents);
+		QCOMPARE(key.size(), 32);
+		QVERIFY(SharedSpecCache::Key(contents + "\n") != key);
+
+		SharedSpecCache writer(dir.filePath("ast"));
+		QVERIFY(!writer.Get(key).has_value());
+		VERIFY_OK(writer.Put(key, spec));
+		// Another process maps the same file.
+		SharedSpecCache reader(dir.filePath("ast"));
+		const auto hit = reader.Get(key);
+		QVERIFY(hit.has_value());
+		QCOMPARE(hit->semanticHash, spec.semanticHash);
+		QCOMPARE(hit->macros, spec.macros);
+		QCOMPARE(hit->sections.size(), spec.sections.size());
+		QCOMPARE(hit->sections[1].lines, spec.sections[1].lines);
+		QCOMPARE(hit->sections[0].tags[1].value, QString("1.0"));
+		QVERIFY(!(QFileInfo(dir.filePath("ast")).permissions() & (QFileDevice::ReadGroup | QFileDevice::ReadOther)));
+	}
+
+	void sharedSpecCacheCompactsWhenFull()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		SharedSpecCache writer(dir.filePath("ast"), 64 << 10, 64);
+		SharedSpecCache reader(dir.filePath("ast"), 64 << 10, 64);
+		QVERIFY(!reader.Get(SharedSpecCache::Key(QByteArray())).has_value());
+		QList<QByteArray> keys;
+		for (int i = 0; i < 100; ++i)
+		{
+			const auto contents = "Name: tool" + QByteArray::number(i) + "\n";
+			keys << SharedSpecCache::Key(contents);
+			const auto parsed = ParseSpec(contents);
+			VERIFY_OK(parsed);
+			VERIFY_OK(writer.Put(keys.last(), std::get<Spec>(parsed)));
+			QVERIFY(writer.Get(keys.last()).has_value());
+		}
+		// The reader's mapping was retired by the compaction; it reopens.
+		const auto hit = reader.Get(keys.last());
+		QVERIFY(hit.has_value());
+		QCOMPARE(hit->sections[0].tags[0].value, QString("tool99"));
+		QCOMPARE(QDir(dir.path()).entryList(QDir::Files).size(), 1);
+		// Only the most recently used records survive a compaction.
+		const auto kept = std::count_if(keys.cbegin(), keys.cend(),
+										[&writer](const QByteArray &key) { return writer.Get(key).has_value(); });
+		QVERIFY(kept < keys.size());
+	}
+
+	void sharedSpecCacheRefusesForeignFiles()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto key = SharedSpecCache::Key("Name: tool\n");
+		const auto parsed = ParseSpec("Name: tool\n");
+		VERIFY_OK(parsed);
+
+		// Planted by someone else: writable by the group, or a symlink.
+		QVERIFY(WriteFile(dir.filePath("shared"), QByteArray()));
+		QVERIFY(::chmod(QFile::encodeName(dir.filePath("shared")).constData(), 0660) == 0);
+		SharedSpecCache shared(dir.filePath("shared"));
+		QVERIFY(Failed(shared.Put(key, std::get<Spec>(parsed))));
+		QVERIFY(!shared.Get(key).has_value());
+		QCOMPARE(QFileInfo(dir.filePath("shared")).size(), 0);
+
+		QVERIFY(QFile::link(dir.filePath("target"), dir.filePath("link")));
+		SharedSpecCache linked(dir.filePath("link"));
+		QVERIFY(Failed(linked.Put(key, std::get<Spec>(parsed))));
+		QVERIFY(!QFileInfo::exists(dir.filePath("target")));
+	}
+
+	void pkgInfoRoundTrip()
+	{
+		PkgInfo info;
+		info.pkgname = "tool";
+		info.pkgbase = "tool-base";
+		info.pkgver = "1.2-3";
+		info.pkgdesc = "A tool = with an equals sign";
+		info.url = "https://example.org/tool";
+		info.packager = "Someone <someone@example.org>";
+		info.arch = "x86_64";
+		info.builddate = 1700000000;
+		info.size = 123456;
+		info.license = {"MIT", "GPL-2.0-or-later"};
+		info.groups = {"tools"};
+		info.replaces = {"oldtool"};
+		info.depends = {"glibc", "zstd>=1.5"};
+		info.optdepends = {"bash: for the completion"};
+		info.makedepends = {"cmake"};
+		info.checkdepends = {"python"};
+		info.conflicts = {"othertool"};
+		info.provides = {"libtool.so=1-64"};
+		info.backup = {"etc/tool.conf"};
+		QCOMPARE(ParsePkgInfo(SerializePkgInfo(info)), info);
+		QCOMPARE(ParsePkgInfo(SerializePkgInfo(PkgInfo{})), PkgInfo{});
+	}
+
+	void repoDatabaseAppliesBatches()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		const auto package = [&dir](const QString &pkgname, const QString &pkgver) {
+			PkgInfo info;
+			info.pkgname = pkgname;
+			info.pkgver = pkgver;
+			info.arch = "x86_64";
+			const auto path = dir.filePath(QString("pkgs/%1-%2-x86_64.pkg.tar").arg(pkgname, pkgver));
+			return WriteTar(path, {{TarEntry{.path = ".PKGINFO"}, SerializePkgInfo(info)},
+								   {TarEntry{.path = "usr/bin/" + pkgname}, pkgver.toUtf8()}})
+					   ? path
+					   : QString();
+		};
+		const auto a1 = package("tool", "1.0-1");
+		const auto a2 = package("tool", "1.1-1");
+		const auto b = package("tool-extra", "2.0-1");
+		QVERIFY(!a1.isEmpty() && !a2.isEmpty() && !b.isEmpty());
+
+		RepoDatabase database(dir.filePath("test.db.tar.zst"));
+		VERIFY_OK(database.Open());
+		VERIFY_OK(database.Apply({a1, b}, {}));
+		auto packages = database.Packages();
+		packages.sort();
+		QCOMPARE(packages, QStringList({"tool", "tool-extra"}));
+		QCOMPARE(QFileInfo(QFileInfo(dir.filePath("test.db")).symLinkTarget()).fileName(), QString("test.db.tar.zst"));
+		QCOMPARE(MemberPaths(dir.filePath("test.db")),
+				 QStringList({"tool-1.0-1/", "tool-1.0-1/desc", "tool-extra-2.0-1/", "tool-extra-2.0-1/desc"}));
+		QVERIFY(MemberPaths(dir.filePath("test.files")).contains("tool-extra-2.0-1/files"));
+
+		// A replacement drops the old version; unknown names fail once the
+		// rest is written.
+		const auto applied = database.Apply({a2}, {"tool-extra", "missing"});
+		QVERIFY(Failed(applied));
+		QVERIFY(std::get<Error>(applied).message.contains("'missing'"));
+		QCOMPARE(MemberPaths(dir.filePath("test.db")), QStringList({"tool-1.1-1/", "tool-1.1-1/desc"}));
+
+		// Reopened through name.db it keeps the working copy, and without it
+		// imports the archives again.
+		RepoDatabase reopened(dir.filePath("test.db"));
+		VERIFY_OK(reopened.Open());
+		QCOMPARE(reopened.Packages(), QStringList({"tool"}));
+		QVERIFY(QDir(dir.filePath(".test.db.d")).removeRecursively());
+		RepoDatabase imported(dir.filePath("test.db"));
+		VERIFY_OK(imported.Open());
+		QCOMPARE(imported.Packages(), QStringList({"tool"}));
+		QVERIFY(ReadFile(dir.filePath(".test.db.d/tool-1.1-1/files")).contains("usr/bin/tool"));
+	}
+
+	void repoDatabaseKeepsTheArchiveFormat()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		PkgInfo info;
+		info.pkgname = "tool";
+		info.pkgver = "1.0-1";
+		const auto desc = RepoDesc(info, "tool-1.0-1-x86_64.pkg.tar.zst", 1, "00");
+		QVERIFY(WriteTar(dir.filePath("db.tar"), {{TarEntry{.path = "tool-1.0-1/", .type = '5'}, QByteArray()},
+												  {TarEntry{.path = "tool-1.0-1/desc"}, desc}}));
+
+		// repo-add's gzip database is read through the name.db link, but not
+		// rewritten in another format.
+		VERIFY_OK(GzipFile(dir.filePath("db.tar"), dir.filePath("gz.db.tar.gz")));
+		QVERIFY(QFile::link("gz.db.tar.gz", dir.filePath("gz.db")));
+		RepoDatabase gzip(dir.filePath("gz.db"));
+		VERIFY_OK(gzip.Open());
+		QCOMPARE(gzip.Packages(), QStringList({"tool"}));
+		QVERIFY(Failed(gzip.Apply({}, {"tool"})));
+		QVERIFY(QFileInfo::exists(dir.filePath("gz.db.tar.gz")));
+		QVERIFY(!QFileInfo::exists(dir.filePath("gz.db.tar.zst")));
+		QVERIFY(Failed(RepoDatabase(dir.filePath("gz.db.tar.zst")).Open()));
+
+		// A database without its files archive has no file lists to carry
+		// over, and the entries added next to it do.
+		QVERIFY(WriteZstd(dir.filePath("zst.db.tar.zst"), ReadFile(dir.filePath("db.tar")), 1 << 20));
+		info.pkgname = "other";
+		const auto package = dir.filePath("other-1.0-1-x86_64.pkg.tar");
+		QVERIFY(WriteTar(package, {{TarEntry{.path = ".PKGINFO"}, SerializePkgInfo(info)},
+								   {TarEntry{.path = "usr/bin/other"}, "other"}}));
+		RepoDatabase zstd(dir.filePath("zst.db.tar.zst"));
+		VERIFY_OK(zstd.Open());
+		VERIFY_OK(zstd.Apply({package}, {}));
+		QCOMPARE(MemberPaths(dir.filePath("zst.files")), QStringList({"other-1.0-1/", "other-1.0-1/desc",
+																	   "other-1.0-1/files", "tool-1.0-1/",
+																	   "tool-1.0-1/desc"}));
+	}
+
+	void seekTableRoundTrip()
+	{
+		const QList<ZstdSeekEntry> frames{{100, 1 << 20}, {7, 0}, {65536, 12345}};
+		auto data = QByteArray(100 + 7 + 65536, 'x') + ZstdSeekTable(frames);
+		const auto read = ReadZstdSeekTable(Bytes(data), data.size());
+		QVERIFY(read);
+		QCOMPARE(read->size(), frames.size());
+		for (qsizetype i = 0; i < frames.size(); ++i)
+		{
+			QCOMPARE((*read)[i].compressedSize, frames[i].compressedSize);
+			QCOMPARE((*read)[i].decompressedSize, frames[i].decompressedSize);
+		}
+	}
+
+	void seekTableRejectsBadInput()
+	{
+		const auto table = ZstdSeekTable({{10, 20}});
+		const auto valid = QByteArray(10, 'x') + table;
+		QVERIFY(ReadZstdSeekTable(Bytes(valid), valid.size()));
+
+		// Frames that do not add up to what precedes the table.
+		const auto short_ = QByteArray(9, 'x') + table;
+		QVERIFY(!ReadZstdSeekTable(Bytes(short_), short_.size()));
+		// Truncated footer.
+		QVERIFY(!ReadZstdSeekTable(Bytes(valid), valid.size() - 1));
+		QVERIFY(!ReadZstdSeekTable(Bytes(valid), 16));
+		// A count larger than the file.
+		auto count = valid;
+		qToLittleEndian<quint32>(1000, count.data() + count.size() - 9);
+		QVERIFY(!ReadZstdSeekTable(Bytes(count), count.size()));
+		// Reserved descriptor bits.
+		auto descriptor = valid;
+		descriptor[descriptor.size() - 5] = 0x04;
+		QVERIFY(!ReadZstdSeekTable(Bytes(descriptor), descriptor.size()));
+		// Wrong skippable frame magic.
+		auto magic = valid;
+		magic[10] = 0;
+		QVERIFY(!ReadZstdSeekTable(Bytes(magic), magic.size()));
+		const QByteArray garbage(64, '\xb1');
+		QVERIFY(!ReadZstdSeekTable(Bytes(garbage), garbage.size()));
+	}
+
+	// Packages written in frames stay one zstd stream to any other decoder,
+	// and each frame decodes on its own at the offset the table gives.
+	void seekableZstdDecodesEitherWay()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QByteArray data;
+		for (int i = 0; i < 50000; ++i)
+		{
+			data += QByteArray::number(i) + '\n';
+		}
+		QVERIFY(WriteZstd(dir.filePath("data.zst"), data, 64 << 10));
+		const auto written = ReadFile(dir.filePath("data.zst"));
+
+		QByteArray whole(data.size(), Qt::Uninitialized);
+		const auto size = ZSTD_decompress(whole.data(), whole.size(), written.constData(), written.size());
+		QVERIFY(!ZSTD_isError(size));
+		QCOMPARE(whole.left(qsizetype(size)), data);
+
+		const auto frames = ReadZstdSeekTable(Bytes(written), written.size());
+		QVERIFY(frames);
+		QCOMPARE(frames->size(), (data.size() + (64 << 10) - 1) / (64 << 10));
+		qsizetype in = 0;
+		qsizetype out = 0;
+		for (const auto &frame : *frames)
+		{
+			const auto decoded = DecodeZstdFrame(Bytes(written) + in, frame.compressedSize);
+			VERIFY_OK(decoded);
+			QCOMPARE(std::get<QByteArray>(decoded), data.mid(out, frame.decompressedSize));
+			in += frame.compressedSize;
+			out += frame.decompressedSize;
+		}
+		QCOMPARE(out, data.size());
+	}
+
+	void tarRoundTrip()
+	{
+		const QList<TarEntry> entries{
+			{.path = "usr/bin/tool", .mode = 0755, .mtime = 1700000000},
+			{.path = "usr/share/" + QString(200, 'n'), .mtime = 1},
+			{.path = "usr/lib/libtool.so", .type = '2', .mode = 0777, .linkTarget = "libtool.so.1"},
+		};
+		const QList<QByteArray> contents{QByteArray(1000, 'a'), QByteArray("short"), QByteArray()};
+		QByteArray archive;
+		TarWriter writer([&archive](const char *data, qint64 size) {
+			archive.append(data, size);
+			return true;
+		});
+		for (qsizetype i = 0; i < entries.size(); ++i)
+		{
+			QVERIFY(writer.WriteEntry(entries[i], contents[i]));
+		}
+		QVERIFY(writer.Finish());
+		QCOMPARE(archive.size() % 512, 0);
+
+		auto done = false;
+		TarReader reader([&]() -> Fallible<QByteArray> {
+			if (done)
+			{
+				return QByteArray();
+			}
+			done = true;
+			return archive;
+		});
+		for (qsizetype i = 0; i < entries.size(); ++i)
+		{
+			const auto next = reader.Next();
+			QVERIFY(!Failed(next));
+			const auto &entry = std::get<std::optional<TarEntry>>(next);
+			QVERIFY(entry);
+			QCOMPARE(entry->path, entries[i].path);
+			QCOMPARE(entry->type, entries[i].type);
+			QCOMPARE(entry->mode, entries[i].mode);
+			QCOMPARE(entry->mtime, entries[i].mtime);
+			QCOMPARE(entry->linkTarget, entries[i].linkTarget);
+			QCOMPARE(entry->size, contents[i].size());
+			const auto data = reader.ReadData(entry->size);
+			QVERIFY(!Failed(data));
+			QCOMPARE(std::get<QByteArray>(data), contents[i]);
+		}
+		const auto end = reader.Next();
+		QVERIFY(!Failed(end));
+		QVERIFY(!std::get<std::optional<TarEntry>>(end));
+	}
+
+	// .PKGINFO comes out of the first frame without touching the rest, so
+	// garbage after it goes unnoticed until the members behind it are read.
+	void packageInfoReadsOnlyTheFirstFrame()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		PkgInfo info;
+		info.pkgname = "tool";
+		info.pkgver = "1.0-1";
+		QVERIFY(WriteTar(dir.filePath("tool.tar"), {{TarEntry{.path = ".PKGINFO"}, SerializePkgInfo(info)},
+													{TarEntry{.path = "usr/bin/tool"}, QByteArray(1 << 20, 't')}}));
+		const auto package = dir.filePath("tool-1.0-1-x86_64.pkg.tar.zst");
+		QVERIFY(WriteZstd(package, ReadFile(dir.filePath("tool.tar")), 4096));
+		const auto written = ReadFile(package);
+		const auto frames = ReadZstdSeekTable(Bytes(written), written.size());
+		QVERIFY(frames && frames->size() > 2);
+		const auto first = qsizetype(frames->first().compressedSize);
+		QVERIFY(WriteFile(package, written.left(first) + QByteArray(written.size() - first, '\xb1')));
+
+		const auto read = ReadPackageInfo(package);
+		VERIFY_OK(read);
+		QCOMPARE(std::get<PkgInfo>(read), info);
+		QVERIFY(Failed(ReadPackageMember(package, "usr/bin/tool")));
+		QVERIFY(Failed(ListPackage(package)));
+	}
+
+	void compressionBudgetPicksTheLevel()
+	{
+		QByteArray sample;
+		for (int i = 0; i < 40000; ++i)
+		{
+			sample += QByteArray::number(i * 7919 % 10007) + ' ';
+		}
+		CompressionBudget budget;
+		budget.levels = {1, 3, 9};
+
+		// A ratio the first level reaches ends the trials there.
+		budget.targetRatio = 1.5;
+		auto decision = ChooseCompression(sample, sample.size(), 0, budget, 19);
+		QCOMPARE(decision.level, 1);
+		QCOMPARE(decision.trials.size(), 1);
+		QVERIFY(decision.ratio >= 1.5);
+
+		// No level can compress a terabyte in a millisecond, and the first
+		// is kept anyway.
+		budget.targetRatio = 0;
+		budget.timeMs = 1;
+		decision = ChooseCompression(sample, qint64(1) << 40, 0, budget, 19);
+		QCOMPARE(decision.level, 1);
+		QCOMPARE(decision.trials.size(), 2);
+
+		// An ample budget tries every level and keeps the last.
+		budget.timeMs = 1000000;
+		decision = ChooseCompression(sample, sample.size(), 0, budget, 19);
+		QCOMPARE(decision.level, 9);
+		QCOMPARE(decision.trials.size(), 3);
+		QCOMPARE(decision.windowLog, 0);
+
+		// Long mode covers the payload, or the frames it is cut into.
+		QCOMPARE(ChooseCompression(sample, 64 << 20, 0, budget, 19).windowLog, 26);
+		QCOMPARE(ChooseCompression(sample, qint64(1) << 32, 0, budget, 19).windowLog, 27);
+		QCOMPARE(ChooseCompression(sample, 64 << 20, 1 << 20, budget, 19).windowLog, 0);
+		budget.levels.clear();
+		QCOMPARE(ChooseCompression(sample, sample.size(), 0, budget, 19).level, 19);
+	}
+
+	void deltaRebuildsPackage()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+		QByteArray library;
+		for (int i = 0; i < 20000; ++i)
+		{
+			library += QByteArray::number(i * 7919 % 10007) + ' ';
+		}
+		auto changed = library;
+		changed.replace(5000, 10, "0123456789");
+		const auto package = [&dir](const QString &path, const QByteArray &pkginfo, const QByteArray &content) {
+			return WriteTar(dir.filePath("payload.tar"), {{TarEntry{.path = ".PKGINFO"}, pkginfo},
+														  {TarEntry{.path = "usr/lib/libtool.so"}, content}}) &&
+				   WriteZstd(path, ReadFile(dir.filePath("payload.tar")), 64 << 10);
+		};
+		const auto previous = dir.filePath("tool-1-1-x86_64.pkg.tar.zst");
+		const auto current = dir.filePath("tool-1-2-x86_64.pkg.tar.zst");
+		QVERIFY(package(previous, "pkgver = 1-1\n", library));
+		QVERIFY(package(current, "pkgver = 1-2\n", changed));
+		const auto header = [](const QByteArray &delta) {
+			return QJsonDocument::fromJson(delta.mid(12, qFromLittleEndian<quint32>(delta.constData() + 8))).object();
+		};
+
+		const auto delta = dir.filePath("tool-1-2.delta");
+		VERIFY_OK(WriteDelta(previous, current, delta));
+		QVERIFY(QFileInfo(delta).size() < QFileInfo(current).size());
+		QCOMPARE(header(ReadFile(delta))["frames"].toArray().first().toObject()["level"].toInt(), 3);
+		const auto output = dir.filePath("rebuilt.pkg.tar.zst");
+		VERIFY_OK(ApplyDelta(previous, delta, output));
+		QCOMPARE(ReadFile(output), ReadFile(current));
+
+		// Against the wrong base it refuses instead of writing a bad package.
+		QVERIFY(Failed(ApplyDelta(current, delta, dir.filePath("wrong.pkg.tar.zst"))));
+
+		// Once a frame defeats every candidate the rest are carried as they
+		// are, and still rebuild.
+		const auto raw = dir.filePath("raw.delta");
+		VERIFY_OK(WriteDelta(previous, current, raw, 19, {19}));
+		for (const auto &frame : header(ReadFile(raw))["frames"].toArray())
+		{
+			QVERIFY(frame.toObject().contains("raw"));
+		}
+		VERIFY_OK(ApplyDelta(previous, raw, output));
+		QCOMPARE(ReadFile(output), ReadFile(current));
+
+		// A payload other than the frames its header lists is refused.
+		const auto written = ReadFile(delta);
+		auto tampered = header(written);
+		tampered["frames"] = QJsonArray{QJsonObject{{"raw", 1}}};
+		const auto json = QJsonDocument(tampered).toJson(QJsonDocument::Compact);
+		QByteArray size(4, Qt::Uninitialized);
+		qToLittleEndian<quint32>(json.size(), size.data());
+		const auto payload = written.mid(12 + qFromLittleEndian<quint32>(written.constData() + 8));
+		QVERIFY(WriteFile(dir.filePath("tampered.delta"), QByteArray(DeltaMagic) + size + json + payload));
+		const auto refused = ApplyDelta(previous, dir.filePath("tampered.delta"), dir.filePath("tampered.pkg"));
+		QVERIFY(Failed(refused));
+		QVERIFY(std::get<Error>(refused).message.contains("corrupt payload"));
+		QVERIFY(!QFileInfo::exists(dir.filePath("tampered.pkg")));
+	}
+};
+
+QTEST_GUILESS_MAIN(Tests)
+#include "tests.moc"
@@ -0,0 +1,420 @@
+#pragma once
+
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QRegularExpression>
+#include <QSet>
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QtConcurrent>
+
+#include <functional>
+#include <memory>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "spec.h"
+
+// What each spec provides and build-requires, kept up to date one spec at a
+// time so a change never needs a rescan.
+class SpecGraph
+{
+	QHash<QString, QStringList> provides;
+	QHash<QString, QStringList> buildRequires;
+	QHash<QString, QSet<QString>> providers;
+	QHash<QString, QSet<QString>> includers;
+
+	static auto Names(const QString &value) -> QStringList
+	{
+		static const QRegularExpression separator(R"([\s,]+)");
+		static const QRegularExpression version(R"(^[<>=])");
+		QStringList ret;
+		auto skip = false;
+		for (const auto &word : value.split(separator, Qt::SkipEmptyParts))
+		{
+			// "foo >= 1.0, bar" lists names, each optionally with a version.
+			if (skip)
+			{
+				skip = false;
+			}
+			else if (version.match(word).hasMatch())
+			{
+				skip = true;
+			}
+			else
+			{
+				ret << word;
+			}
+		}
+		return ret;
+	}
+
+public:
+	auto Remove(const QString &path) -> void
+	{
+		for (const auto &name : provides.take(path))
+		{
+			providers[name].remove(path);
+		}
+		buildRequires.remove(path);
+		for (auto &specs : includers)
+		{
+			specs.remove(path);
+		}
+	}
+
+	auto Update(const QString &path, const Spec &spec) -> void
+	{
+		Remove(path);
+		QStringList provided;
+		QStringList required;
+		for (const auto &section : spec.sections)
+		{
+			if (section.name == "package" && !section.arguments.isEmpty())
+			{
+				const auto arguments = section.arguments.split(' ');
+				provided << (arguments.first() == "-n" && arguments.size() > 1
+								 ? arguments[1]
+								 : ExpandMacros("%{name}-", spec.macros) + arguments.first());
+			}
+			for (const auto &tag : section.tags)
+			{
+				const auto name = tag.name.toLower();
+				if (name == "name")
+				{
+					provided << tag.value.trimmed();
+				}
+				else if (name == "provides")
+				{
+					provided << Names(tag.value);
+				}
+				else if (name == "buildrequires")
+				{
+					required << Names(tag.value);
+				}
+			}
+		}
+		provided.removeDuplicates();
+		required.removeDuplicates();
+		for (const auto &name : provided)
+		{
+			providers[name].insert(path);
+		}
+		provides[path] = provided;
+		buildRequires[path] = required;
+		for (const auto &include : spec.includes)
+		{
+			includers[include].insert(path);
+		}
+	}
+
+	// Specs that %include the file.
+	auto Includers(const QString &file) const -> QSet<QString> { return includers.value(file); }
+
+	// Specs that build-require something the spec provides.
+	auto Dependents(const QString &path) const -> QStringList
+	{
+		QStringList ret;
+		const auto provided = provides.value(path);
+		for (auto it = buildRequires.cbegin(); it != buildRequires.cend(); ++it)
+		{
+			for (const auto &name : provided)
+			{
+				if (it.value().contains(name))
+				{
+					ret << it.key();
+					break;
+				}
+			}
+		}
+		return ret;
+	}
+
+	auto Contains(const QString &path) const -> bool { return provides.contains(path); }
+
+	// Specs, and files specs include, under the directory.
+	auto Under(const QString &directory) const -> QStringList
+	{
+		const auto prefix = directory + "/";
+		QStringList ret;
+		for (auto it = provides.cbegin(); it != provides.cend(); ++it)
+		{
+			if (it.key().startsWith(prefix))
+			{
+				ret << it.key();
+			}
+		}
+		for (auto it = includers.cbegin(); it != includers.cend(); ++it)
+		{
+			if (it.key().startsWith(prefix) && !it.value().isEmpty())
+			{
+				ret << it.key();
+			}
+		}
+		return ret;
+	}
+};
+
+// Follows a spec tree with inotify. Bursts of events (editors write, rename
+// and chmod for a single save) are coalesced for `delay` ms, then only the
+// changed specs and the specs that %include changed files are reparsed. When
+// the kernel's event queue overflows the whole tree is checked again.
+class SpecWatcher
+{
+	SpecIndex &specs;
+	std::function<void(const QJsonObject &)> notify;
+	SpecGraph graph;
+	QString root;
+	int fd = -1;
+	std::unique_ptr<QSocketNotifier> notifier;
+	QHash<int, QString> directories;
+	QSet<QString> changed;
+	QTimer debounce;
+
+	static constexpr auto Mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE |
+								 IN_DELETE_SELF | IN_ONLYDIR;
+
+	auto AddDirectory(const QString &path) -> void
+	{
+		const auto wd = ::inotify_add_watch(fd, QFile::encodeName(path).constData(), Mask);
+		if (wd >= 0)
+		{
+			directories[wd] = path;
+		}
+	}
+
+	auto AddTree(const QString &root) -> QStringList
+	{
+		QStringList found;
+		AddDirectory(root);
+		QDirIterator it(root, QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot | QDir::Hidden,
+						QDirIterator::Subdirectories);
+		while (it.hasNext())
+		{
+			const auto path = it.next();
+			if (it.fileInfo().isDir() && !it.fileInfo().isSymLink())
+			{
+				AddDirectory(path);
+			}
+			else if (path.endsWith(".spec"))
+			{
+				found << path;
+			}
+		}
+		return found;
+	}
+
+	// A directory was deleted or moved away: its watches go, and its specs
+	// and the specs including its files are queued, to be reported removed or
+	// reparsed.
+	auto Forget(const QString &directory) -> void
+	{
+		const auto prefix = directory + "/";
+		for (auto it = directories.begin(); it != directories.end();)
+		{
+			if (it.value() == directory || it.value().startsWith(prefix))
+			{
+				::inotify_rm_watch(fd, it.key());
+				it = directories.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		for (const auto &path : graph.Under(directory))
+		{
+			changed.insert(path);
+		}
+		specs.InvalidateTree(directory);
+	}
+
+	// Events were dropped, so neither the watches nor the index can be
+	// trusted: watches of directories that are gone are removed, new
+	// directories are watched, and every spec is reparsed or reported removed.
+	auto Rescan() -> void
+	{
+		for (auto it = directories.begin(); it != directories.end();)
+		{
+			if (!QFileInfo(it.value()).isDir())
+			{
+				::inotify_rm_watch(fd, it.key());
+				it = directories.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+		specs.InvalidateTree(root);
+		for (const auto &path : graph.Under(root))
+		{
+			changed.insert(path);
+		}
+		for (const auto &spec : AddTree(root))
+		{
+			changed.insert(spec);
+		}
+	}
+
+	auto ReadEvents() -> void
+	{
+		alignas(struct inotify_event) char buffer[64 << 10];
+		ssize_t got;
+		auto overflowed = false;
+		while ((got = ::read(fd, buffer, sizeof buffer)) > 0)
+		{
+			for (auto at = buffer; at < buffer + got;)
+			{
+				const auto event = reinterpret_cast<const struct inotify_event *>(at);
+				at += sizeof(struct inotify_event) + event->len;
+				if (event->mask & IN_Q_OVERFLOW)
+				{
+					overflowed = true;
+					continue;
+				}
+				if (event->mask & IN_IGNORED)
+				{
+					directories.remove(event->wd);
+					continue;
+				}
+				const auto directory = directories.value(event->wd);
+				if (directory.isEmpty() || event->len == 0)
+				{
+					continue;
+				}
+				const auto path = directory + "/" + QFile::decodeName(event->name);
+				if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+				{
+					// Files may already be in a directory moved or created
+					// before its watch was added.
+					for (const auto &spec : AddTree(path))
+					{
+						changed.insert(spec);
+					}
+					continue;
+				}
+				if ((event->mask & IN_ISDIR) && (event->mask & (IN_DELETE | IN_MOVED_FROM)))
+				{
+					Forget(path);
+					continue;
+				}
+				changed.insert(path);
+			}
+		}
+		if (overflowed)
+		{
+			Rescan();
+		}
+		if (!changed.isEmpty())
+		{
+			debounce.start();
+		}
+	}
+
+	auto Reindex() -> void
+	{
+		QSet<QString> affected;
+		for (const auto &path : std::as_const(changed))
+		{
+			if (path.endsWith(".spec"))
+			{
+				affected.insert(path);
+			}
+			affected.unite(graph.Includers(path));
+		}
+		changed.clear();
+
+		const QStringList paths(affected.begin(), affected.end());
+		for (const auto &path : paths)
+		{
+			specs.Invalidate(path);
+		}
+		const auto parsed = QtConcurrent::blockingMapped<QList<Fallible<std::shared_ptr<const Spec>>>>(
+			paths, [this](const QString &path) { return specs.Get(path); });
+
+		for (qsizetype i = 0; i < paths.size(); ++i)
+		{
+			const auto &path = paths[i];
+			if (!QFileInfo::exists(path))
+			{
+				const auto dependents = graph.Dependents(path);
+				graph.Remove(path);
+				notify(QJsonObject{
+					{"event", "removed"},
+					{"path", path},
+					{"dependents", QJsonArray::fromStringList(dependents)},
+				});
+			}
+			else if (Failed(parsed[i]))
+			{
+				notify(QJsonObject{
+					{"event", "error"},
+					{"path", path},
+					{"error", std::get<Error>(parsed[i]).message},
+				});
+			}
+			else
+			{
+				const auto &spec = *std::get<std::shared_ptr<const Spec>>(parsed[i]);
+				graph.Update(path, spec);
+				notify(QJsonObject{
+					{"event", "changed"},
+					{"path", path},
+					{"hash", QString::fromLatin1(spec.semanticHash)},
+					{"dependents", QJsonArray::fromStringList(graph.Dependents(path))},
+				});
+			}
+		}
+	}
+
+public:
+	SpecWatcher(SpecIndex &specs, std::function<void(const QJsonObject &)> notify, int delay = 100)
+		: specs(specs), notify(notify)
+	{
+		debounce.setSingleShot(true);
+		debounce.setInterval(delay);
+		QObject::connect(&debounce, &QTimer::timeout, &debounce, [this] { Reindex(); });
+	}
+	~SpecWatcher()
+	{
+		notifier.reset();
+		if (fd >= 0)
+		{
+			::close(fd);
+		}
+	}
+	SpecWatcher(const SpecWatcher &) = delete;
+	SpecWatcher &operator=(const SpecWatcher &) = delete;
+
+	// Indexes every spec under directory and starts following changes.
+	auto Watch(const QString &directory) -> Fallible<>
+	{
+		fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0)
+		{
+			return Error{QString("cannot initialize inotify: %1").arg(qt_error_string(errno))};
+		}
+		notifier = std::make_unique<QSocketNotifier>(fd, QSocketNotifier::Read);
+		QObject::connect(notifier.get(), &QSocketNotifier::activated, notifier.get(), [this] { ReadEvents(); });
+
+		root = QFileInfo(directory).absoluteFilePath();
+		const auto found = AddTree(root);
+		const auto parsed = QtConcurrent::blockingMapped<QList<Fallible<std::shared_ptr<const Spec>>>>(
+			found, [this](const QString &path) { return specs.Get(path); });
+		for (qsizetype i = 0; i < found.size(); ++i)
+		{
+			if (!Failed(parsed[i]))
+			{
+				graph.Update(found[i], *std::get<std::shared_ptr<const Spec>>(parsed[i]));
+			}
+		}
+		return std::monostate{};
+	}
+
+	auto Graph() const -> const SpecGraph & { return graph; }
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QList>
+#include <QString>
+#include <QtEndian>
+
+#include <optional>
+#include <zstd.h>
+
+// The zstd seekable format: a skippable frame at the end of the file lists
+// the compressed and decompressed size of every frame before it, so readers
+// can find any frame from the footer instead of walking the whole stream.
+constexpr quint32 ZstdSeekTableMagic = 0x184D2A5E;
+constexpr quint32 ZstdSeekableMagic = 0x8F92EAB1;
+
+struct ZstdSeekEntry
+{
+	quint32 compressedSize;
+	quint32 decompressedSize;
+};
+
+// Entries are written without checksums; the frames carry their own.
+auto ZstdSeekTable(const QList<ZstdSeekEntry> &frames) -> QByteArray
+{
+	QByteArray ret(8 + frames.size() * 8 + 9, Qt::Uninitialized);
+	auto at = reinterpret_cast<uchar *>(ret.data());
+	qToLittleEndian<quint32>(ZstdSeekTableMagic, at);
+	qToLittleEndian<quint32>(ret.size() - 8, at + 4);
+	at += 8;
+	for (const auto &frame : frames)
+	{
+		qToLittleEndian<quint32>(frame.compressedSize, at);
+		qToLittleEndian<quint32>(frame.decompressedSize, at + 4);
+		at += 8;
+	}
+	qToLittleEndian<quint32>(frames.size(), at);
+	at[4] = 0;
+	qToLittleEndian<quint32>(ZstdSeekableMagic, at + 5);
+	return ret;
+}
+
+// The frames listed by a seek table at the end of data, or nothing when there
+// is none or it does not add up to the rest of the file.
+auto ReadZstdSeekTable(const uchar *data, size_t size) -> std::optional<QList<ZstdSeekEntry>>
+{
+	if (size < 17 || qFromLittleEndian<quint32>(data + size - 4) != ZstdSeekableMagic)
+	{
+		return std::nullopt;
+	}
+	const auto count = qFromLittleEndian<quint32>(data + size - 9);
+	const auto descriptor = data[size - 5];
+	const size_t entrySize = descriptor & 0x80 ? 12 : 8;
+	const auto tableSize = 8 + count * entrySize + 9;
+	if ((descriptor & 0x7c) != 0 || tableSize > size)
+	{
+		return std::nullopt;
+	}
+	const auto table = data + size - tableSize;
+	if (qFromLittleEndian<quint32>(table) != ZstdSeekTableMagic ||
+		qFromLittleEndian<quint32>(table + 4) != tableSize - 8)
+	{
+		return std::nullopt;
+	}
+	QList<ZstdSeekEntry> frames;
+	frames.reserve(count);
+	size_t total = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const auto entry = table + 8 + i * entrySize;
+		frames << ZstdSeekEntry{qFromLittleEndian<quint32>(entry), qFromLittleEndian<quint32>(entry + 4)};
+		total += frames.last().compressedSize;
+	}
+	if (total != size - tableSize)
+	{
+		return std::nullopt;
+	}
+	return frames;
+}
+
+class ZstdWriter
+{
+	QIODevice &out;
+	ZSTD_CCtx *cctx;
+	QByteArray buffer;
+	QString error;
+	qint64 frameSize;
+	qint64 frameIn = 0;
+	qint64 frameOut = 0;
+	QList<ZstdSeekEntry> frames;
+
+	auto Drive(ZSTD_inBuffer &input, ZSTD_EndDirective mode) -> bool
+	{
+		bool finished = false;
+		do
+		{
+			ZSTD_outBuffer output{buffer.data(), size_t(buffer.size()), 0};
+			const auto remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+			if (ZSTD_isError(remaining))
+			{
+				error = ZSTD_getErrorName(remaining);
+				return false;
+			}
+			if (out.write(buffer.constData(), output.pos) != qint64(output.pos))
+			{
+				error = out.errorString();
+				return false;
+			}
+			frameOut += output.pos;
+			finished = mode == ZSTD_e_continue ? input.pos == input.size : remaining == 0;
+		} while (!finished);
+		return true;
+	}
+
+	auto Continue(const char *data, qint64 size) -> bool
+	{
+		ZSTD_inBuffer input{data, size_t(size), 0};
+		frameIn += size;
+		return Drive(input, ZSTD_e_continue);
+	}
+
+public:
+	// With a frameSize, every frameSize input bytes end a frame, which
+	// WriteSeekTable() can then index; zero makes frames end only at
+	// EndFrame(). Frames must stay below 4 GiB either way to be indexed.
+	ZstdWriter(QIODevice &out, int level, int workers = 0, qint64 frameSize = 0)
+		: out(out), cctx(ZSTD_createCCtx()), buffer(ZSTD_CStreamOutSize(), Qt::Uninitialized),
+		  frameSize(qBound<qint64>(0, frameSize, 1 << 30))
+	{
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+		if (workers > 0)
+		{
+			ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, workers);
+		}
+	}
+	~ZstdWriter() { ZSTD_freeCCtx(cctx); }
+	ZstdWriter(const ZstdWriter &) = delete;
+	ZstdWriter &operator=(const ZstdWriter &) = delete;
+
+	// Long-distance matching over 2^windowLog bytes, before the first Write().
+	// Decoders need to be told to allow windows beyond 2^27.
+	auto SetLongWindow(int windowLog) -> void
+	{
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, windowLog);
+	}
+	auto Write(const char *data, qint64 size) -> bool
+	{
+		if (frameSize == 0)
+		{
+			return Continue(data, size);
+		}
+		while (size > 0)
+		{
+			const auto step = qMin(size, frameSize - frameIn);
+			if (!Continue(data, step) || (frameIn == frameSize && !EndFrame()))
+			{
+				return false;
+			}
+			data += step;
+			size -= step;
+		}
+		return true;
+	}
+	auto EndFrame() -> bool
+	{
+		if (frameIn == 0 && !frames.isEmpty())
+		{
+			return true;
+		}
+		ZSTD_inBuffer input{nullptr, 0, 0};
+		if (!Drive(input, ZSTD_e_end))
+		{
+			return false;
+		}
+		frames << ZstdSeekEntry{quint32(frameOut), quint32(frameIn)};
+		frameIn = 0;
+		frameOut = 0;
+		return true;
+	}
+	// The frames ended so far, for a seek table covering more than this writer.
+	auto Frames() const -> QList<ZstdSeekEntry> { return frames; }
+	auto WriteSeekTable() -> bool
+	{
+		const auto table = ZstdSeekTable(frames);
+		if (out.write(table) != table.size())
+		{
+			error = out.errorString();
+			return false;
+		}
+		return true;
+	}
+	auto ErrorString() const -> QString { return error; }
+};